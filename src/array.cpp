@@ -28,19 +28,36 @@ SOFTWARE.
 
 #define MAJOR   (INT) 1
 #define MINOR   (INT) 0
-#define MICRO   (INT) 3
+#define MICRO   (INT) 7
 
 const char *arrayHelp[] = {
   "Array library:",
   "  {initial} {count} {name} create array::()  - create an array called {name} with {count} elements,",
   "                                               starting from index 0, with {initial} value",
   "  {value} {name} scooch array::()            - add {value} to the beginning of the array and shuffle all",
-  "                                               the other values along. only useable with an array",
-  "                                               created with create array::()",
+  "                                               the other values along, dropping the last one. only",
+  "                                               useable with an array created with create array::()",
   "  {index} {name} get array::()               - get the array element {index}",
   "                                               If the element exists it pushes the value then true,",
   "                                               otherwise it pushes false.",
   "  {index} {name} {value} set array::()       - set the element {index} to {value}",
+  "  {type} {count} {name} typed array::()      - create a typed array called {name} with {count} elements",
+  "                                               set to 0. {type} is int64 or \"double\". Typed arrays hold",
+  "                                               numbers only and are used with get, set and these",
+  "  {value} {name} fill array::()              - set every element to {value}",
+  "  {src} {dst} copy array::()                 - copy the elements of {src} to {dst}",
+  "  {src} {dst} add array::()                  - add each element of {src} to the same element of {dst}",
+  "  {factor} {name} scale array::()            - multiply every element by {factor}, truncating for int64",
+  "  {name} sum array::()                       - sum of the elements",
+  "  {name} min array::()                       - smallest element",
+  "  {name} max array::()                       - largest element",
+  "  {a} {b} dot array::()                      - dot product of {a} and {b}",
+  "                                               Where two arrays differ in length only the elements",
+  "                                               they have in common are used.",
+  "  {name} sort array::()                      - sort the array into ascending order, numbers before",
+  "                                               strings. large arrays are sorted using several threads",
+  "  {name} {compare} sortby array::()          - sort the array using the code {compare}, which is given",
+  "                                               two elements and leaves true if the first goes first",
   "  major version:: array::                    - major version number",
   "  minor version:: array::                    - minor version number",
   "  micro version:: array::                    - micro version number",
@@ -78,6 +95,127 @@ class ArraySet : public Operation {
     OperatorReturn action(ExecutionEnvironment *);
 };
 
+// An array made by create array::() keeps its elements in one block of variables,
+// used as a ring so scooch only has to move the start. Element i is found by its
+// index rather than by name, and the array resolves the names i.value {name}::
+// to its elements, which keep out of the btree.
+
+class DenseArray {
+  public:
+    DenseArray(const char *, INT, Object *);
+    ~DenseArray();
+    const char *getName();
+    INT getCount();
+    Variable *getElement(INT);
+    void scooch(Object *);
+    DenseArray *next;
+
+  private:
+    char *name;
+    char *elementName;
+    Variable *elements;
+    INT count;
+    INT start;
+};
+
+// A typed array holds the values themselves, packed together, rather than a
+// number object for each. The kernels are plain loops over them, which the
+// compiler vectorises.
+
+class TypedArray {
+  public:
+    TypedArray(const char *, bool, INT);
+    ~TypedArray();
+    const char *getName();
+    bool isInt();
+    INT getCount();
+    INT *getInts();
+    double *getDoubles();
+    Number *getNumber(INT, Cache *);
+    bool setNumber(INT, Number *);
+    TypedArray *next;
+
+  private:
+    char *name;
+    bool intRep;
+    INT count;
+    union {
+      INT *ints;
+      double *doubles;
+    };
+};
+
+#define KERNEL_FILL   1
+#define KERNEL_COPY   2
+#define KERNEL_ADD    3
+#define KERNEL_SCALE  4
+#define KERNEL_SUM    5
+#define KERNEL_MIN    6
+#define KERNEL_MAX    7
+#define KERNEL_DOT    8
+
+class ArrayTyped : public Operation {
+  public:
+    ArrayTyped(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class ArrayKernel : public Operation {
+  public:
+    ArrayKernel(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int kernel;
+    TypedArray *getTypedArray(Object *, ExecutionEnvironment *);
+};
+
+// Sorting. Arrays are sorted by introsort, or radix sort for typed arrays, and
+// large ones are split into a part for each processor, sorted in their own
+// threads, then merged. Sorting with a compare code fragment uses a merge sort,
+// which is stable, in the calling thread.
+
+#define INSERTION_SORT_MAX    16
+#define RADIX_SORT_MIN        256
+#define PARALLEL_SORT_MIN     65536
+#define PARALLEL_SORT_THREADS 16
+
+#define SORT_INT      0
+#define SORT_DOUBLE   1
+#define SORT_STRING   2
+
+class SortItem {
+  public:
+    Object *object;
+    const char *str;
+    double d;
+    INT i;
+    int kind;
+};
+
+class ArraySort : public Operation {
+  public:
+    ArraySort(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class ArraySortBy : public Operation {
+  public:
+    ArraySortBy(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class ArrayResolver : public VariableResolver {
+  public:
+    Variable *resolve(const char *);
+};
+
+#define ARRAY_TABLE_SIZE  256
+
+DenseArray *arrayTable[ARRAY_TABLE_SIZE];
+TypedArray *typedTable[ARRAY_TABLE_SIZE];
+pthread_mutex_t arrayMutex = PTHREAD_MUTEX_INITIALIZER;
+
 char arrayMessage[2014];
 
 extern "C" void slmain() {
@@ -134,6 +272,411 @@ extern "C" void slmain() {
   v = new Variable("/set/array");
   v->setObject(new Code(ol, &mainEE.cache));
   btree.addVariable(v);
+
+  // typed array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayTyped((LexInfo *) 0));
+  v = new Variable("/typed/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // fill array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_FILL, (LexInfo *) 0));
+  v = new Variable("/fill/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // copy array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_COPY, (LexInfo *) 0));
+  v = new Variable("/copy/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // add array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_ADD, (LexInfo *) 0));
+  v = new Variable("/add/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // scale array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_SCALE, (LexInfo *) 0));
+  v = new Variable("/scale/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // sum array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_SUM, (LexInfo *) 0));
+  v = new Variable("/sum/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // min array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_MIN, (LexInfo *) 0));
+  v = new Variable("/min/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // max array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_MAX, (LexInfo *) 0));
+  v = new Variable("/max/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // dot array::
+  ol = new OperationList;
+  ol->addOperation(new ArrayKernel(KERNEL_DOT, (LexInfo *) 0));
+  v = new Variable("/dot/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // sort array::
+  ol = new OperationList;
+  ol->addOperation(new ArraySort((LexInfo *) 0));
+  v = new Variable("/sort/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // sortby array::
+  ol = new OperationList;
+  ol->addOperation(new ArraySortBy((LexInfo *) 0));
+  v = new Variable("/sortby/array");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  btree.addResolver(new ArrayResolver);
+}
+
+static unsigned long arrayHash(const char *n) {
+  unsigned long h;
+
+  for(h = 5381; *n != 0; n++) h = h * 33 + (unsigned char) *n;
+
+  return h % ARRAY_TABLE_SIZE;
+}
+
+static DenseArray *findArray(const char *n) {
+  DenseArray *a;
+
+  for(a = __atomic_load_n(&arrayTable[arrayHash(n)], __ATOMIC_ACQUIRE); a != (DenseArray *) 0; a = a->next) {
+    if(strcmp(n, a->getName()) == 0) return a;
+  }
+
+  return (DenseArray *) 0;
+}
+
+static TypedArray *findTypedArray(const char *n) {
+  TypedArray *t;
+
+  for(t = __atomic_load_n(&typedTable[arrayHash(n)], __ATOMIC_ACQUIRE); t != (TypedArray *) 0; t = t->next) {
+    if(strcmp(n, t->getName()) == 0) return t;
+  }
+
+  return (TypedArray *) 0;
+}
+
+// Returns false if there's already an array with this name.
+static bool addArray(DenseArray *a) {
+  unsigned long h;
+  bool ret;
+
+  if(useMutex) pthread_mutex_lock(&arrayMutex);
+  ret = (findArray(a->getName()) == (DenseArray *) 0) && (findTypedArray(a->getName()) == (TypedArray *) 0);
+  if(ret) {
+    h = arrayHash(a->getName());
+    a->next = arrayTable[h];
+    __atomic_store_n(&arrayTable[h], a, __ATOMIC_RELEASE);
+  }
+  if(useMutex) pthread_mutex_unlock(&arrayMutex);
+
+  return ret;
+}
+
+static bool addTypedArray(TypedArray *t) {
+  unsigned long h;
+  bool ret;
+
+  if(useMutex) pthread_mutex_lock(&arrayMutex);
+  ret = (findArray(t->getName()) == (DenseArray *) 0) && (findTypedArray(t->getName()) == (TypedArray *) 0);
+  if(ret) {
+    h = arrayHash(t->getName());
+    t->next = typedTable[h];
+    __atomic_store_n(&typedTable[h], t, __ATOMIC_RELEASE);
+  }
+  if(useMutex) pthread_mutex_unlock(&arrayMutex);
+
+  return ret;
+}
+
+// Other libraries, eg graph, read and write typed arrays through this, found
+// with dlsym(). It returns the elements of the typed array {name} and sets
+// {count}. If there's no such array and {create} is above zero one is made with
+// that many elements. Null if there's no array, or it holds the wrong type.
+extern "C" void *typedArrayElements(const char *name, bool intRep, INT create, INT *count) {
+  TypedArray *t;
+
+  if((t = findTypedArray(name)) == (TypedArray *) 0) {
+    if(create <= 0) return (void *) 0;
+    t = new TypedArray(name, intRep, create);
+    if(! addTypedArray(t)) {
+      delete t;
+      if((t = findTypedArray(name)) == (TypedArray *) 0) return (void *) 0;
+    }
+  }
+
+  if(t->isInt() != intRep) return (void *) 0;
+  *count = t->getCount();
+
+  return (intRep ? (void *) t->getInts() : (void *) t->getDoubles());
+}
+
+DenseArray::DenseArray(const char *n, INT c, Object *value) : next((DenseArray *) 0), count(c), start(0) {
+  INT i;
+
+  if((name = (char *) malloc(strlen(n) + 1)) == (char *) 0) slexception.chuck("malloc failed", (LexInfo *) 0);
+  strcpy(name, n);
+
+  // The elements share a name, it's only there to mark them as namespace variables.
+  if((elementName = (char *) malloc(strlen(n) + 4)) == (char *) 0) slexception.chuck("malloc failed", (LexInfo *) 0);
+  sprintf(elementName, "/$/%s", n);
+
+  elements = new Variable[count];
+  for(i = 0; i < count; i++) {
+    elements[i].setName(elementName);
+    elements[i].setObject(value);
+  }
+}
+
+// The elements share elementName, so they let go of it before they're deleted.
+DenseArray::~DenseArray() {
+  INT i;
+
+  for(i = 0; i < count; i++) {
+    elements[i].unsetObject();
+    elements[i].setName((char *) 0);
+  }
+  delete [] elements;
+  free(elementName);
+  free(name);
+}
+
+const char *DenseArray::getName() {
+  return name;
+}
+
+INT DenseArray::getCount() {
+  return count;
+}
+
+// scooch moves start, so it's read under the same lock.
+Variable *DenseArray::getElement(INT i) {
+  INT s;
+
+  if((i < 0) || (i >= count)) return (Variable *) 0;
+  if(useMutex) pthread_mutex_lock(&arrayMutex);
+  s = start;
+  if(useMutex) pthread_mutex_unlock(&arrayMutex);
+  i += s;
+  if(i >= count) i -= count;
+  return &elements[i];
+}
+
+// Element 0 becomes the value, and the last element drops off the end.
+void DenseArray::scooch(Object *value) {
+  if(useMutex) pthread_mutex_lock(&arrayMutex);
+  start = (start == 0 ? count - 1 : start - 1);
+  elements[start].setObject(value);
+  if(useMutex) pthread_mutex_unlock(&arrayMutex);
+}
+
+TypedArray::TypedArray(const char *n, bool ir, INT c) : next((TypedArray *) 0), intRep(ir), count(c) {
+  void *p;
+
+  if((name = (char *) malloc(strlen(n) + 1)) == (char *) 0) slexception.chuck("malloc failed", (LexInfo *) 0);
+  strcpy(name, n);
+
+  // Cache line aligned, which suits the vector loads.
+  if(posix_memalign(&p, 64, count * (intRep ? sizeof(INT) : sizeof(double))) != 0) slexception.chuck("malloc failed", (LexInfo *) 0);
+  memset(p, 0, count * (intRep ? sizeof(INT) : sizeof(double)));
+  if(intRep) ints = (INT *) p;
+  else doubles = (double *) p;
+}
+
+TypedArray::~TypedArray() {
+  free(name);
+  if(intRep) free(ints);
+  else free(doubles);
+}
+
+const char *TypedArray::getName() { return name; }
+bool TypedArray::isInt() { return intRep; }
+INT TypedArray::getCount() { return count; }
+INT *TypedArray::getInts() { return ints; }
+double *TypedArray::getDoubles() { return doubles; }
+
+Number *TypedArray::getNumber(INT i, Cache *c) {
+  if((i < 0) || (i >= count)) return (Number *) 0;
+  if(intRep) return c->newNumber(ints[i]);
+  return c->newNumber(doubles[i]);
+}
+
+bool TypedArray::setNumber(INT i, Number *n) {
+  if((i < 0) || (i >= count)) return false;
+  if(intRep) ints[i] = n->getInt();
+  else doubles[i] = n->getDouble();
+  return true;
+}
+
+// The kernels. The double reductions keep four running totals so the additions
+// needn't happen in order, which is what lets them vectorise.
+
+static void fillInts(INT *a, INT n, INT v) {
+  INT i;
+
+  for(i = 0; i < n; i++) a[i] = v;
+}
+
+static void fillDoubles(double *a, INT n, double v) {
+  INT i;
+
+  for(i = 0; i < n; i++) a[i] = v;
+}
+
+static void addInts(INT *__restrict__ d, const INT *__restrict__ s, INT n) {
+  INT i;
+
+  for(i = 0; i < n; i++) d[i] += s[i];
+}
+
+static void addDoubles(double *__restrict__ d, const double *__restrict__ s, INT n) {
+  INT i;
+
+  for(i = 0; i < n; i++) d[i] += s[i];
+}
+
+static void scaleInts(INT *a, INT n, INT f) {
+  INT i;
+
+  for(i = 0; i < n; i++) a[i] *= f;
+}
+
+static void scaleDoubles(double *a, INT n, double f) {
+  INT i;
+
+  for(i = 0; i < n; i++) a[i] *= f;
+}
+
+static INT sumInts(const INT *a, INT n) {
+  INT s;
+  INT i;
+
+  for(s = 0, i = 0; i < n; i++) s += a[i];
+
+  return s;
+}
+
+static double sumDoubles(const double *a, INT n) {
+  double s0, s1, s2, s3;
+  INT i;
+
+  s0 = s1 = s2 = s3 = 0.0;
+  for(i = 0; i + 4 <= n; i += 4) {
+    s0 += a[i];
+    s1 += a[i + 1];
+    s2 += a[i + 2];
+    s3 += a[i + 3];
+  }
+  for(; i < n; i++) s0 += a[i];
+
+  return (s0 + s1) + (s2 + s3);
+}
+
+static INT minInts(const INT *a, INT n) {
+  INT m;
+  INT i;
+
+  for(m = a[0], i = 1; i < n; i++) m = (a[i] < m ? a[i] : m);
+
+  return m;
+}
+
+static double minDoubles(const double *a, INT n) {
+  double m;
+  INT i;
+
+  for(m = a[0], i = 1; i < n; i++) m = (a[i] < m ? a[i] : m);
+
+  return m;
+}
+
+static INT maxInts(const INT *a, INT n) {
+  INT m;
+  INT i;
+
+  for(m = a[0], i = 1; i < n; i++) m = (a[i] > m ? a[i] : m);
+
+  return m;
+}
+
+static double maxDoubles(const double *a, INT n) {
+  double m;
+  INT i;
+
+  for(m = a[0], i = 1; i < n; i++) m = (a[i] > m ? a[i] : m);
+
+  return m;
+}
+
+static INT dotInts(const INT *a, const INT *b, INT n) {
+  INT s;
+  INT i;
+
+  for(s = 0, i = 0; i < n; i++) s += a[i] * b[i];
+
+  return s;
+}
+
+static double dotDoubles(const double *a, const double *b, INT n) {
+  double s0, s1, s2, s3;
+  INT i;
+
+  s0 = s1 = s2 = s3 = 0.0;
+  for(i = 0; i + 4 <= n; i += 4) {
+    s0 += a[i] * b[i];
+    s1 += a[i + 1] * b[i + 1];
+    s2 += a[i + 2] * b[i + 2];
+    s3 += a[i + 3] * b[i + 3];
+  }
+  for(; i < n; i++) s0 += a[i] * b[i];
+
+  return (s0 + s1) + (s2 + s3);
+}
+
+// Element i of a typed array as a double, for mixing int64 and double arrays.
+static double typedDouble(TypedArray *t, INT i) {
+  return t->isInt() ? (double) t->getInts()[i] : t->getDoubles()[i];
+}
+
+// Names look like /{index}/{array}.
+Variable *ArrayResolver::resolve(const char *n) {
+  DenseArray *a;
+  const char *p;
+  INT i;
+
+  p = n + 1;
+  if((*p < '0') || (*p > '9') || ((*p == '0') && (p[1] != '/'))) return (Variable *) 0;
+  for(i = 0; (*p >= '0') && (*p <= '9'); p++) i = i * 10 + (*p - '0');
+  if(*p != '/') return (Variable *) 0;
+
+  if((a = findArray(p + 1)) == (DenseArray *) 0) return (Variable *) 0;
+
+  return a->getElement(i);
 }
 
 ArrayHelp::ArrayHelp(LexInfo *li) : Operation(li) { }
@@ -158,9 +701,9 @@ OperatorReturn ArrayCreate::action(ExecutionEnvironment *ee) {
   String *string;
   Number *s;
   Variable *v;
+  DenseArray *a;
   char buf[512];
   char *p;
-  int i;
   INT j;
   char element[1024];
   bool found;
@@ -208,22 +751,15 @@ OperatorReturn ArrayCreate::action(ExecutionEnvironment *ee) {
       sprintf(arrayMessage, "Name %s too long", buf);
       slexception.chuck(arrayMessage, getLexInfo());
     }
+    a = new DenseArray(buf, j, value);
+    if(! addArray(a)) {
+      delete a;
+      sprintf(arrayMessage, "Array %s already exists", buf);
+      slexception.chuck(arrayMessage, getLexInfo());
+    }
     v = new Variable(element);
     v->setObject(mainEE.cache.newNumber(j));
     btree.addVariable(v);
-    for(i = 0; i < j; i++) {
-      sprintf(element, "/%d/%s", i, buf);
-      if(strlen(element) > 63) {
-        sprintf(arrayMessage, "Name %s too long", buf);
-        slexception.chuck(arrayMessage, getLexInfo());
-      }
-      v = new Variable(element);
-      v->setObject(value);
-      if(! btree.addVariable(v)) {
-        sprintf(arrayMessage, "Name /%d/%s already exists", i, buf);
-        slexception.chuck(arrayMessage, getLexInfo());
-      }
-    }
   }
 
   s->release(getLexInfo());
@@ -241,6 +777,7 @@ OperatorReturn ArrayScooch::action(ExecutionEnvironment *ee) {
   Object *value;
   Name *arrayName;
   const char *n;
+  DenseArray *a;
   Variable *vc;
   Number *c;
   INT count;
@@ -256,6 +793,13 @@ OperatorReturn ArrayScooch::action(ExecutionEnvironment *ee) {
   arrayName = name->getName(getLexInfo(), ee);
   n = arrayName->getValue();
 
+  if((a = findArray(n)) != (DenseArray *) 0) {
+    a->scooch(value);
+    name->release(getLexInfo());
+    value->release(getLexInfo());
+    return or_continue;
+  }
+
   sprintf(element, "/_$/%s", n);
   if(strlen(element) > 63) {
     sprintf(arrayMessage, "Name %s too long", n);
@@ -317,6 +861,9 @@ OperatorReturn ArrayGet::action(ExecutionEnvironment *ee) {
   Name *arrayName;
   Number *indexNumber;
   String *indexString;
+  DenseArray *a;
+  TypedArray *t;
+  Number *n;
   Variable *v;
   Object *val;
   char buf[512];
@@ -329,11 +876,29 @@ OperatorReturn ArrayGet::action(ExecutionEnvironment *ee) {
 
   arrayName = array->getName(getLexInfo(), ee);
 
+  if((t = findTypedArray(arrayName->getValue())) != (TypedArray *) 0) {
+    indexNumber = index->getNumber(getLexInfo(), ee);
+    if((n = t->getNumber(indexNumber->getInt(), &ee->cache)) != (Number *) 0) {
+      ee->stack.push(n);
+      ee->stack.push(ee->cache.newNumber((INT) 1));
+    } else {
+      ee->stack.push(ee->cache.newNumber((INT) 0));
+    }
+    indexNumber->release(getLexInfo());
+    array->release(getLexInfo());
+    index->release(getLexInfo());
+    return or_continue;
+  }
+
+  a = findArray(arrayName->getValue());
+  v = (Variable *) 0;
+
   found = false;
 
   try {
     indexNumber = index->getNumber(getLexInfo(), ee);
     if(indexNumber->isInt()) {
+      if(a != (DenseArray *) 0) v = a->getElement(indexNumber->getInt());
       sprintf(fmt, "%%%sd", PCTD);
       sprintf(buf, fmt, indexNumber->getInt());
     } else {
@@ -354,15 +919,18 @@ OperatorReturn ArrayGet::action(ExecutionEnvironment *ee) {
 
   if(! found) slexception.chuck("Unknown index type", getLexInfo());
 
-  sprintf(element, "/%s/%s", buf, arrayName->getValue());
-  if(strlen(element) > 63) {
-    sprintf(arrayMessage, "Name %s too long", element);
-    slexception.chuck(arrayMessage, getLexInfo());
+  if(v == (Variable *) 0) {
+    sprintf(element, "/%s/%s", buf, arrayName->getValue());
+    if(strlen(element) > 63) {
+      sprintf(arrayMessage, "Name %s too long", element);
+      slexception.chuck(arrayMessage, getLexInfo());
+    }
+    v = btree.findVariable(element);
   }
-  v = btree.findVariable(element);
   if(v != (Variable *) 0) {
     val = v->getObject();
     if(val != (Object *) 0) {
+      val->hold();
       ee->stack.push(val);
       ee->stack.push(mainEE.cache.newNumber((INT) 1));
     } else {
@@ -387,6 +955,9 @@ OperatorReturn ArraySet::action(ExecutionEnvironment *ee) {
   Name *arrayName;
   Number *indexNumber;
   String *indexString;
+  DenseArray *a;
+  TypedArray *t;
+  Number *n;
   Variable *v;
   char buf[512];
   char element[1024];
@@ -399,11 +970,27 @@ OperatorReturn ArraySet::action(ExecutionEnvironment *ee) {
 
   arrayName = array->getName(getLexInfo(), ee);
 
+  if((t = findTypedArray(arrayName->getValue())) != (TypedArray *) 0) {
+    indexNumber = index->getNumber(getLexInfo(), ee);
+    n = value->getNumber(getLexInfo(), ee);
+    if(! t->setNumber(indexNumber->getInt(), n)) slexception.chuck("Index out of range", getLexInfo());
+    n->release(getLexInfo());
+    indexNumber->release(getLexInfo());
+    value->release(getLexInfo());
+    array->release(getLexInfo());
+    index->release(getLexInfo());
+    return or_continue;
+  }
+
+  a = findArray(arrayName->getValue());
+  v = (Variable *) 0;
+
   found = false;
 
   try {
     indexNumber = index->getNumber(getLexInfo(), ee);
     if(indexNumber->isInt()) {
+      if(a != (DenseArray *) 0) v = a->getElement(indexNumber->getInt());
       sprintf(fmt, "%%%sd", PCTD);
       sprintf(buf, fmt, indexNumber->getInt());
     } else {
@@ -424,15 +1011,17 @@ OperatorReturn ArraySet::action(ExecutionEnvironment *ee) {
 
   if(! found) slexception.chuck("Unknown index type", getLexInfo());
 
-  sprintf(element, "/%s/%s", buf, arrayName->getValue());
-  if(strlen(element) > 63) {
-    sprintf(arrayMessage, "Name %s too long", element);
-    slexception.chuck(arrayMessage, getLexInfo());
-  }
-  v = btree.findVariable(element);
   if(v == (Variable *) 0) {
-    v = new Variable(element);
-    btree.addVariable(v);
+    sprintf(element, "/%s/%s", buf, arrayName->getValue());
+    if(strlen(element) > 63) {
+      sprintf(arrayMessage, "Name %s too long", element);
+      slexception.chuck(arrayMessage, getLexInfo());
+    }
+    v = btree.findVariable(element);
+    if(v == (Variable *) 0) {
+      v = new Variable(element);
+      btree.addVariable(v);
+    }
   }
   v->setObject(value);
 
@@ -442,3 +1031,671 @@ OperatorReturn ArraySet::action(ExecutionEnvironment *ee) {
 
   return or_continue;
 }
+
+ArrayTyped::ArrayTyped(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ArrayTyped::action(ExecutionEnvironment *ee) {
+  Object *oname;
+  Object *size;
+  Object *type;
+  Number *s;
+  String *str;
+  Variable *v;
+  TypedArray *ta;
+  const char *n;
+  const char *t;
+  char element[1024];
+  bool intRep;
+  INT j;
+
+  oname = ee->stack.pop(getLexInfo());
+  size = ee->stack.pop(getLexInfo());
+  type = ee->stack.pop(getLexInfo());
+  s = size->getNumber(getLexInfo(), ee);
+  n = oname->getName(getLexInfo(), ee)->getValue();
+
+  // double is also an operator, so the type can be given as a string.
+  str = (String *) 0;
+  if(type->isName()) {
+    t = type->getName(getLexInfo(), ee)->getValue();
+  } else {
+    str = type->getString(getLexInfo(), ee);
+    t = str->getValue();
+  }
+
+  if(strcmp(t, "int64") == 0) intRep = true;
+  else if(strcmp(t, "double") == 0) intRep = false;
+  else slexception.chuck("Typed arrays are int64 or double", getLexInfo());
+  if(str != (String *) 0) str->release(getLexInfo());
+
+  j = s->getInt();
+  if(j <= 0) slexception.chuck("Typed arrays need at least one element", getLexInfo());
+
+  sprintf(element, "/_$/%s", n);
+  if(strlen(element) > 63) {
+    sprintf(arrayMessage, "Name %s too long", n);
+    slexception.chuck(arrayMessage, getLexInfo());
+  }
+  ta = new TypedArray(n, intRep, j);
+  if(! addTypedArray(ta)) {
+    delete ta;
+    sprintf(arrayMessage, "Array %s already exists", n);
+    slexception.chuck(arrayMessage, getLexInfo());
+  }
+  v = new Variable(element);
+  v->setObject(mainEE.cache.newNumber(j));
+  btree.addVariable(v);
+
+  s->release(getLexInfo());
+  oname->release(getLexInfo());
+  size->release(getLexInfo());
+  type->release(getLexInfo());
+
+  return or_continue;
+}
+
+ArrayKernel::ArrayKernel(int k, LexInfo *li) : Operation(li), kernel(k) { }
+
+TypedArray *ArrayKernel::getTypedArray(Object *o, ExecutionEnvironment *ee) {
+  TypedArray *t;
+  const char *n;
+
+  n = o->getName(getLexInfo(), ee)->getValue();
+  if((t = findTypedArray(n)) == (TypedArray *) 0) {
+    sprintf(arrayMessage, "Typed array %s not found", n);
+    slexception.chuck(arrayMessage, getLexInfo());
+  }
+
+  return t;
+}
+
+OperatorReturn ArrayKernel::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Object *o2;
+  TypedArray *a;
+  TypedArray *b;
+  Number *n;
+  double d;
+  INT count;
+  INT i;
+
+  o = ee->stack.pop(getLexInfo());
+  o2 = (Object *) 0;
+  n = (Number *) 0;
+  a = getTypedArray(o, ee);
+  b = (TypedArray *) 0;
+
+  switch(kernel) {
+    case KERNEL_FILL:
+    case KERNEL_SCALE:
+      o2 = ee->stack.pop(getLexInfo());
+      n = o2->getNumber(getLexInfo(), ee);
+      break;
+
+    case KERNEL_COPY:
+    case KERNEL_ADD:
+    case KERNEL_DOT:
+      o2 = ee->stack.pop(getLexInfo());
+      b = getTypedArray(o2, ee);
+      break;
+  }
+
+  count = a->getCount();
+  if((b != (TypedArray *) 0) && (b->getCount() < count)) count = b->getCount();
+
+  switch(kernel) {
+    case KERNEL_FILL:
+      if(a->isInt()) fillInts(a->getInts(), count, n->getInt());
+      else fillDoubles(a->getDoubles(), count, n->getDouble());
+      break;
+
+    // For copy and add a is the destination and b the source.
+    case KERNEL_COPY:
+      if(a->isInt() == b->isInt()) memmove(a->getInts(), b->getInts(), count * (a->isInt() ? sizeof(INT) : sizeof(double)));
+      else if(a->isInt()) for(i = 0; i < count; i++) a->getInts()[i] = (INT) b->getDoubles()[i];
+      else for(i = 0; i < count; i++) a->getDoubles()[i] = (double) b->getInts()[i];
+      break;
+
+    case KERNEL_ADD:
+      if(a->isInt() && b->isInt()) addInts(a->getInts(), b->getInts(), count);
+      else if(! a->isInt() && ! b->isInt()) addDoubles(a->getDoubles(), b->getDoubles(), count);
+      else if(a->isInt()) for(i = 0; i < count; i++) a->getInts()[i] += (INT) b->getDoubles()[i];
+      else for(i = 0; i < count; i++) a->getDoubles()[i] += (double) b->getInts()[i];
+      break;
+
+    case KERNEL_SCALE:
+      if(! a->isInt()) scaleDoubles(a->getDoubles(), count, n->getDouble());
+      else if(n->isInt()) scaleInts(a->getInts(), count, n->getInt());
+      else for(d = n->getDouble(), i = 0; i < count; i++) a->getInts()[i] = (INT) (a->getInts()[i] * d);
+      break;
+
+    case KERNEL_SUM:
+      if(a->isInt()) ee->stack.push(ee->cache.newNumber(sumInts(a->getInts(), count)));
+      else ee->stack.push(ee->cache.newNumber(sumDoubles(a->getDoubles(), count)));
+      break;
+
+    case KERNEL_MIN:
+      if(a->isInt()) ee->stack.push(ee->cache.newNumber(minInts(a->getInts(), count)));
+      else ee->stack.push(ee->cache.newNumber(minDoubles(a->getDoubles(), count)));
+      break;
+
+    case KERNEL_MAX:
+      if(a->isInt()) ee->stack.push(ee->cache.newNumber(maxInts(a->getInts(), count)));
+      else ee->stack.push(ee->cache.newNumber(maxDoubles(a->getDoubles(), count)));
+      break;
+
+    case KERNEL_DOT:
+      if(a->isInt() && b->isInt()) ee->stack.push(ee->cache.newNumber(dotInts(a->getInts(), b->getInts(), count)));
+      else if(! a->isInt() && ! b->isInt()) ee->stack.push(ee->cache.newNumber(dotDoubles(a->getDoubles(), b->getDoubles(), count)));
+      else {
+        for(d = 0.0, i = 0; i < count; i++) d += typedDouble(a, i) * typedDouble(b, i);
+        ee->stack.push(ee->cache.newNumber(d));
+      }
+      break;
+  }
+
+  if(n != (Number *) 0) n->release(getLexInfo());
+  if(o2 != (Object *) 0) o2->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+// The orderings.
+
+class IntLess {
+  public:
+    bool operator()(INT a, INT b) const { return a < b; }
+};
+
+class DoubleLess {
+  public:
+    bool operator()(double a, double b) const { return a < b; }
+};
+
+// Numbers before strings, and integers compared as integers.
+class ItemLess {
+  public:
+    bool operator()(const SortItem &a, const SortItem &b) const {
+      if((a.kind == SORT_STRING) || (b.kind == SORT_STRING)) {
+        if(a.kind != SORT_STRING) return true;
+        if(b.kind != SORT_STRING) return false;
+        return strcmp(a.str, b.str) < 0;
+      }
+      if((a.kind == SORT_INT) && (b.kind == SORT_INT)) return a.i < b.i;
+      return a.d < b.d;
+    }
+};
+
+// Calls the compare code with the two objects on the stack.
+class CodeLess {
+  public:
+    CodeLess(Code *c, ExecutionEnvironment *e, LexInfo *l) : code(c), ee(e), li(l) { }
+    bool operator()(Object *a, Object *b) const {
+      Object *o;
+      Number *n;
+      bool ret;
+
+      a->hold();
+      ee->stack.push(a);
+      b->hold();
+      ee->stack.push(b);
+      code->action(ee);
+      o = ee->stack.pop(li);
+      n = o->getNumber(li, ee);
+      ret = (n->isInt() ? n->getInt() != 0 : n->getDouble() != 0.0);
+      n->release(li);
+      o->release(li);
+
+      return ret;
+    }
+
+  private:
+    Code *code;
+    ExecutionEnvironment *ee;
+    LexInfo *li;
+};
+
+template <class T, class Less> static void insertionSort(T *a, INT n, Less less) {
+  T t;
+  INT i;
+  INT j;
+
+  for(i = 1; i < n; i++) {
+    t = a[i];
+    for(j = i; (j > 0) && less(t, a[j - 1]); j--) a[j] = a[j - 1];
+    a[j] = t;
+  }
+}
+
+template <class T, class Less> static void siftDown(T *a, INT i, INT n, Less less) {
+  T t;
+  INT c;
+
+  t = a[i];
+  while((c = 2 * i + 1) < n) {
+    if((c + 1 < n) && less(a[c], a[c + 1])) c++;
+    if(! less(t, a[c])) break;
+    a[i] = a[c];
+    i = c;
+  }
+  a[i] = t;
+}
+
+template <class T, class Less> static void heapSort(T *a, INT n, Less less) {
+  T t;
+  INT i;
+
+  for(i = n / 2 - 1; i >= 0; i--) siftDown(a, i, n, less);
+  for(i = n - 1; i > 0; i--) {
+    t = a[0];
+    a[0] = a[i];
+    a[i] = t;
+    siftDown(a, 0, i, less);
+  }
+}
+
+// Quicksort with a median of three pivot, falling back to heapsort if it goes
+// too deep and leaving short runs for insertion sort.
+template <class T, class Less> static void introSortLoop(T *a, INT n, int depth, Less less) {
+  T pivot;
+  T t;
+  INT mid;
+  INT i;
+  INT j;
+
+  while(n > INSERTION_SORT_MAX) {
+    if(depth-- == 0) {
+      heapSort(a, n, less);
+      return;
+    }
+
+    mid = n / 2;
+    if(less(a[mid], a[0])) { t = a[mid]; a[mid] = a[0]; a[0] = t; }
+    if(less(a[n - 1], a[mid])) {
+      t = a[n - 1]; a[n - 1] = a[mid]; a[mid] = t;
+      if(less(a[mid], a[0])) { t = a[mid]; a[mid] = a[0]; a[0] = t; }
+    }
+    pivot = a[mid];
+
+    i = -1;
+    j = n;
+    for(;;) {
+      do i++; while(less(a[i], pivot));
+      do j--; while(less(pivot, a[j]));
+      if(i >= j) break;
+      t = a[i]; a[i] = a[j]; a[j] = t;
+    }
+
+    // Recurse on the smaller side.
+    if(j + 1 < n - j - 1) {
+      introSortLoop(a, j + 1, depth, less);
+      a += j + 1;
+      n -= j + 1;
+    } else {
+      introSortLoop(a + j + 1, n - j - 1, depth, less);
+      n = j + 1;
+    }
+  }
+  insertionSort(a, n, less);
+}
+
+template <class T, class Less> static void introSort(T *a, INT n, Less less) {
+  INT m;
+  int depth;
+
+  for(depth = 0, m = n; m > 1; m >>= 1) depth += 2;
+  introSortLoop(a, n, depth, less);
+}
+
+// Merge the sorted runs a[0, m) and a[m, n) into out.
+template <class T, class Less> static void mergeRuns(T *a, INT m, INT n, T *out, Less less) {
+  INT i;
+  INT j;
+  INT k;
+
+  for(i = 0, j = m, k = 0; (i < m) && (j < n); k++) out[k] = (less(a[j], a[i]) ? a[j++] : a[i++]);
+  while(i < m) out[k++] = a[i++];
+  while(j < n) out[k++] = a[j++];
+}
+
+template <class T, class Less> static void mergeSort(T *a, T *tmp, INT n, Less less) {
+  INT m;
+
+  if(n <= INSERTION_SORT_MAX) {
+    insertionSort(a, n, less);
+    return;
+  }
+  m = n / 2;
+  mergeSort(a, tmp, m, less);
+  mergeSort(a + m, tmp, n - m, less);
+  if(! less(a[m], a[m - 1])) return;
+  mergeRuns(a, m, n, tmp, less);
+  memcpy(a, tmp, n * sizeof(T));
+}
+
+// Radix sort on 64 bit keys, a byte at a time, skipping any byte that's the same
+// in every key. Returns whichever of k and tmp holds the result.
+static uint64_t *radixSort(uint64_t *k, uint64_t *tmp, INT n) {
+  uint64_t *t;
+  INT count[256];
+  INT sum;
+  INT c;
+  INT i;
+  int shift;
+  int b;
+
+  for(shift = 0; shift < 64; shift += 8) {
+    memset(count, 0, sizeof(count));
+    for(i = 0; i < n; i++) count[(k[i] >> shift) & 0xff]++;
+    if(count[(k[0] >> shift) & 0xff] == n) continue;
+    for(sum = 0, b = 0; b < 256; b++) {
+      c = count[b];
+      count[b] = sum;
+      sum += c;
+    }
+    for(i = 0; i < n; i++) tmp[count[(k[i] >> shift) & 0xff]++] = k[i];
+    t = k;
+    k = tmp;
+    tmp = t;
+  }
+
+  return k;
+}
+
+// Keys that sort as unsigned in the same order as the signed integers or doubles.
+#define SIGN_BIT  ((uint64_t) 1 << 63)
+
+static void sortInts(INT *a, INT n) {
+  uint64_t *k;
+  uint64_t *r;
+  INT i;
+
+  if(n < RADIX_SORT_MIN) {
+    introSort(a, n, IntLess());
+    return;
+  }
+
+  if((k = (uint64_t *) malloc(2 * n * sizeof(uint64_t))) == (uint64_t *) 0) {
+    introSort(a, n, IntLess());
+    return;
+  }
+  for(i = 0; i < n; i++) k[i] = ((uint64_t) (int64_t) a[i]) ^ SIGN_BIT;
+  r = radixSort(k, k + n, n);
+  for(i = 0; i < n; i++) a[i] = (INT) (int64_t) (r[i] ^ SIGN_BIT);
+  free(k);
+}
+
+static void sortDoubles(double *a, INT n) {
+  uint64_t *k;
+  uint64_t *r;
+  uint64_t u;
+  INT i;
+
+  if(n < RADIX_SORT_MIN) {
+    introSort(a, n, DoubleLess());
+    return;
+  }
+
+  if((k = (uint64_t *) malloc(2 * n * sizeof(uint64_t))) == (uint64_t *) 0) {
+    introSort(a, n, DoubleLess());
+    return;
+  }
+  for(i = 0; i < n; i++) {
+    memcpy(&u, &a[i], sizeof(u));
+    k[i] = (u & SIGN_BIT ? ~u : u | SIGN_BIT);
+  }
+  r = radixSort(k, k + n, n);
+  for(i = 0; i < n; i++) {
+    u = (r[i] & SIGN_BIT ? r[i] ^ SIGN_BIT : ~r[i]);
+    memcpy(&a[i], &u, sizeof(u));
+  }
+  free(k);
+}
+
+static void sortItems(SortItem *a, INT n) {
+  introSort(a, n, ItemLess());
+}
+
+// Each thread sorts, or merges, its own part of the array.
+
+template <class T, class Less> class SortPart {
+  public:
+    T *a;
+    T *out;
+    INT m;
+    INT n;
+    void (*sort)(T *, INT);
+    Less less;
+};
+
+template <class T, class Less> static void *sortPartThread(void *p) {
+  SortPart<T, Less> *sp = (SortPart<T, Less> *) p;
+
+  sp->sort(sp->a, sp->n);
+
+  return (void *) 0;
+}
+
+template <class T, class Less> static void *mergePartThread(void *p) {
+  SortPart<T, Less> *sp = (SortPart<T, Less> *) p;
+
+  mergeRuns(sp->a, sp->m, sp->n, sp->out, sp->less);
+
+  return (void *) 0;
+}
+
+// Sort using a thread per processor for big arrays, otherwise just sort.
+template <class T, class Less> static void parallelSort(T *a, INT n, void (*sort)(T *, INT), Less less) {
+  SortPart<T, Less> parts[PARALLEL_SORT_THREADS];
+  pthread_t threads[PARALLEL_SORT_THREADS];
+  INT bounds[PARALLEL_SORT_THREADS + 1];
+  bool started[PARALLEL_SORT_THREADS];
+  T *src;
+  T *dst;
+  T *t;
+  long cpus;
+  int count;
+  int runs;
+  int i;
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if((n < PARALLEL_SORT_MIN) || (cpus < 2)) {
+    sort(a, n);
+    return;
+  }
+  count = (cpus > PARALLEL_SORT_THREADS ? PARALLEL_SORT_THREADS : (int) cpus);
+  if((dst = (T *) malloc(n * sizeof(T))) == (T *) 0) {
+    sort(a, n);
+    return;
+  }
+
+  for(i = 0; i <= count; i++) bounds[i] = (n * i) / count;
+  for(i = 0; i < count; i++) {
+    parts[i].a = a + bounds[i];
+    parts[i].n = bounds[i + 1] - bounds[i];
+    parts[i].sort = sort;
+    // If a thread can't be had, do it here.
+    started[i] = (pthread_create(&threads[i], NULL, sortPartThread<T, Less>, &parts[i]) == 0);
+    if(! started[i]) sortPartThread<T, Less>(&parts[i]);
+  }
+  for(i = 0; i < count; i++) if(started[i]) pthread_join(threads[i], NULL);
+
+  // Merge pairs of runs until there's one left.
+  src = a;
+  for(runs = count; runs > 1; runs = (runs + 1) / 2) {
+    for(i = 0; i < runs / 2; i++) {
+      parts[i].a = src + bounds[2 * i];
+      parts[i].out = dst + bounds[2 * i];
+      parts[i].m = bounds[2 * i + 1] - bounds[2 * i];
+      parts[i].n = bounds[2 * i + 2] - bounds[2 * i];
+      parts[i].less = less;
+      started[i] = (pthread_create(&threads[i], NULL, mergePartThread<T, Less>, &parts[i]) == 0);
+      if(! started[i]) mergePartThread<T, Less>(&parts[i]);
+    }
+    if(runs & 1) memcpy(dst + bounds[runs - 1], src + bounds[runs - 1], (n - bounds[runs - 1]) * sizeof(T));
+    for(i = 0; i < runs / 2; i++) if(started[i]) pthread_join(threads[i], NULL);
+
+    for(i = 0; i <= runs / 2; i++) bounds[i] = bounds[2 * i < runs ? 2 * i : runs];
+    bounds[(runs + 1) / 2] = n;
+    t = src;
+    src = dst;
+    dst = t;
+  }
+
+  if(src != a) {
+    memcpy(a, src, n * sizeof(T));
+    free(src);
+  } else {
+    free(dst);
+  }
+}
+
+ArraySort::ArraySort(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ArraySort::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Object *val;
+  DenseArray *a;
+  TypedArray *t;
+  SortItem *items;
+  Number *n;
+  String *str;
+  const char *name;
+  INT count;
+  INT i;
+
+  o = ee->stack.pop(getLexInfo());
+  name = o->getName(getLexInfo(), ee)->getValue();
+
+  if((t = findTypedArray(name)) != (TypedArray *) 0) {
+    if(t->isInt()) parallelSort(t->getInts(), t->getCount(), sortInts, IntLess());
+    else parallelSort(t->getDoubles(), t->getCount(), sortDoubles, DoubleLess());
+  } else if((a = findArray(name)) != (DenseArray *) 0) {
+    count = a->getCount();
+    if((items = (SortItem *) malloc(count * sizeof(SortItem))) == (SortItem *) 0) slexception.chuck("malloc failed", getLexInfo());
+
+    // Pull out the keys, holding each object until it's put back.
+    for(i = 0; i < count; i++) {
+      if((val = a->getElement(i)->getObject()) == (Object *) 0) {
+        while(i-- > 0) items[i].object->release(getLexInfo());
+        free(items);
+        slexception.chuck("Can't sort, array has an undefined element", getLexInfo());
+      }
+      n = (Number *) 0;
+      str = (String *) 0;
+      try {
+        n = val->getNumber(getLexInfo(), ee);
+      } catch(Exception *e) { }
+      if(n == (Number *) 0) {
+        try {
+          str = val->getString(getLexInfo(), ee);
+        } catch(Exception *e) { }
+      }
+      if(n != (Number *) 0) {
+        items[i].kind = (n->isInt() ? SORT_INT : SORT_DOUBLE);
+        items[i].i = n->getInt();
+        items[i].d = n->getDouble();
+        n->release(getLexInfo());
+      } else if(str != (String *) 0) {
+        items[i].kind = SORT_STRING;
+        items[i].str = str->getValue();
+        str->release(getLexInfo());
+      } else {
+        while(i-- > 0) items[i].object->release(getLexInfo());
+        free(items);
+        slexception.chuck("Can only sort numbers and strings", getLexInfo());
+      }
+      val->hold();
+      items[i].object = val;
+    }
+
+    parallelSort(items, count, sortItems, ItemLess());
+
+    for(i = 0; i < count; i++) a->getElement(i)->restoreObject(items[i].object);
+    free(items);
+  } else {
+    sprintf(arrayMessage, "Can't sort %s, only arrays made with create or typed array::() can be sorted", name);
+    slexception.chuck(arrayMessage, getLexInfo());
+  }
+
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ArraySortBy::ArraySortBy(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ArraySortBy::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Object *oc;
+  Object **objects;
+  Object **tmp;
+  DenseArray *a;
+  TypedArray *t;
+  Code *code;
+  Number *n;
+  const char *name;
+  INT count;
+  INT i;
+
+  oc = ee->stack.pop(getLexInfo());
+  o = ee->stack.pop(getLexInfo());
+  code = oc->getCode(getLexInfo(), ee);
+  name = o->getName(getLexInfo(), ee)->getValue();
+
+  t = findTypedArray(name);
+  a = findArray(name);
+  if((t == (TypedArray *) 0) && (a == (DenseArray *) 0)) {
+    sprintf(arrayMessage, "Can't sort %s, only arrays made with create or typed array::() can be sorted", name);
+    slexception.chuck(arrayMessage, getLexInfo());
+  }
+
+  count = (t != (TypedArray *) 0 ? t->getCount() : a->getCount());
+  objects = (Object **) malloc(count * sizeof(Object *));
+  tmp = (Object **) malloc(count * sizeof(Object *));
+  if((objects == (Object **) 0) || (tmp == (Object **) 0)) slexception.chuck("malloc failed", getLexInfo());
+
+  for(i = 0; i < count; i++) {
+    if(t != (TypedArray *) 0) {
+      objects[i] = t->getNumber(i, &ee->cache);
+    } else {
+      if((objects[i] = a->getElement(i)->getObject()) == (Object *) 0) {
+        while(i-- > 0) objects[i]->release(getLexInfo());
+        free(objects);
+        free(tmp);
+        slexception.chuck("Can't sort, array has an undefined element", getLexInfo());
+      }
+      objects[i]->hold();
+    }
+  }
+
+  // The compare code may fail, in which case let go of everything before passing the error on.
+  try {
+    mergeSort(objects, tmp, count, CodeLess(code, ee, getLexInfo()));
+  } catch(Exception *e) {
+    for(i = 0; i < count; i++) objects[i]->release(getLexInfo());
+    free(objects);
+    free(tmp);
+    e->rechuck(getLexInfo());
+  }
+
+  for(i = 0; i < count; i++) {
+    if(t != (TypedArray *) 0) {
+      n = objects[i]->getNumber(getLexInfo(), ee);
+      t->setNumber(i, n);
+      n->release(getLexInfo());
+      objects[i]->release(getLexInfo());
+    } else {
+      a->getElement(i)->restoreObject(objects[i]);
+    }
+  }
+  free(objects);
+  free(tmp);
+
+  code->release(getLexInfo());
+  oc->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
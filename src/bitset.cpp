@@ -0,0 +1,476 @@
+/*
+
+MIT License
+
+Copyright (c) 2020-2023 Graeme Elsworthy <github@sharkshead.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "shalelib.h"
+
+#define MAJOR   (INT) 1
+#define MINOR   (INT) 0
+#define MICRO   (INT) 1
+
+const char *bitsetHelp[] = {
+  "Bitset library:",
+  "  {size} create bitset::()           - push a new bitset with room for {size} bits, all clear.",
+  "                                       it grows as needed when bits past the end are set,",
+  "                                       up to 2^32 bits",
+  "  {bit} {bitset} set bitset::()      - set bit {bit}",
+  "  {bit} {bitset} clear bitset::()    - clear bit {bit}",
+  "  {bit} {bitset} test bitset::()     - true if bit {bit} is set",
+  "  {bitset} count bitset::()          - number of bits set",
+  "  {bitset} size bitset::()           - number of bits the bitset has room for",
+  "  {from} {bitset} next bitset::()    - the first set bit at or after {from}, or -1 if there are none",
+  "  {bitset} clone bitset::()          - push a copy of {bitset}",
+  "  {bitset} reset bitset::()          - clear every bit",
+  "  {src} {dst} intersect bitset::()   - {dst} becomes {dst} and {src}",
+  "  {src} {dst} union bitset::()       - {dst} becomes {dst} or {src}",
+  "  {src} {dst} xor bitset::()         - {dst} becomes {dst} xor {src}",
+  "  {src} {dst} andnot bitset::()      - {dst} becomes {dst} and not {src}, clearing the bits set in {src}",
+  "  major version:: bitset::           - major version number",
+  "  minor version:: bitset::           - minor version number",
+  "  micro version:: bitset::           - micro version number",
+  "  help bitset::()                    - this",
+  (const char *) 0
+};
+
+const char *bitsetType = "bitset";
+
+#define BITSET_HELP     0
+#define BITSET_CREATE   1
+#define BITSET_SET      2
+#define BITSET_CLEAR    3
+#define BITSET_TEST     4
+#define BITSET_COUNT    5
+#define BITSET_SIZE     6
+#define BITSET_NEXT     7
+#define BITSET_CLONE    8
+#define BITSET_RESET    9
+#define BITSET_AND      10
+#define BITSET_OR       11
+#define BITSET_XOR      12
+#define BITSET_ANDNOT   13
+
+typedef unsigned long long Word;
+
+#define WORD_BITS       64
+
+// Growing copies the bits while the bitset is locked, so cap the size to keep
+// that bounded. 2^32 bits is 512MB.
+#define MAX_BITS        ((INT) 1 << 32)
+
+// The bits are kept in 64 bit words on a cache line boundary. Every word past
+// the last used bit is kept clear, so count and the boolean operations can work
+// a whole word at a time without masking, and the loops are simple enough for
+// the compiler to vectorise.
+class Bitset : public Handle {
+  public:
+    Bitset(INT, Cache *);
+    ~Bitset();
+    void lock();
+    void unlock();
+    INT getSize();
+    INT getWords();
+    Word *getData();
+    bool setSize(INT);
+    bool set(INT);
+    void clear(INT);
+    bool test(INT);
+    INT count();
+    INT next(INT);
+    void reset();
+
+  private:
+    Word *data;
+    INT words;
+    INT size;
+    pthread_mutex_t mutex;
+    bool grow(INT);
+};
+
+class BitsetFunction : public Operation {
+  public:
+    BitsetFunction(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+static void addFunction(const char *name, int function) {
+  OperationList *ol;
+  Variable *v;
+
+  ol = new OperationList;
+  ol->addOperation(new BitsetFunction(function, (LexInfo *) 0));
+  v = new Variable(name);
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
+extern "C" void slmain() {
+  Variable *v;
+
+  // Are we already loaded?
+  if(btree.findVariable("/help/bitset") != (Variable *) 0) return;
+
+  addFunction("/help/bitset", BITSET_HELP);
+
+  v = new Variable("/major/version/bitset");
+  v->setObject(mainEE.cache.newNumber(MAJOR));
+  btree.addVariable(v);
+
+  v = new Variable("/minor/version/bitset");
+  v->setObject(mainEE.cache.newNumber(MINOR));
+  btree.addVariable(v);
+
+  v = new Variable("/micro/version/bitset");
+  v->setObject(mainEE.cache.newNumber(MICRO));
+  btree.addVariable(v);
+
+  addFunction("/create/bitset", BITSET_CREATE);
+  addFunction("/set/bitset", BITSET_SET);
+  addFunction("/clear/bitset", BITSET_CLEAR);
+  addFunction("/test/bitset", BITSET_TEST);
+  addFunction("/count/bitset", BITSET_COUNT);
+  addFunction("/size/bitset", BITSET_SIZE);
+  addFunction("/next/bitset", BITSET_NEXT);
+  addFunction("/clone/bitset", BITSET_CLONE);
+  addFunction("/reset/bitset", BITSET_RESET);
+  addFunction("/intersect/bitset", BITSET_AND);
+  addFunction("/union/bitset", BITSET_OR);
+  addFunction("/xor/bitset", BITSET_XOR);
+  addFunction("/andnot/bitset", BITSET_ANDNOT);
+}
+
+// Null if there's no memory, as growing happens with the bitset locked and the
+// caller has to unlock before chucking. The words aren't cleared.
+static Word *allocWords(INT n) {
+  void *p;
+
+  if(n < 1) n = 1;
+  if(posix_memalign(&p, 64, n * sizeof(Word)) != 0) return (Word *) 0;
+
+  return (Word *) p;
+}
+
+Bitset::Bitset(INT n, Cache *c) : Handle(bitsetType, c) {
+  size = n;
+  words = (n + WORD_BITS - 1) / WORD_BITS;
+  if((data = allocWords(words)) == (Word *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  memset(data, 0, (words < 1 ? 1 : words) * sizeof(Word));
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Bitset::~Bitset() {
+  free(data);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Bitset::lock() { if(useMutex) pthread_mutex_lock(&mutex); }
+void Bitset::unlock() { if(useMutex) pthread_mutex_unlock(&mutex); }
+INT Bitset::getSize() { return size; }
+INT Bitset::getWords() { return words; }
+Word *Bitset::getData() { return data; }
+
+// Make room for n words, at least doubling so a run of sets past the end is
+// cheap, but not past MAX_BITS. False if there's no memory.
+bool Bitset::grow(INT n) {
+  Word *d;
+
+  if(n <= words) return true;
+  if(n < words * 2) n = words * 2;
+  if(n > MAX_BITS / WORD_BITS) n = MAX_BITS / WORD_BITS;
+  if((d = allocWords(n)) == (Word *) 0) return false;
+  memcpy(d, data, words * sizeof(Word));
+  memset(d + words, 0, (n - words) * sizeof(Word));
+  free(data);
+  data = d;
+  words = n;
+
+  return true;
+}
+
+bool Bitset::setSize(INT n) {
+  if(! grow((n + WORD_BITS - 1) / WORD_BITS)) return false;
+  if(n > size) size = n;
+
+  return true;
+}
+
+bool Bitset::set(INT i) {
+  if((i >= size) && ! setSize(i + 1)) return false;
+  data[i / WORD_BITS] |= (Word) 1 << (i % WORD_BITS);
+
+  return true;
+}
+
+void Bitset::clear(INT i) {
+  if(i < size) data[i / WORD_BITS] &= ~((Word) 1 << (i % WORD_BITS));
+}
+
+bool Bitset::test(INT i) {
+  if(i >= size) return false;
+  return (data[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+INT Bitset::count() {
+  INT i;
+  INT c0;
+  INT c1;
+
+  c0 = 0;
+  c1 = 0;
+  for(i = 0; i + 1 < words; i += 2) {
+    c0 += __builtin_popcountll(data[i]);
+    c1 += __builtin_popcountll(data[i + 1]);
+  }
+  if(i < words) c0 += __builtin_popcountll(data[i]);
+
+  return c0 + c1;
+}
+
+INT Bitset::next(INT from) {
+  INT i;
+  Word w;
+
+  if(from < 0) from = 0;
+  if(from >= size) return -1;
+
+  i = from / WORD_BITS;
+  w = data[i] & (~(Word) 0 << (from % WORD_BITS));
+  while(w == 0) {
+    if(++i >= words) return -1;
+    w = data[i];
+  }
+
+  return i * WORD_BITS + __builtin_ctzll(w);
+}
+
+void Bitset::reset() {
+  memset(data, 0, words * sizeof(Word));
+}
+
+static void andWords(Word *d, const Word *s, INT n) {
+  INT i;
+
+  for(i = 0; i < n; i++) d[i] &= s[i];
+}
+
+static void orWords(Word *d, const Word *s, INT n) {
+  INT i;
+
+  for(i = 0; i < n; i++) d[i] |= s[i];
+}
+
+static void xorWords(Word *d, const Word *s, INT n) {
+  INT i;
+
+  for(i = 0; i < n; i++) d[i] ^= s[i];
+}
+
+static void andNotWords(Word *d, const Word *s, INT n) {
+  INT i;
+
+  for(i = 0; i < n; i++) d[i] &= ~s[i];
+}
+
+static Bitset *findBitset(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(bitsetType)) {
+    h->release(li);
+    slexception.chuck("bitset not found", li);
+  }
+
+  return (Bitset *) h;
+}
+
+static INT getBit(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  INT i;
+
+  n = o->getNumber(li, ee);
+  i = n->getInt();
+  n->release(li);
+  if(i < 0) slexception.chuck("bit number out of range", li);
+
+  return i;
+}
+
+// Locks two bitsets in address order, so two threads combining the same pair
+// the other way around can't deadlock.
+static void lockPair(Bitset *a, Bitset *b) {
+  if(a == b) { a->lock(); return; }
+  if(a < b) { a->lock(); b->lock(); }
+  else { b->lock(); a->lock(); }
+}
+
+static void unlockPair(Bitset *a, Bitset *b) {
+  a->unlock();
+  if(a != b) b->unlock();
+}
+
+BitsetFunction::BitsetFunction(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn BitsetFunction::action(ExecutionEnvironment *ee) {
+  const char **p;
+  Object *o1;
+  Object *o2;
+  Number *n;
+  Bitset *b1;
+  Bitset *b2;
+  Bitset *c;
+  INT i;
+  INT common;
+  bool res;
+  bool ok;
+
+  switch(function) {
+    case BITSET_HELP:
+      for(p = bitsetHelp; *p != (const char *) 0; p++) {
+        printf("%s\n", *p);
+      }
+      break;
+
+    case BITSET_CREATE:
+      o1 = ee->stack.pop(getLexInfo());
+      n = o1->getNumber(getLexInfo(), ee);
+      i = n->getInt();
+      n->release(getLexInfo());
+      o1->release(getLexInfo());
+      if((i < 0) || (i > MAX_BITS)) slexception.chuck("bitset size out of range", getLexInfo());
+      ee->stack.push(new Bitset(i, &ee->cache));
+      break;
+
+    case BITSET_SET:
+    case BITSET_CLEAR:
+    case BITSET_TEST:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      b1 = findBitset(o1, getLexInfo(), ee);
+      i = getBit(o2, getLexInfo(), ee);
+      if((function == BITSET_SET) && (i >= MAX_BITS)) {
+        b1->release(getLexInfo());
+        slexception.chuck("bit number out of range", getLexInfo());
+      }
+      b1->lock();
+      res = false;
+      ok = true;
+      switch(function) {
+        case BITSET_SET: ok = b1->set(i); break;
+        case BITSET_CLEAR: b1->clear(i); break;
+        case BITSET_TEST: res = b1->test(i); break;
+      }
+      b1->unlock();
+      if(! ok) {
+        b1->release(getLexInfo());
+        slexception.chuck("malloc error", getLexInfo());
+      }
+      if(function == BITSET_TEST) ee->stack.push(ee->cache.newNumber((INT) (res ? 1 : 0)));
+      b1->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+
+    case BITSET_COUNT:
+    case BITSET_SIZE:
+    case BITSET_CLONE:
+    case BITSET_RESET:
+      o1 = ee->stack.pop(getLexInfo());
+      b1 = findBitset(o1, getLexInfo(), ee);
+      b1->lock();
+      switch(function) {
+        case BITSET_COUNT: ee->stack.push(ee->cache.newNumber(b1->count())); break;
+        case BITSET_SIZE: ee->stack.push(ee->cache.newNumber(b1->getSize())); break;
+        case BITSET_RESET: b1->reset(); break;
+        case BITSET_CLONE:
+          try {
+            c = new Bitset(b1->getSize(), &ee->cache);
+          } catch(Exception *e) {
+            b1->unlock();
+            b1->release(getLexInfo());
+            e->rechuck(getLexInfo());
+          }
+          memcpy(c->getData(), b1->getData(), c->getWords() * sizeof(Word));
+          ee->stack.push(c);
+          break;
+      }
+      b1->unlock();
+      b1->release(getLexInfo());
+      o1->release(getLexInfo());
+      break;
+
+    case BITSET_NEXT:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      b1 = findBitset(o1, getLexInfo(), ee);
+      n = o2->getNumber(getLexInfo(), ee);
+      i = n->getInt();
+      n->release(getLexInfo());
+      b1->lock();
+      i = b1->next(i);
+      b1->unlock();
+      ee->stack.push(ee->cache.newNumber(i));
+      b1->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+
+    case BITSET_AND:
+    case BITSET_OR:
+    case BITSET_XOR:
+    case BITSET_ANDNOT:
+      o1 = ee->stack.pop(getLexInfo());   // dst
+      o2 = ee->stack.pop(getLexInfo());   // src
+      b1 = findBitset(o1, getLexInfo(), ee);
+      b2 = findBitset(o2, getLexInfo(), ee);
+      lockPair(b1, b2);
+      // or and xor can set bits past the end of dst, so it takes on src's size.
+      if(((function == BITSET_OR) || (function == BITSET_XOR)) && ! b1->setSize(b2->getSize())) {
+        unlockPair(b1, b2);
+        b1->release(getLexInfo());
+        b2->release(getLexInfo());
+        slexception.chuck("malloc error", getLexInfo());
+      }
+      common = (b1->getWords() < b2->getWords() ? b1->getWords() : b2->getWords());
+      switch(function) {
+        case BITSET_AND:
+          andWords(b1->getData(), b2->getData(), common);
+          if(b1->getWords() > common) memset(b1->getData() + common, 0, (b1->getWords() - common) * sizeof(Word));
+          break;
+        case BITSET_OR: orWords(b1->getData(), b2->getData(), common); break;
+        case BITSET_XOR: xorWords(b1->getData(), b2->getData(), common); break;
+        case BITSET_ANDNOT: andNotWords(b1->getData(), b2->getData(), common); break;
+      }
+      unlockPair(b1, b2);
+      b1->release(getLexInfo());
+      b2->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+  }
+
+  return or_continue;
+}
@@ -0,0 +1,479 @@
+/*
+
+MIT License
+
+Copyright (c) 2020-2023 Graeme Elsworthy <github@sharkshead.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "shalelib.h"
+
+#define MAJOR   (INT) 1
+#define MINOR   (INT) 0
+#define MICRO   (INT) 0
+
+const char *combinatoricsHelp[] = {
+  "Combinatorics library:",
+  "  {n} {k} {out} permutations combinatorics::()  - every ordering of {k} of the numbers 0 to {n}-1",
+  "  {n} {k} {out} combinations combinatorics::()  - every choice of {k} of the numbers 0 to {n}-1, in",
+  "                                                  ascending order",
+  "  {n} {k} {out} product combinatorics::()       - every list of {k} numbers each from 0 to {n}-1",
+  "  {index} {n} {k} unrank combinatorics::()      - push permutation number {index}, counting from 0, of",
+  "                                                  {k} of the numbers 0 to {n}-1",
+  "  {n} {k} arrange combinatorics::()             - how many permutations of {k} from {n} there are",
+  "  {n} {k} choose combinatorics::()              - how many combinations of {k} from {n} there are",
+  "  major version:: combinatorics::               - major version number",
+  "  minor version:: combinatorics::               - minor version number",
+  "  micro version:: combinatorics::               - micro version number",
+  "  help combinatorics::()                        - this",
+  "",
+  "  Everything is generated in lexicographic order. If {out} is code it is run once for each list",
+  "  with the {k} numbers on the stack, the last one on top, and break stops early. Otherwise {out}",
+  "  names an int64 typed array, from the array library, which is filled with the lists one after",
+  "  the other, and the number of lists is pushed. The array is created if it doesn't exist.",
+  (const char *) 0
+};
+
+#define COMB_HELP           0
+#define COMB_PERMUTATIONS   1
+#define COMB_COMBINATIONS   2
+#define COMB_PRODUCT        3
+#define COMB_UNRANK         4
+#define COMB_ARRANGE        5
+#define COMB_CHOOSE         6
+
+// Each generator steps a list of k numbers in place. first() sets up the first
+// list and next() moves on to the following one, returning false at the end.
+class Generator {
+  public:
+    Generator(INT, INT);
+    virtual ~Generator();
+    virtual bool first() = 0;
+    virtual bool next() = 0;
+    INT *getList();
+
+  protected:
+    INT n;
+    INT k;
+    INT *list;
+};
+
+class Permutations : public Generator {
+  public:
+    Permutations(INT, INT);
+    ~Permutations();
+    bool first();
+    bool next();
+
+  private:
+    bool *used;
+};
+
+class Combinations : public Generator {
+  public:
+    Combinations(INT, INT);
+    bool first();
+    bool next();
+};
+
+class Product : public Generator {
+  public:
+    Product(INT, INT);
+    bool first();
+    bool next();
+};
+
+class CombinatoricsFunction : public Operation {
+  public:
+    CombinatoricsFunction(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+static void addFunction(const char *name, int function) {
+  OperationList *ol;
+  Variable *v;
+
+  ol = new OperationList;
+  ol->addOperation(new CombinatoricsFunction(function, (LexInfo *) 0));
+  v = new Variable(name);
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
+extern "C" void slmain() {
+  Variable *v;
+
+  // Are we already loaded?
+  if(btree.findVariable("/help/combinatorics") != (Variable *) 0) return;
+
+  addFunction("/help/combinatorics", COMB_HELP);
+
+  v = new Variable("/major/version/combinatorics");
+  v->setObject(mainEE.cache.newNumber(MAJOR));
+  btree.addVariable(v);
+
+  v = new Variable("/minor/version/combinatorics");
+  v->setObject(mainEE.cache.newNumber(MINOR));
+  btree.addVariable(v);
+
+  v = new Variable("/micro/version/combinatorics");
+  v->setObject(mainEE.cache.newNumber(MICRO));
+  btree.addVariable(v);
+
+  addFunction("/permutations/combinatorics", COMB_PERMUTATIONS);
+  addFunction("/combinations/combinatorics", COMB_COMBINATIONS);
+  addFunction("/product/combinatorics", COMB_PRODUCT);
+  addFunction("/unrank/combinatorics", COMB_UNRANK);
+  addFunction("/arrange/combinatorics", COMB_ARRANGE);
+  addFunction("/choose/combinatorics", COMB_CHOOSE);
+}
+
+Generator::Generator(INT nn, INT kk) : n(nn), k(kk) {
+  if((list = (INT *) malloc((k < 1 ? 1 : k) * sizeof(INT))) == (INT *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+}
+
+Generator::~Generator() { free(list); }
+INT *Generator::getList() { return list; }
+
+Permutations::Permutations(INT nn, INT kk) : Generator(nn, kk) {
+  if((used = (bool *) malloc((n < 1 ? 1 : n) * sizeof(bool))) == (bool *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+}
+
+Permutations::~Permutations() { free(used); }
+
+bool Permutations::first() {
+  INT i;
+
+  if(k > n) return false;
+  for(i = 0; i < n; i++) used[i] = (i < k);
+  for(i = 0; i < k; i++) list[i] = i;
+
+  return true;
+}
+
+// Working back from the end, find a place that can take a bigger unused number,
+// then fill everything after it with the smallest unused numbers.
+bool Permutations::next() {
+  INT i;
+  INT j;
+  INT v;
+
+  for(i = k - 1; i >= 0; i--) {
+    used[list[i]] = false;
+    for(v = list[i] + 1; (v < n) && used[v]; v++) ;
+    if(v < n) {
+      list[i] = v;
+      used[v] = true;
+      for(j = i + 1, v = 0; j < k; j++, v++) {
+        while(used[v]) v++;
+        list[j] = v;
+        used[v] = true;
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+Combinations::Combinations(INT nn, INT kk) : Generator(nn, kk) { }
+
+bool Combinations::first() {
+  INT i;
+
+  if(k > n) return false;
+  for(i = 0; i < k; i++) list[i] = i;
+
+  return true;
+}
+
+bool Combinations::next() {
+  INT i;
+  INT j;
+
+  for(i = k - 1; (i >= 0) && (list[i] == n - k + i); i--) ;
+  if(i < 0) return false;
+  list[i]++;
+  for(j = i + 1; j < k; j++) list[j] = list[j - 1] + 1;
+
+  return true;
+}
+
+Product::Product(INT nn, INT kk) : Generator(nn, kk) { }
+
+bool Product::first() {
+  INT i;
+
+  if((n == 0) && (k > 0)) return false;
+  for(i = 0; i < k; i++) list[i] = 0;
+
+  return true;
+}
+
+bool Product::next() {
+  INT i;
+
+  for(i = k - 1; i >= 0; i--) {
+    if(++list[i] < n) return true;
+    list[i] = 0;
+  }
+
+  return false;
+}
+
+// n!/(n-k)! and n!/(k!(n-k)!), or -1 if it won't fit.
+static INT arrange(INT n, INT k) {
+  INT r;
+  INT i;
+
+  if(k > n) return 0;
+  for(r = 1, i = 0; i < k; i++) {
+    if(__builtin_mul_overflow(r, n - i, &r)) return -1;
+  }
+
+  return r;
+}
+
+static INT gcd(INT a, INT b) {
+  INT t;
+
+  while(b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+// r * (n - k + i) / i is always whole, so dividing out the common factors
+// first keeps it in range for as long as the answer is.
+static INT choose(INT n, INT k) {
+  INT r;
+  INT i;
+  INT a;
+  INT b;
+  INT g;
+
+  if(k > n) return 0;
+  if(k > n - k) k = n - k;
+  for(r = 1, i = 1; i <= k; i++) {
+    a = n - k + i;
+    b = i;
+    g = gcd(r, b);
+    r /= g;
+    b /= g;
+    a /= b;
+    if(__builtin_mul_overflow(r, a, &r)) return -1;
+  }
+
+  return r;
+}
+
+static INT power(INT n, INT k) {
+  INT r;
+  INT i;
+
+  for(r = 1, i = 0; i < k; i++) {
+    if(__builtin_mul_overflow(r, n, &r)) return -1;
+  }
+
+  return r;
+}
+
+typedef void *(*TypedArrayElements)(const char *, bool, INT, INT *);
+
+static INT *typedArray(Name *n, INT create, INT *count, LexInfo *li) {
+  static TypedArrayElements elements = (TypedArrayElements) 0;
+  static char buf[128];
+  INT *ret;
+
+  if(elements == (TypedArrayElements) 0) {
+    elements = (TypedArrayElements) dlsym(RTLD_DEFAULT, "typedArrayElements");
+    if(elements == (TypedArrayElements) 0) slexception.chuck("the array library must be loaded", li);
+  }
+
+  if((ret = (INT *) (*elements)(n->getValue(), true, create, count)) == (INT *) 0) {
+    sprintf(buf, "%.64s is not an int64 typed array", n->getValue());
+    slexception.chuck(buf, li);
+  }
+
+  return ret;
+}
+
+static INT getInt(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  INT i;
+
+  n = o->getNumber(li, ee);
+  i = n->getInt();
+  n->release(li);
+
+  return i;
+}
+
+CombinatoricsFunction::CombinatoricsFunction(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn CombinatoricsFunction::action(ExecutionEnvironment *ee) {
+  const char **p;
+  Object *o1;
+  Object *o2;
+  Object *o3;
+  Code *code;
+  Generator *g;
+  INT n;
+  INT k;
+  INT i;
+  INT j;
+  INT index;
+  INT total;
+  INT count;
+  INT *out;
+  INT *list;
+  INT block;
+  INT v;
+  bool *used;
+  bool more;
+  OperatorReturn ret;
+
+  ret = or_continue;
+
+  switch(function) {
+    case COMB_HELP:
+      for(p = combinatoricsHelp; *p != (const char *) 0; p++) {
+        printf("%s\n", *p);
+      }
+      break;
+
+    case COMB_PERMUTATIONS:
+    case COMB_COMBINATIONS:
+    case COMB_PRODUCT:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      k = getInt(o2, getLexInfo(), ee);
+      n = getInt(o3, getLexInfo(), ee);
+      if((n < 0) || (k < 0)) slexception.chuck("n and k can't be negative", getLexInfo());
+
+      code = (Code *) 0;
+      try {
+        code = o1->getCode(getLexInfo(), ee);
+      } catch(Exception *e) { }
+
+      switch(function) {
+        case COMB_PERMUTATIONS: g = new Permutations(n, k); total = arrange(n, k); break;
+        case COMB_COMBINATIONS: g = new Combinations(n, k); total = choose(n, k); break;
+        default: g = new Product(n, k); total = power(n, k); break;
+      }
+      list = g->getList();
+
+      if(code != (Code *) 0) {
+        for(more = g->first(); more; more = g->next()) {
+          for(i = 0; i < k; i++) ee->stack.push(ee->cache.newNumber(list[i]));
+          try {
+            ret = code->action(ee);
+          } catch(Exception *e) {
+            delete g;
+            e->rechuck(getLexInfo());
+          }
+          if(ret != or_continue) {
+            if(ret == or_break) ret = or_continue;
+            break;
+          }
+        }
+        code->release(getLexInfo());
+      } else {
+        if((total < 0) || ((k > 0) && (total > ((INT) 1 << 40) / k))) {
+          delete g;
+          slexception.chuck("too many to fit in an array", getLexInfo());
+        }
+        try {
+          out = typedArray(o1->getName(getLexInfo(), ee), (total * k > 0 ? total * k : 1), &count, getLexInfo());
+          if(count < total * k) slexception.chuck("result array is too small", getLexInfo());
+        } catch(Exception *e) {
+          delete g;
+          e->rechuck(getLexInfo());
+        }
+        for(j = 0, more = g->first(); more; more = g->next()) {
+          for(i = 0; i < k; i++) out[j++] = list[i];
+        }
+        ee->stack.push(ee->cache.newNumber(total));
+      }
+
+      delete g;
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case COMB_UNRANK:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      k = getInt(o1, getLexInfo(), ee);
+      n = getInt(o2, getLexInfo(), ee);
+      index = getInt(o3, getLexInfo(), ee);
+      if((n < 0) || (k < 0) || (k > n)) slexception.chuck("k must be between 0 and n", getLexInfo());
+      total = arrange(n, k);
+      if((index < 0) || ((total >= 0) && (index >= total))) slexception.chuck("index out of range", getLexInfo());
+
+      // Position i has n-i numbers to choose from, and each choice there is
+      // followed by arrange(n-i-1, k-i-1) lists.
+      if((used = (bool *) malloc((n < 1 ? 1 : n) * sizeof(bool))) == (bool *) 0) slexception.chuck("malloc error", getLexInfo());
+      for(i = 0; i < n; i++) used[i] = false;
+      for(i = 0; i < k; i++) {
+        block = arrange(n - i - 1, k - i - 1);
+        if(block < 0) j = 0;
+        else {
+          j = index / block;
+          index %= block;
+        }
+        for(v = 0; used[v] || (j-- > 0); v++) ;
+        used[v] = true;
+        ee->stack.push(ee->cache.newNumber(v));
+      }
+      free(used);
+
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case COMB_ARRANGE:
+    case COMB_CHOOSE:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      k = getInt(o1, getLexInfo(), ee);
+      n = getInt(o2, getLexInfo(), ee);
+      if((n < 0) || (k < 0)) slexception.chuck("n and k can't be negative", getLexInfo());
+      total = (function == COMB_ARRANGE ? arrange(n, k) : choose(n, k));
+      if(total < 0) slexception.chuck("too big", getLexInfo());
+      ee->stack.push(ee->cache.newNumber(total));
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+  }
+
+  return ret;
+}
@@ -0,0 +1,314 @@
+/*
+
+MIT License
+
+Copyright (c) 2020-2023 Graeme Elsworthy <github@sharkshead.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "shalelib.h"
+
+#define MAJOR   (INT) 1
+#define MINOR   (INT) 0
+#define MICRO   (INT) 0
+
+const char *dequeHelp[] = {
+  "Deque library:",
+  "  create deque::()                     - push a new, empty double ended queue",
+  "  {value} {deque} pushfront deque::()  - add {value} to the front",
+  "  {value} {deque} pushback deque::()   - add {value} to the back",
+  "  {deque} popfront deque::()           - remove the front value and push it then true, or push false if",
+  "                                         the deque is empty",
+  "  {deque} popback deque::()            - remove the back value and push it then true, or push false",
+  "  {deque} front deque::()              - push the front value then true, or false, leaving it in the deque",
+  "  {deque} back deque::()               - push the back value then true, or false, leaving it in the deque",
+  "  {index} {deque} get deque::()        - push the value {index} places from the front then true, or false",
+  "  {deque} size deque::()               - number of values in the deque",
+  "  major version:: deque::              - major version number",
+  "  minor version:: deque::              - minor version number",
+  "  micro version:: deque::              - micro version number",
+  "  help deque::()                       - this",
+  (const char *) 0
+};
+
+const char *dequeType = "deque";
+
+#define DEQUE_HELP        0
+#define DEQUE_CREATE      1
+#define DEQUE_PUSHFRONT   2
+#define DEQUE_PUSHBACK    3
+#define DEQUE_POPFRONT    4
+#define DEQUE_POPBACK     5
+#define DEQUE_FRONT       6
+#define DEQUE_BACK        7
+#define DEQUE_GET         8
+#define DEQUE_SIZE        9
+
+// A ring buffer whose size is a power of two, so both ends are an index and a
+// mask away. It doubles when full, unrolling the ring into the new buffer.
+class Deque : public Handle {
+  public:
+    Deque(Cache *);
+    ~Deque();
+    void lock();
+    void unlock();
+    void pushFront(Object *);
+    void pushBack(Object *);
+    Object *popFront();
+    Object *popBack();
+    Object *get(INT);
+    INT size();
+
+  private:
+    Object **ring;
+    INT mask;
+    INT head;
+    INT count;
+    pthread_mutex_t mutex;
+    void grow();
+};
+
+class DequeFunction : public Operation {
+  public:
+    DequeFunction(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+static void addFunction(const char *name, int function) {
+  OperationList *ol;
+  Variable *v;
+
+  ol = new OperationList;
+  ol->addOperation(new DequeFunction(function, (LexInfo *) 0));
+  v = new Variable(name);
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
+extern "C" void slmain() {
+  Variable *v;
+
+  // Are we already loaded?
+  if(btree.findVariable("/help/deque") != (Variable *) 0) return;
+
+  addFunction("/help/deque", DEQUE_HELP);
+
+  v = new Variable("/major/version/deque");
+  v->setObject(mainEE.cache.newNumber(MAJOR));
+  btree.addVariable(v);
+
+  v = new Variable("/minor/version/deque");
+  v->setObject(mainEE.cache.newNumber(MINOR));
+  btree.addVariable(v);
+
+  v = new Variable("/micro/version/deque");
+  v->setObject(mainEE.cache.newNumber(MICRO));
+  btree.addVariable(v);
+
+  addFunction("/create/deque", DEQUE_CREATE);
+  addFunction("/pushfront/deque", DEQUE_PUSHFRONT);
+  addFunction("/pushback/deque", DEQUE_PUSHBACK);
+  addFunction("/popfront/deque", DEQUE_POPFRONT);
+  addFunction("/popback/deque", DEQUE_POPBACK);
+  addFunction("/front/deque", DEQUE_FRONT);
+  addFunction("/back/deque", DEQUE_BACK);
+  addFunction("/get/deque", DEQUE_GET);
+  addFunction("/size/deque", DEQUE_SIZE);
+}
+
+Deque::Deque(Cache *c) : Handle(dequeType, c) {
+  mask = 15;
+  head = 0;
+  count = 0;
+  if((ring = (Object **) malloc((mask + 1) * sizeof(Object *))) == (Object **) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Deque::~Deque() {
+  INT i;
+
+  for(i = 0; i < count; i++) ring[(head + i) & mask]->release((LexInfo *) 0);
+  free(ring);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Deque::lock() { if(useMutex) pthread_mutex_lock(&mutex); }
+void Deque::unlock() { if(useMutex) pthread_mutex_unlock(&mutex); }
+INT Deque::size() { return count; }
+
+void Deque::grow() {
+  Object **r;
+  INT i;
+
+  if((r = (Object **) malloc((mask + 1) * 2 * sizeof(Object *))) == (Object **) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  for(i = 0; i < count; i++) r[i] = ring[(head + i) & mask];
+  free(ring);
+  ring = r;
+  mask = mask * 2 + 1;
+  head = 0;
+}
+
+// The push functions take over the caller's hold on the value, and the pop
+// functions hand theirs back.
+void Deque::pushFront(Object *o) {
+  if(count > mask) grow();
+  head = (head - 1) & mask;
+  ring[head] = o;
+  count++;
+}
+
+void Deque::pushBack(Object *o) {
+  if(count > mask) grow();
+  ring[(head + count) & mask] = o;
+  count++;
+}
+
+Object *Deque::popFront() {
+  Object *o;
+
+  if(count == 0) return (Object *) 0;
+  o = ring[head];
+  head = (head + 1) & mask;
+  count--;
+
+  return o;
+}
+
+Object *Deque::popBack() {
+  if(count == 0) return (Object *) 0;
+  count--;
+
+  return ring[(head + count) & mask];
+}
+
+Object *Deque::get(INT i) {
+  if((i < 0) || (i >= count)) return (Object *) 0;
+
+  return ring[(head + i) & mask];
+}
+
+static Deque *findDeque(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(dequeType)) {
+    h->release(li);
+    slexception.chuck("deque not found", li);
+  }
+
+  return (Deque *) h;
+}
+
+DequeFunction::DequeFunction(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn DequeFunction::action(ExecutionEnvironment *ee) {
+  const char **p;
+  Object *o1;
+  Object *o2;
+  Object *v;
+  Number *n;
+  Deque *d;
+  INT i;
+
+  switch(function) {
+    case DEQUE_HELP:
+      for(p = dequeHelp; *p != (const char *) 0; p++) {
+        printf("%s\n", *p);
+      }
+      break;
+
+    case DEQUE_CREATE:
+      ee->stack.push(new Deque(&ee->cache));
+      break;
+
+    case DEQUE_PUSHFRONT:
+    case DEQUE_PUSHBACK:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      d = findDeque(o1, getLexInfo(), ee);
+      v = o2->resolveValue(getLexInfo(), ee);
+      d->lock();
+      try {
+        if(function == DEQUE_PUSHFRONT) d->pushFront(v);
+        else d->pushBack(v);
+      } catch(Exception *e) {
+        d->unlock();
+        v->release(getLexInfo());
+        e->rechuck(getLexInfo());
+      }
+      d->unlock();
+      d->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+
+    case DEQUE_POPFRONT:
+    case DEQUE_POPBACK:
+    case DEQUE_FRONT:
+    case DEQUE_BACK:
+    case DEQUE_GET:
+      o1 = ee->stack.pop(getLexInfo());
+      d = findDeque(o1, getLexInfo(), ee);
+      i = 0;
+      o2 = (Object *) 0;
+      v = (Object *) 0;
+      if(function == DEQUE_GET) {
+        o2 = ee->stack.pop(getLexInfo());
+        n = o2->getNumber(getLexInfo(), ee);
+        i = n->getInt();
+        n->release(getLexInfo());
+      }
+      d->lock();
+      switch(function) {
+        case DEQUE_POPFRONT: v = d->popFront(); break;
+        case DEQUE_POPBACK: v = d->popBack(); break;
+        case DEQUE_FRONT: if((v = d->get(0)) != (Object *) 0) v->hold(); break;
+        case DEQUE_BACK: if((v = d->get(d->size() - 1)) != (Object *) 0) v->hold(); break;
+        case DEQUE_GET: if((v = d->get(i)) != (Object *) 0) v->hold(); break;
+      }
+      d->unlock();
+      if(v != (Object *) 0) {
+        ee->stack.push(v);
+        ee->stack.push(ee->cache.newNumber((INT) 1));
+      } else {
+        ee->stack.push(ee->cache.newNumber((INT) 0));
+      }
+      d->release(getLexInfo());
+      o1->release(getLexInfo());
+      if(o2 != (Object *) 0) o2->release(getLexInfo());
+      break;
+
+    case DEQUE_SIZE:
+      o1 = ee->stack.pop(getLexInfo());
+      d = findDeque(o1, getLexInfo(), ee);
+      d->lock();
+      ee->stack.push(ee->cache.newNumber(d->size()));
+      d->unlock();
+      d->release(getLexInfo());
+      o1->release(getLexInfo());
+      break;
+  }
+
+  return or_continue;
+}
@@ -0,0 +1,682 @@
+/*
+
+MIT License
+
+Copyright (c) 2020-2023 Graeme Elsworthy <github@sharkshead.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "shalelib.h"
+
+#define MAJOR   (INT) 1
+#define MINOR   (INT) 0
+#define MICRO   (INT) 0
+
+const char *graphHelp[] = {
+  "Graph library:",
+  "  {nodes} create graph::()                         - push a new undirected graph with nodes 0 to {nodes}-1",
+  "  {nodes} directed graph::()                       - push a new directed graph",
+  "  {from} {to} {graph} edge graph::()               - add an edge of weight 1",
+  "  {from} {to} {weight} {graph} weighted graph::()  - add an edge with a weight, which can't be negative",
+  "  {from} {to} {graph} edges graph::()              - add an edge for each pair of elements in the int64",
+  "                                                     typed arrays {from} and {to}",
+  "  {graph} nodes graph::()                          - number of nodes",
+  "  {graph} size graph::()                           - number of edges",
+  "  {node} {result} {graph} neighbours graph::()     - put the nodes {node} has an edge to in the int64",
+  "                                                     typed array {result} and push how many there are",
+  "  {source} {result} {graph} bfs graph::()          - breadth first search. element n of the int64 typed",
+  "                                                     array {result} is set to the number of edges from",
+  "                                                     {source} to node n, or -1 if it can't be reached",
+  "  {source} {result} {graph} dfs graph::()          - depth first search. element n of the int64 typed",
+  "                                                     array {result} is set to the order node n was",
+  "                                                     visited in, counting from 0, or -1",
+  "  {source} {result} {graph} dijkstra graph::()     - shortest paths. element n of the double typed array",
+  "                                                     {result} is set to the length of the shortest path",
+  "                                                     from {source} to node n, or -1",
+  "  {result} {graph} components graph::()            - element n of the int64 typed array {result} is set",
+  "                                                     to the connected component of node n, numbered from",
+  "                                                     0, ignoring edge direction. pushes how many there are",
+  "  major version:: graph::                          - major version number",
+  "  minor version:: graph::                          - minor version number",
+  "  micro version:: graph::                          - micro version number",
+  "  help graph::()                                   - this",
+  "",
+  "  bfs, dfs and dijkstra push the number of nodes reached. The typed arrays are those of the array",
+  "  library, which must be loaded. A result array is created if it doesn't already exist.",
+  (const char *) 0
+};
+
+const char *graphType = "graph";
+
+#define GRAPH_HELP          0
+#define GRAPH_CREATE        1
+#define GRAPH_DIRECTED      2
+#define GRAPH_EDGE          3
+#define GRAPH_WEIGHTED      4
+#define GRAPH_EDGES         5
+#define GRAPH_NODES         6
+#define GRAPH_SIZE          7
+#define GRAPH_NEIGHBOURS    8
+#define GRAPH_BFS           9
+#define GRAPH_DFS           10
+#define GRAPH_DIJKSTRA      11
+#define GRAPH_COMPONENTS    12
+
+// Edges are collected in a list as they're added. The first search after a
+// change turns the list into compressed sparse row form: the edges out of node
+// n are targets[offsets[n]] up to targets[offsets[n+1]], so walking a node's
+// neighbours is a walk along one array.
+class Graph : public Handle {
+  public:
+    Graph(INT, bool, Cache *);
+    ~Graph();
+    void lock();
+    void unlock();
+    INT getNodes();
+    INT getEdges();
+    void addEdge(INT, INT, double);
+    INT neighbours(INT, INT *, INT);
+    INT degree(INT);
+    INT bfs(INT, INT *);
+    INT dfs(INT, INT *);
+    INT dijkstra(INT, double *);
+    INT components(INT *);
+
+  private:
+    INT nodes;
+    bool directed;
+    bool weighted;
+    INT edgeCount;
+    INT edgeCapacity;
+    INT *from;
+    INT *to;
+    double *weight;
+    bool built;
+    INT *offsets;
+    INT *targets;
+    double *weights;
+    pthread_mutex_t mutex;
+    void build();
+};
+
+class GraphFunction : public Operation {
+  public:
+    GraphFunction(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+static void addFunction(const char *name, int function) {
+  OperationList *ol;
+  Variable *v;
+
+  ol = new OperationList;
+  ol->addOperation(new GraphFunction(function, (LexInfo *) 0));
+  v = new Variable(name);
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
+extern "C" void slmain() {
+  Variable *v;
+
+  // Are we already loaded?
+  if(btree.findVariable("/help/graph") != (Variable *) 0) return;
+
+  addFunction("/help/graph", GRAPH_HELP);
+
+  v = new Variable("/major/version/graph");
+  v->setObject(mainEE.cache.newNumber(MAJOR));
+  btree.addVariable(v);
+
+  v = new Variable("/minor/version/graph");
+  v->setObject(mainEE.cache.newNumber(MINOR));
+  btree.addVariable(v);
+
+  v = new Variable("/micro/version/graph");
+  v->setObject(mainEE.cache.newNumber(MICRO));
+  btree.addVariable(v);
+
+  addFunction("/create/graph", GRAPH_CREATE);
+  addFunction("/directed/graph", GRAPH_DIRECTED);
+  addFunction("/edge/graph", GRAPH_EDGE);
+  addFunction("/weighted/graph", GRAPH_WEIGHTED);
+  addFunction("/edges/graph", GRAPH_EDGES);
+  addFunction("/nodes/graph", GRAPH_NODES);
+  addFunction("/size/graph", GRAPH_SIZE);
+  addFunction("/neighbours/graph", GRAPH_NEIGHBOURS);
+  addFunction("/bfs/graph", GRAPH_BFS);
+  addFunction("/dfs/graph", GRAPH_DFS);
+  addFunction("/dijkstra/graph", GRAPH_DIJKSTRA);
+  addFunction("/components/graph", GRAPH_COMPONENTS);
+}
+
+static void *allocate(INT n, size_t size) {
+  void *p;
+
+  if((p = malloc((n < 1 ? 1 : n) * size)) == (void *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+
+  return p;
+}
+
+Graph::Graph(INT n, bool d, Cache *c) : Handle(graphType, c) {
+  nodes = n;
+  directed = d;
+  weighted = false;
+  edgeCount = 0;
+  edgeCapacity = 0;
+  from = (INT *) 0;
+  to = (INT *) 0;
+  weight = (double *) 0;
+  built = false;
+  offsets = (INT *) 0;
+  targets = (INT *) 0;
+  weights = (double *) 0;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Graph::~Graph() {
+  free(from);
+  free(to);
+  free(weight);
+  free(offsets);
+  free(targets);
+  free(weights);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Graph::lock() { if(useMutex) pthread_mutex_lock(&mutex); }
+void Graph::unlock() { if(useMutex) pthread_mutex_unlock(&mutex); }
+INT Graph::getNodes() { return nodes; }
+INT Graph::getEdges() { return edgeCount; }
+
+void Graph::addEdge(INT f, INT t, double w) {
+  INT c;
+
+  if(edgeCount == edgeCapacity) {
+    c = (edgeCapacity == 0 ? 64 : edgeCapacity * 2);
+    if((from = (INT *) realloc(from, c * sizeof(INT))) == (INT *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+    if((to = (INT *) realloc(to, c * sizeof(INT))) == (INT *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+    if((weight = (double *) realloc(weight, c * sizeof(double))) == (double *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+    edgeCapacity = c;
+  }
+
+  from[edgeCount] = f;
+  to[edgeCount] = t;
+  weight[edgeCount] = w;
+  edgeCount++;
+  if(w != 1.0) weighted = true;
+  built = false;
+}
+
+// A counting sort of the edge list by source node. An undirected edge goes in
+// once for each end. Edges keep the order they were added in.
+void Graph::build() {
+  INT m;
+  INT i;
+  INT *pos;
+
+  if(built) return;
+
+  free(offsets);
+  free(targets);
+  free(weights);
+
+  m = (directed ? edgeCount : edgeCount * 2);
+  offsets = (INT *) allocate(nodes + 1, sizeof(INT));
+  targets = (INT *) allocate(m, sizeof(INT));
+  weights = (weighted ? (double *) allocate(m, sizeof(double)) : (double *) 0);
+
+  for(i = 0; i <= nodes; i++) offsets[i] = 0;
+  for(i = 0; i < edgeCount; i++) {
+    offsets[from[i] + 1]++;
+    if(! directed) offsets[to[i] + 1]++;
+  }
+  for(i = 0; i < nodes; i++) offsets[i + 1] += offsets[i];
+
+  pos = (INT *) allocate(nodes, sizeof(INT));
+  memcpy(pos, offsets, nodes * sizeof(INT));
+  for(i = 0; i < edgeCount; i++) {
+    if(weighted) weights[pos[from[i]]] = weight[i];
+    targets[pos[from[i]]++] = to[i];
+    if(! directed) {
+      if(weighted) weights[pos[to[i]]] = weight[i];
+      targets[pos[to[i]]++] = from[i];
+    }
+  }
+  free(pos);
+
+  built = true;
+}
+
+INT Graph::degree(INT n) {
+  build();
+  return offsets[n + 1] - offsets[n];
+}
+
+INT Graph::neighbours(INT n, INT *result, INT max) {
+  INT i;
+  INT j;
+
+  build();
+  for(i = offsets[n], j = 0; (i < offsets[n + 1]) && (j < max); i++, j++) result[j] = targets[i];
+
+  return j;
+}
+
+INT Graph::bfs(INT source, INT *dist) {
+  INT *queue;
+  INT head;
+  INT tail;
+  INT n;
+  INT i;
+  INT t;
+
+  build();
+  for(i = 0; i < nodes; i++) dist[i] = -1;
+  queue = (INT *) allocate(nodes, sizeof(INT));
+
+  dist[source] = 0;
+  queue[0] = source;
+  head = 0;
+  tail = 1;
+  while(head < tail) {
+    n = queue[head++];
+    for(i = offsets[n]; i < offsets[n + 1]; i++) {
+      t = targets[i];
+      if(dist[t] < 0) {
+        dist[t] = dist[n] + 1;
+        queue[tail++] = t;
+      }
+    }
+  }
+
+  free(queue);
+  return tail;
+}
+
+// Iterative, so a long path can't run off the end of the C stack. Each node on
+// the stack remembers how far through its edges it has got.
+INT Graph::dfs(INT source, INT *order) {
+  INT *stack;
+  INT *cursor;
+  INT sp;
+  INT n;
+  INT t;
+  INT visited;
+  INT i;
+
+  build();
+  for(i = 0; i < nodes; i++) order[i] = -1;
+  stack = (INT *) allocate(nodes, sizeof(INT));
+  cursor = (INT *) allocate(nodes, sizeof(INT));
+
+  visited = 0;
+  order[source] = visited++;
+  cursor[source] = offsets[source];
+  stack[0] = source;
+  sp = 1;
+  while(sp > 0) {
+    n = stack[sp - 1];
+    if(cursor[n] == offsets[n + 1]) {
+      sp--;
+      continue;
+    }
+    t = targets[cursor[n]++];
+    if(order[t] < 0) {
+      order[t] = visited++;
+      cursor[t] = offsets[t];
+      stack[sp++] = t;
+    }
+  }
+
+  free(cursor);
+  free(stack);
+  return visited;
+}
+
+class HeapEntry {
+  public:
+    double dist;
+    INT node;
+};
+
+static void heapPush(HeapEntry *h, INT *n, double d, INT node) {
+  INT i;
+  INT p;
+
+  for(i = (*n)++; i > 0; i = p) {
+    p = (i - 1) / 2;
+    if(h[p].dist <= d) break;
+    h[i] = h[p];
+  }
+  h[i].dist = d;
+  h[i].node = node;
+}
+
+static HeapEntry heapPop(HeapEntry *h, INT *n) {
+  HeapEntry ret;
+  HeapEntry t;
+  INT i;
+  INT c;
+
+  ret = h[0];
+  t = h[--(*n)];
+  for(i = 0; (c = 2 * i + 1) < *n; i = c) {
+    if((c + 1 < *n) && (h[c + 1].dist < h[c].dist)) c++;
+    if(t.dist <= h[c].dist) break;
+    h[i] = h[c];
+  }
+  h[i] = t;
+
+  return ret;
+}
+
+// A binary heap with lazy deletion: a node can be in the heap more than once
+// and entries older than its best distance are skipped when they come out.
+INT Graph::dijkstra(INT source, double *dist) {
+  HeapEntry *heap;
+  HeapEntry e;
+  INT size;
+  INT reached;
+  INT i;
+  INT t;
+  double d;
+
+  build();
+  for(i = 0; i < nodes; i++) dist[i] = -1.0;
+  heap = (HeapEntry *) allocate((directed ? edgeCount : edgeCount * 2) + 1, sizeof(HeapEntry));
+
+  reached = 0;
+  size = 0;
+  dist[source] = 0.0;
+  heapPush(heap, &size, 0.0, source);
+  while(size > 0) {
+    e = heapPop(heap, &size);
+    if(e.dist > dist[e.node]) continue;
+    reached++;
+    for(i = offsets[e.node]; i < offsets[e.node + 1]; i++) {
+      t = targets[i];
+      d = e.dist + (weighted ? weights[i] : 1.0);
+      if((dist[t] < 0.0) || (d < dist[t])) {
+        dist[t] = d;
+        heapPush(heap, &size, d, t);
+      }
+    }
+  }
+
+  free(heap);
+  return reached;
+}
+
+// Union-find over the edge list, then the roots numbered in node order.
+INT Graph::components(INT *comp) {
+  INT *parent;
+  INT *size;
+  INT i;
+  INT a;
+  INT b;
+  INT t;
+  INT count;
+
+  parent = (INT *) allocate(nodes, sizeof(INT));
+  size = (INT *) allocate(nodes, sizeof(INT));
+  for(i = 0; i < nodes; i++) {
+    parent[i] = i;
+    size[i] = 1;
+  }
+
+  for(i = 0; i < edgeCount; i++) {
+    for(a = from[i]; parent[a] != a; a = parent[a]) parent[a] = parent[parent[a]];
+    for(b = to[i]; parent[b] != b; b = parent[b]) parent[b] = parent[parent[b]];
+    if(a == b) continue;
+    if(size[a] < size[b]) { t = a; a = b; b = t; }
+    parent[b] = a;
+    size[a] += size[b];
+  }
+
+  count = 0;
+  for(i = 0; i < nodes; i++) comp[i] = -1;
+  for(i = 0; i < nodes; i++) {
+    for(a = i; parent[a] != a; a = parent[a]) ;
+    if(comp[a] < 0) comp[a] = count++;
+    comp[i] = comp[a];
+  }
+
+  free(size);
+  free(parent);
+  return count;
+}
+
+typedef void *(*TypedArrayElements)(const char *, bool, INT, INT *);
+
+// The elements of a typed array from the array library, creating it if create
+// is above zero and it doesn't exist. chuck keeps a pointer to the message
+// until it's printed, after this frame has gone, so the buffer is one per thread
+// rather than on the stack.
+static void *typedArray(Object *o, bool intRep, INT create, INT *count, LexInfo *li, ExecutionEnvironment *ee) {
+  static TypedArrayElements elements = (TypedArrayElements) 0;
+  static __thread char buf[128];
+  Name *n;
+  void *ret;
+
+  if(elements == (TypedArrayElements) 0) {
+    elements = (TypedArrayElements) dlsym(RTLD_DEFAULT, "typedArrayElements");
+    if(elements == (TypedArrayElements) 0) slexception.chuck("the array library must be loaded", li);
+  }
+
+  n = o->getName(li, ee);
+  if((ret = (*elements)(n->getValue(), intRep, create, count)) == (void *) 0) {
+    sprintf(buf, "%.64s is not %s typed array", n->getValue(), (intRep ? "an int64" : "a double"));
+    slexception.chuck(buf, li);
+  }
+
+  return ret;
+}
+
+static Graph *findGraph(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(graphType)) {
+    h->release(li);
+    slexception.chuck("graph not found", li);
+  }
+
+  return (Graph *) h;
+}
+
+static INT getInt(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  INT i;
+
+  n = o->getNumber(li, ee);
+  i = n->getInt();
+  n->release(li);
+
+  return i;
+}
+
+static void checkNode(Graph *g, INT n, LexInfo *li) {
+  if((n < 0) || (n >= g->getNodes())) slexception.chuck("node out of range", li);
+}
+
+GraphFunction::GraphFunction(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn GraphFunction::action(ExecutionEnvironment *ee) {
+  const char **p;
+  Object *o1;
+  Object *o2;
+  Object *o3;
+  Object *o4;
+  Number *n;
+  Graph *g;
+  INT i;
+  INT j;
+  INT k;
+  INT count;
+  INT fromCount;
+  INT toCount;
+  INT *ints;
+  INT *fromInts;
+  INT *toInts;
+  double *doubles;
+  double w;
+
+  switch(function) {
+    case GRAPH_HELP:
+      for(p = graphHelp; *p != (const char *) 0; p++) {
+        printf("%s\n", *p);
+      }
+      break;
+
+    case GRAPH_CREATE:
+    case GRAPH_DIRECTED:
+      o1 = ee->stack.pop(getLexInfo());
+      i = getInt(o1, getLexInfo(), ee);
+      o1->release(getLexInfo());
+      if(i < 1) slexception.chuck("a graph needs at least one node", getLexInfo());
+      ee->stack.push(new Graph(i, function == GRAPH_DIRECTED, &ee->cache));
+      break;
+
+    case GRAPH_EDGE:
+    case GRAPH_WEIGHTED:
+      o1 = ee->stack.pop(getLexInfo());
+      o4 = (function == GRAPH_WEIGHTED ? ee->stack.pop(getLexInfo()) : (Object *) 0);
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      g = findGraph(o1, getLexInfo(), ee);
+      j = getInt(o2, getLexInfo(), ee);
+      i = getInt(o3, getLexInfo(), ee);
+      checkNode(g, i, getLexInfo());
+      checkNode(g, j, getLexInfo());
+      w = 1.0;
+      if(o4 != (Object *) 0) {
+        n = o4->getNumber(getLexInfo(), ee);
+        w = n->getDouble();
+        n->release(getLexInfo());
+        if(w < 0.0) slexception.chuck("edge weights can't be negative", getLexInfo());
+        o4->release(getLexInfo());
+      }
+      g->lock();
+      g->addEdge(i, j, w);
+      g->unlock();
+      g->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case GRAPH_EDGES:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      g = findGraph(o1, getLexInfo(), ee);
+      toInts = (INT *) typedArray(o2, true, 0, &toCount, getLexInfo(), ee);
+      fromInts = (INT *) typedArray(o3, true, 0, &fromCount, getLexInfo(), ee);
+      if(fromCount != toCount) slexception.chuck("edge arrays are different lengths", getLexInfo());
+      for(k = 0; k < fromCount; k++) {
+        checkNode(g, fromInts[k], getLexInfo());
+        checkNode(g, toInts[k], getLexInfo());
+      }
+      g->lock();
+      for(k = 0; k < fromCount; k++) g->addEdge(fromInts[k], toInts[k], 1.0);
+      g->unlock();
+      g->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case GRAPH_NODES:
+    case GRAPH_SIZE:
+      o1 = ee->stack.pop(getLexInfo());
+      g = findGraph(o1, getLexInfo(), ee);
+      g->lock();
+      ee->stack.push(ee->cache.newNumber(function == GRAPH_NODES ? g->getNodes() : g->getEdges()));
+      g->unlock();
+      g->release(getLexInfo());
+      o1->release(getLexInfo());
+      break;
+
+    case GRAPH_NEIGHBOURS:
+    case GRAPH_BFS:
+    case GRAPH_DFS:
+    case GRAPH_DIJKSTRA:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      g = findGraph(o1, getLexInfo(), ee);
+      i = getInt(o3, getLexInfo(), ee);
+      checkNode(g, i, getLexInfo());
+      g->lock();
+      try {
+        if(function == GRAPH_NEIGHBOURS) {
+          k = g->degree(i);
+          ints = (INT *) typedArray(o2, true, (k > g->getNodes() ? k : g->getNodes()), &count, getLexInfo(), ee);
+          if(count < k) slexception.chuck("result array is too small", getLexInfo());
+          k = g->neighbours(i, ints, count);
+        } else if(function == GRAPH_DIJKSTRA) {
+          doubles = (double *) typedArray(o2, false, g->getNodes(), &count, getLexInfo(), ee);
+          if(count < g->getNodes()) slexception.chuck("result array is too small", getLexInfo());
+          k = g->dijkstra(i, doubles);
+        } else {
+          ints = (INT *) typedArray(o2, true, g->getNodes(), &count, getLexInfo(), ee);
+          if(count < g->getNodes()) slexception.chuck("result array is too small", getLexInfo());
+          k = (function == GRAPH_BFS ? g->bfs(i, ints) : g->dfs(i, ints));
+        }
+      } catch(Exception *e) {
+        g->unlock();
+        e->rechuck(getLexInfo());
+      }
+      g->unlock();
+      ee->stack.push(ee->cache.newNumber(k));
+      g->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case GRAPH_COMPONENTS:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      g = findGraph(o1, getLexInfo(), ee);
+      g->lock();
+      try {
+        ints = (INT *) typedArray(o2, true, g->getNodes(), &count, getLexInfo(), ee);
+        if(count < g->getNodes()) slexception.chuck("result array is too small", getLexInfo());
+        k = g->components(ints);
+      } catch(Exception *e) {
+        g->unlock();
+        e->rechuck(getLexInfo());
+      }
+      g->unlock();
+      ee->stack.push(ee->cache.newNumber(k));
+      g->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+  }
+
+  return or_continue;
+}
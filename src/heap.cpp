@@ -0,0 +1,325 @@
+/*
+
+MIT License
+
+Copyright (c) 2020-2023 Graeme Elsworthy <github@sharkshead.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "shalelib.h"
+
+#define MAJOR   (INT) 1
+#define MINOR   (INT) 0
+#define MICRO   (INT) 0
+
+const char *heapHelp[] = {
+  "Heap library:",
+  "  create heap::()                          - push a new, empty priority queue",
+  "  {value} {priority} {heap} push heap::()  - add {value} with the number {priority}",
+  "  {heap} popmin heap::()                   - remove the value with the lowest priority and push it,",
+  "                                             then its priority, then true. pushes false if the heap",
+  "                                             is empty. values with equal priority come out in the",
+  "                                             order they went in",
+  "  {heap} peek heap::()                     - as popmin, but leave the value on the heap",
+  "  {heap} size heap::()                     - number of values on the heap",
+  "  major version:: heap::                   - major version number",
+  "  minor version:: heap::                   - minor version number",
+  "  micro version:: heap::                   - micro version number",
+  "  help heap::()                            - this",
+  (const char *) 0
+};
+
+const char *heapType = "heap";
+
+#define HEAP_HELP     0
+#define HEAP_CREATE   1
+#define HEAP_PUSH     2
+#define HEAP_POP      3
+#define HEAP_PEEK     4
+#define HEAP_SIZE     5
+
+#define HEAP_ARITY    4
+
+class HeapItem {
+  public:
+    bool intRep;
+    union {
+      INT i;
+      double d;
+    };
+    unsigned long long order;
+    Object *value;
+};
+
+// A 4-ary min heap, kept in one array. Four children to a node halves the depth
+// of a binary heap, and the children share a cache line or two, which more than
+// pays for the extra compares on each level of a pop.
+class Heap : public Handle {
+  public:
+    Heap(Cache *);
+    ~Heap();
+    void lock();
+    void unlock();
+    void push(HeapItem *);
+    bool pop(HeapItem *);
+    bool peek(HeapItem *);
+    INT size();
+
+  private:
+    HeapItem *items;
+    INT count;
+    INT capacity;
+    unsigned long long order;
+    pthread_mutex_t mutex;
+};
+
+class HeapFunction : public Operation {
+  public:
+    HeapFunction(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+static void addFunction(const char *name, int function) {
+  OperationList *ol;
+  Variable *v;
+
+  ol = new OperationList;
+  ol->addOperation(new HeapFunction(function, (LexInfo *) 0));
+  v = new Variable(name);
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
+extern "C" void slmain() {
+  Variable *v;
+
+  // Are we already loaded?
+  if(btree.findVariable("/help/heap") != (Variable *) 0) return;
+
+  addFunction("/help/heap", HEAP_HELP);
+
+  v = new Variable("/major/version/heap");
+  v->setObject(mainEE.cache.newNumber(MAJOR));
+  btree.addVariable(v);
+
+  v = new Variable("/minor/version/heap");
+  v->setObject(mainEE.cache.newNumber(MINOR));
+  btree.addVariable(v);
+
+  v = new Variable("/micro/version/heap");
+  v->setObject(mainEE.cache.newNumber(MICRO));
+  btree.addVariable(v);
+
+  addFunction("/create/heap", HEAP_CREATE);
+  addFunction("/push/heap", HEAP_PUSH);
+  addFunction("/popmin/heap", HEAP_POP);
+  addFunction("/peek/heap", HEAP_PEEK);
+  addFunction("/size/heap", HEAP_SIZE);
+}
+
+// Lower priority first, then first in first out.
+static inline bool before(HeapItem *a, HeapItem *b) {
+  if(a->intRep && b->intRep) {
+    if(a->i != b->i) return a->i < b->i;
+  } else {
+    double x = (a->intRep ? (double) a->i : a->d);
+    double y = (b->intRep ? (double) b->i : b->d);
+    if(x != y) return x < y;
+  }
+
+  return a->order < b->order;
+}
+
+Heap::Heap(Cache *c) : Handle(heapType, c) {
+  count = 0;
+  capacity = 16;
+  order = 0;
+  if((items = (HeapItem *) malloc(capacity * sizeof(HeapItem))) == (HeapItem *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Heap::~Heap() {
+  INT i;
+
+  for(i = 0; i < count; i++) items[i].value->release((LexInfo *) 0);
+  free(items);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Heap::lock() { if(useMutex) pthread_mutex_lock(&mutex); }
+void Heap::unlock() { if(useMutex) pthread_mutex_unlock(&mutex); }
+INT Heap::size() { return count; }
+
+// Takes over the item's hold on its value.
+void Heap::push(HeapItem *it) {
+  HeapItem *p;
+  INT i;
+  INT parent;
+  HeapItem t;
+
+  if(count == capacity) {
+    if((p = (HeapItem *) realloc(items, capacity * 2 * sizeof(HeapItem))) == (HeapItem *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+    items = p;
+    capacity *= 2;
+  }
+
+  t = *it;
+  t.order = order++;
+  for(i = count++; i > 0; i = parent) {
+    parent = (i - 1) / HEAP_ARITY;
+    if(! before(&t, &items[parent])) break;
+    items[i] = items[parent];
+  }
+  items[i] = t;
+}
+
+// The caller gets the heap's hold on the value.
+bool Heap::pop(HeapItem *ret) {
+  HeapItem t;
+  INT i;
+  INT c;
+  INT best;
+  INT last;
+
+  if(count == 0) return false;
+
+  *ret = items[0];
+  t = items[--count];
+
+  i = 0;
+  while((c = i * HEAP_ARITY + 1) < count) {
+    best = c;
+    last = c + HEAP_ARITY;
+    if(last > count) last = count;
+    for(c++; c < last; c++) {
+      if(before(&items[c], &items[best])) best = c;
+    }
+    if(! before(&items[best], &t)) break;
+    items[i] = items[best];
+    i = best;
+  }
+  items[i] = t;
+
+  return true;
+}
+
+bool Heap::peek(HeapItem *ret) {
+  if(count == 0) return false;
+  *ret = items[0];
+  return true;
+}
+
+static Heap *findHeap(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(heapType)) {
+    h->release(li);
+    slexception.chuck("heap not found", li);
+  }
+
+  return (Heap *) h;
+}
+
+HeapFunction::HeapFunction(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn HeapFunction::action(ExecutionEnvironment *ee) {
+  const char **p;
+  Object *o1;
+  Object *o2;
+  Object *o3;
+  Number *n;
+  Heap *h;
+  HeapItem it;
+  bool found;
+
+  switch(function) {
+    case HEAP_HELP:
+      for(p = heapHelp; *p != (const char *) 0; p++) {
+        printf("%s\n", *p);
+      }
+      break;
+
+    case HEAP_CREATE:
+      ee->stack.push(new Heap(&ee->cache));
+      break;
+
+    case HEAP_PUSH:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      h = findHeap(o1, getLexInfo(), ee);
+      n = o2->getNumber(getLexInfo(), ee);
+      if((it.intRep = n->isInt())) it.i = n->getInt();
+      else it.d = n->getDouble();
+      n->release(getLexInfo());
+      it.value = o3->resolveValue(getLexInfo(), ee);
+      h->lock();
+      try {
+        h->push(&it);
+      } catch(Exception *e) {
+        h->unlock();
+        it.value->release(getLexInfo());
+        e->rechuck(getLexInfo());
+      }
+      h->unlock();
+      h->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case HEAP_POP:
+    case HEAP_PEEK:
+      o1 = ee->stack.pop(getLexInfo());
+      h = findHeap(o1, getLexInfo(), ee);
+      h->lock();
+      if(function == HEAP_POP) found = h->pop(&it);
+      else if((found = h->peek(&it))) it.value->hold();
+      h->unlock();
+      if(found) {
+        ee->stack.push(it.value);
+        if(it.intRep) ee->stack.push(ee->cache.newNumber(it.i));
+        else ee->stack.push(ee->cache.newNumber(it.d));
+        ee->stack.push(ee->cache.newNumber((INT) 1));
+      } else {
+        ee->stack.push(ee->cache.newNumber((INT) 0));
+      }
+      h->release(getLexInfo());
+      o1->release(getLexInfo());
+      break;
+
+    case HEAP_SIZE:
+      o1 = ee->stack.pop(getLexInfo());
+      h = findHeap(o1, getLexInfo(), ee);
+      h->lock();
+      ee->stack.push(ee->cache.newNumber(h->size()));
+      h->unlock();
+      h->release(getLexInfo());
+      o1->release(getLexInfo());
+      break;
+  }
+
+  return or_continue;
+}
@@ -0,0 +1,776 @@
+/*
+
+MIT License
+
+Copyright (c) 2020-2023 Graeme Elsworthy <github@sharkshead.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "shalelib.h"
+
+#define MAJOR   (INT) 1
+#define MINOR   (INT) 0
+#define MICRO   (INT) 2
+
+const char *mapHelp[] = {
+  "Map library:",
+  "  create map::()                     - push a new, empty map to keep in a variable,",
+  "                                       eg m var m create map::() =",
+  "  {value} {key} {map} put map::()    - set the value of {key} to {value}. keys are numbers,",
+  "                                       other than NaN, or strings, values are anything a",
+  "                                       variable can hold",
+  "  {key} {map} get map::()            - if {key} is in the map it pushes the value then true,",
+  "                                       otherwise it pushes false",
+  "  {key} {map} has map::()            - true if {key} is in the map",
+  "  {key} {map} remove map::()         - remove {key} from the map, if it's there",
+  "  {map} size map::()                 - number of keys in the map",
+  "  {map} {code} each map::()          - run {code} for each key in no particular order, with the",
+  "                                       key and then the value on the stack. break stops early",
+  "  major version:: map::              - major version number",
+  "  minor version:: map::              - minor version number",
+  "  micro version:: map::              - micro version number",
+  "  help map::()                       - this",
+  (const char *) 0
+};
+
+const char *mapType = "map";
+
+#define MAP_EMPTY     0
+#define MAP_MOVED     1
+#define MAP_INT       2
+#define MAP_DOUBLE    3
+#define MAP_STRING    4
+
+#define MAP_INITIAL   16
+#define MAP_STEP      8
+
+// A key taken from the stack. The string isn't copied until the key is stored.
+class MapKey {
+  public:
+    int kind;
+    unsigned int hash;
+    union {
+      INT i;
+      double d;
+      const char *s;
+    };
+};
+
+// One slot of the table. The hash is kept with the key so probing and growing
+// never rehash, and string keys are only compared when the hashes match.
+class MapEntry {
+  public:
+    int kind;
+    unsigned int hash;
+    union {
+      INT i;
+      double d;
+      char *s;
+    };
+    Object *value;
+};
+
+// An open addressed hash table with linear probing. When it gets three quarters
+// full a table twice the size is allocated, and every later put or remove moves
+// a few slots of the old table across, so no single call pays for the whole
+// rehash. Until the move is done, keys are looked for in both tables.
+class Map : public Handle {
+  public:
+    Map(Cache *);
+    ~Map();
+    void lock();
+    void unlock();
+    Object *get(MapKey *);
+    void put(MapKey *, Object *);
+    bool remove(MapKey *);
+    INT size();
+    INT entries(MapEntry **);
+
+  private:
+    MapEntry *table;
+    unsigned int mask;
+    INT count;
+    MapEntry *old;
+    unsigned int oldMask;
+    INT oldCount;
+    unsigned int oldNext;
+    pthread_mutex_t mutex;
+    MapEntry *newTable(unsigned int);
+    MapEntry *find(MapEntry *, unsigned int, MapKey *);
+    void insert(MapEntry *);
+    void grow();
+    void step(int);
+    void freeTable(MapEntry *, unsigned int);
+};
+
+class MapHelp : public Operation {
+  public:
+    MapHelp(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class MapCreate : public Operation {
+  public:
+    MapCreate(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class MapPut : public Operation {
+  public:
+    MapPut(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class MapGet : public Operation {
+  public:
+    MapGet(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class MapHas : public Operation {
+  public:
+    MapHas(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class MapRemove : public Operation {
+  public:
+    MapRemove(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class MapSize : public Operation {
+  public:
+    MapSize(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class MapEach : public Operation {
+  public:
+    MapEach(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+extern "C" void slmain() {
+  OperationList *ol;
+  Variable *v;
+
+  // Are we already loaded?
+  if(btree.findVariable("/help/map") != (Variable *) 0) return;
+
+  // help map::
+  ol = new OperationList;
+  ol->addOperation(new MapHelp((LexInfo *) 0));
+  v = new Variable("/help/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  v = new Variable("/major/version/map");
+  v->setObject(mainEE.cache.newNumber(MAJOR));
+  btree.addVariable(v);
+
+  v = new Variable("/minor/version/map");
+  v->setObject(mainEE.cache.newNumber(MINOR));
+  btree.addVariable(v);
+
+  v = new Variable("/micro/version/map");
+  v->setObject(mainEE.cache.newNumber(MICRO));
+  btree.addVariable(v);
+
+  // create map::
+  ol = new OperationList;
+  ol->addOperation(new MapCreate((LexInfo *) 0));
+  v = new Variable("/create/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // put map::
+  ol = new OperationList;
+  ol->addOperation(new MapPut((LexInfo *) 0));
+  v = new Variable("/put/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // get map::
+  ol = new OperationList;
+  ol->addOperation(new MapGet((LexInfo *) 0));
+  v = new Variable("/get/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // has map::
+  ol = new OperationList;
+  ol->addOperation(new MapHas((LexInfo *) 0));
+  v = new Variable("/has/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // remove map::
+  ol = new OperationList;
+  ol->addOperation(new MapRemove((LexInfo *) 0));
+  v = new Variable("/remove/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // size map::
+  ol = new OperationList;
+  ol->addOperation(new MapSize((LexInfo *) 0));
+  v = new Variable("/size/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+
+  // each map::
+  ol = new OperationList;
+  ol->addOperation(new MapEach((LexInfo *) 0));
+  v = new Variable("/each/map");
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
+static unsigned int hashInt(INT i) {
+  unsigned long long h;
+
+  h = (unsigned long long) i;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return (unsigned int) h;
+}
+
+static unsigned int hashString(const char *s) {
+  unsigned int h;
+
+  for(h = 2166136261U; *s != 0; s++) h = (h ^ (unsigned char) *s) * 16777619U;
+
+  return h;
+}
+
+// Numbers with no fractional part are int keys, so 3 and 3.0 are the same key.
+// NaN isn't equal to itself, so it could never be found again and isn't a key.
+static void mapKey(Object *o, MapKey *k, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  String *s;
+  INT bits;
+  bool found;
+
+  found = false;
+  try {
+    n = o->getNumber(li, ee);
+    if(n->isInt()) {
+      k->kind = MAP_INT;
+      k->i = n->getInt();
+    } else if((n->getDouble() > -9.2e18) && (n->getDouble() < 9.2e18) && (n->getDouble() == (double) (INT) n->getDouble())) {
+      k->kind = MAP_INT;
+      k->i = (INT) n->getDouble();
+    } else {
+      k->kind = MAP_DOUBLE;
+      k->d = n->getDouble();
+    }
+    n->release(li);
+    found = true;
+  } catch(Exception *e) { }
+
+  if(found) {
+    if((k->kind == MAP_DOUBLE) && isnan(k->d)) slexception.chuck("map key can't be NaN", li);
+    if(k->kind == MAP_INT) k->hash = hashInt(k->i);
+    else { memcpy(&bits, &k->d, sizeof(bits)); k->hash = hashInt(bits); }
+    return;
+  }
+
+  // The String stays held by the variable or the stack entry we were given,
+  // so its value lives until the caller releases o.
+  try {
+    s = o->getString(li, ee);
+    k->kind = MAP_STRING;
+    k->s = s->getValue();
+    k->hash = hashString(k->s);
+    s->release(li);
+    found = true;
+  } catch(Exception *e) { }
+
+  if(! found) slexception.chuck("map key must be a number or a string", li);
+}
+
+static Map *findMap(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(mapType)) {
+    h->release(li);
+    slexception.chuck("map not found", li);
+  }
+
+  return (Map *) h;
+}
+
+static bool sameKey(MapEntry *e, MapKey *k) {
+  if((e->kind != k->kind) || (e->hash != k->hash)) return false;
+  switch(k->kind) {
+    case MAP_INT: return e->i == k->i;
+    case MAP_DOUBLE: return e->d == k->d;
+    case MAP_STRING: return strcmp(e->s, k->s) == 0;
+  }
+
+  return false;
+}
+
+Map::Map(Cache *c) : Handle(mapType, c) {
+  table = newTable(MAP_INITIAL);
+  mask = MAP_INITIAL - 1;
+  count = 0;
+  old = (MapEntry *) 0;
+  oldMask = 0;
+  oldCount = 0;
+  oldNext = 0;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Map::~Map() {
+  freeTable(table, mask);
+  if(old != (MapEntry *) 0) freeTable(old, oldMask);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Map::lock() { if(useMutex) pthread_mutex_lock(&mutex); }
+void Map::unlock() { if(useMutex) pthread_mutex_unlock(&mutex); }
+
+MapEntry *Map::newTable(unsigned int n) {
+  MapEntry *t;
+  unsigned int i;
+
+  if((t = (MapEntry *) malloc(n * sizeof(MapEntry))) == (MapEntry *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  for(i = 0; i < n; i++) t[i].kind = MAP_EMPTY;
+
+  return t;
+}
+
+void Map::freeTable(MapEntry *t, unsigned int m) {
+  unsigned int i;
+
+  for(i = 0; i <= m; i++) {
+    if(t[i].kind >= MAP_INT) {
+      if(t[i].kind == MAP_STRING) free(t[i].s);
+      t[i].value->release((LexInfo *) 0);
+    }
+  }
+  free(t);
+}
+
+MapEntry *Map::find(MapEntry *t, unsigned int m, MapKey *k) {
+  unsigned int i;
+
+  for(i = k->hash & m; t[i].kind != MAP_EMPTY; i = (i + 1) & m) {
+    if(sameKey(&t[i], k)) return &t[i];
+  }
+
+  return (MapEntry *) 0;
+}
+
+// Only used for keys known not to be in the new table.
+void Map::insert(MapEntry *e) {
+  unsigned int i;
+
+  for(i = e->hash & mask; table[i].kind != MAP_EMPTY; i = (i + 1) & mask) ;
+  table[i] = *e;
+  count++;
+}
+
+void Map::grow() {
+  // Still moving the last lot across? Finish that first.
+  if(old != (MapEntry *) 0) step(oldMask + 1);
+
+  old = table;
+  oldMask = mask;
+  oldCount = count;
+  oldNext = 0;
+  mask = (mask << 1) | 1;
+  table = newTable(mask + 1);
+  count = 0;
+}
+
+// Move up to n slots of the old table into the new one. The slots left behind
+// are marked as moved rather than empty so that probes for keys still in the
+// old table carry on past them.
+void Map::step(int n) {
+  while((old != (MapEntry *) 0) && (n-- > 0)) {
+    if(old[oldNext].kind >= MAP_INT) {
+      insert(&old[oldNext]);
+      old[oldNext].kind = MAP_MOVED;
+      oldCount--;
+    }
+    if(++oldNext > oldMask) {
+      free(old);
+      old = (MapEntry *) 0;
+    }
+  }
+}
+
+Object *Map::get(MapKey *k) {
+  MapEntry *e;
+
+  if((e = find(table, mask, k)) == (MapEntry *) 0) {
+    if(old == (MapEntry *) 0) return (Object *) 0;
+    if((e = find(old, oldMask, k)) == (MapEntry *) 0) return (Object *) 0;
+  }
+
+  return e->value;
+}
+
+// Takes over the caller's hold on value.
+void Map::put(MapKey *k, Object *value) {
+  MapEntry *e;
+  MapEntry n;
+  Object *o;
+
+  step(MAP_STEP);
+
+  if((e = find(table, mask, k)) != (MapEntry *) 0) {
+    o = e->value;
+    e->value = value;
+    o->release((LexInfo *) 0);
+    return;
+  }
+
+  if((old != (MapEntry *) 0) && ((e = find(old, oldMask, k)) != (MapEntry *) 0)) {
+    n = *e;
+    e->kind = MAP_MOVED;
+    oldCount--;
+    o = n.value;
+    n.value = value;
+    insert(&n);
+    o->release((LexInfo *) 0);
+    return;
+  }
+
+  if((count + oldCount + 1) * 4 > (INT) (mask + 1) * 3) grow();
+
+  n.kind = k->kind;
+  n.hash = k->hash;
+  switch(k->kind) {
+    case MAP_INT: n.i = k->i; break;
+    case MAP_DOUBLE: n.d = k->d; break;
+    case MAP_STRING:
+      if((n.s = strdup(k->s)) == (char *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+      break;
+  }
+  n.value = value;
+  insert(&n);
+}
+
+bool Map::remove(MapKey *k) {
+  MapEntry *e;
+  unsigned int i;
+  unsigned int j;
+  Object *o;
+
+  step(MAP_STEP);
+
+  if((old != (MapEntry *) 0) && ((e = find(old, oldMask, k)) != (MapEntry *) 0)) {
+    if(e->kind == MAP_STRING) free(e->s);
+    o = e->value;
+    e->kind = MAP_MOVED;
+    oldCount--;
+    o->release((LexInfo *) 0);
+    return true;
+  }
+
+  if((e = find(table, mask, k)) == (MapEntry *) 0) return false;
+
+  if(e->kind == MAP_STRING) free(e->s);
+  o = e->value;
+  count--;
+
+  // Shuffle back any later entries in the run that would otherwise be cut off
+  // from their home slot, so the new table never needs tombstones.
+  i = e - table;
+  for(j = (i + 1) & mask; table[j].kind != MAP_EMPTY; j = (j + 1) & mask) {
+    if(((j - (table[j].hash & mask)) & mask) >= ((j - i) & mask)) {
+      table[i] = table[j];
+      i = j;
+    }
+  }
+  table[i].kind = MAP_EMPTY;
+
+  o->release((LexInfo *) 0);
+  return true;
+}
+
+INT Map::size() { return count + oldCount; }
+
+// A copy of every entry, with each value held and each string key duplicated.
+INT Map::entries(MapEntry **ret) {
+  MapEntry *r;
+  INT n;
+  unsigned int i;
+  int t;
+  MapEntry *tab;
+  unsigned int m;
+
+  if((r = (MapEntry *) malloc((size() + 1) * sizeof(MapEntry))) == (MapEntry *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+
+  n = 0;
+  for(t = 0; t < 2; t++) {
+    tab = (t == 0 ? table : old);
+    m = (t == 0 ? mask : oldMask);
+    if(tab == (MapEntry *) 0) continue;
+    for(i = 0; i <= m; i++) {
+      if(tab[i].kind >= MAP_INT) {
+        r[n] = tab[i];
+        if(r[n].kind == MAP_STRING) {
+          if((r[n].s = strdup(tab[i].s)) == (char *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+        }
+        r[n].value->hold();
+        n++;
+      }
+    }
+  }
+
+  *ret = r;
+  return n;
+}
+
+MapHelp::MapHelp(LexInfo *li) : Operation(li) { }
+
+OperatorReturn MapHelp::action(ExecutionEnvironment *ee) {
+  const char **p;
+
+  for(p = mapHelp; *p != (const char *) 0; p++) {
+    printf("%s\n", *p);
+  }
+
+  return or_continue;
+}
+
+MapCreate::MapCreate(LexInfo *li) : Operation(li) { }
+
+OperatorReturn MapCreate::action(ExecutionEnvironment *ee) {
+  ee->stack.push(new Map(&ee->cache));
+
+  return or_continue;
+}
+
+MapPut::MapPut(LexInfo *li) : Operation(li) { }
+
+OperatorReturn MapPut::action(ExecutionEnvironment *ee) {
+  Object *map;
+  Object *key;
+  Object *value;
+  Map *m;
+  MapKey k;
+  Object *v;
+
+  map = ee->stack.pop(getLexInfo());
+  key = ee->stack.pop(getLexInfo());
+  value = ee->stack.pop(getLexInfo());
+
+  m = findMap(map, getLexInfo(), ee);
+  mapKey(key, &k, getLexInfo(), ee);
+  v = value->resolveValue(getLexInfo(), ee);
+
+  m->lock();
+  m->put(&k, v);
+  m->unlock();
+
+  m->release(getLexInfo());
+  map->release(getLexInfo());
+  key->release(getLexInfo());
+  value->release(getLexInfo());
+
+  return or_continue;
+}
+
+MapGet::MapGet(LexInfo *li) : Operation(li) { }
+
+OperatorReturn MapGet::action(ExecutionEnvironment *ee) {
+  Object *map;
+  Object *key;
+  Map *m;
+  MapKey k;
+  Object *v;
+
+  map = ee->stack.pop(getLexInfo());
+  key = ee->stack.pop(getLexInfo());
+
+  m = findMap(map, getLexInfo(), ee);
+  mapKey(key, &k, getLexInfo(), ee);
+
+  m->lock();
+  if((v = m->get(&k)) != (Object *) 0) v->hold();
+  m->unlock();
+
+  if(v != (Object *) 0) {
+    ee->stack.push(v);
+    ee->stack.push(ee->cache.newNumber((INT) 1));
+  } else {
+    ee->stack.push(ee->cache.newNumber((INT) 0));
+  }
+
+  m->release(getLexInfo());
+  map->release(getLexInfo());
+  key->release(getLexInfo());
+
+  return or_continue;
+}
+
+MapHas::MapHas(LexInfo *li) : Operation(li) { }
+
+OperatorReturn MapHas::action(ExecutionEnvironment *ee) {
+  Object *map;
+  Object *key;
+  Map *m;
+  MapKey k;
+  bool found;
+
+  map = ee->stack.pop(getLexInfo());
+  key = ee->stack.pop(getLexInfo());
+
+  m = findMap(map, getLexInfo(), ee);
+  mapKey(key, &k, getLexInfo(), ee);
+
+  m->lock();
+  found = (m->get(&k) != (Object *) 0);
+  m->unlock();
+
+  ee->stack.push(ee->cache.newNumber((INT) (found ? 1 : 0)));
+
+  m->release(getLexInfo());
+  map->release(getLexInfo());
+  key->release(getLexInfo());
+
+  return or_continue;
+}
+
+MapRemove::MapRemove(LexInfo *li) : Operation(li) { }
+
+OperatorReturn MapRemove::action(ExecutionEnvironment *ee) {
+  Object *map;
+  Object *key;
+  Map *m;
+  MapKey k;
+
+  map = ee->stack.pop(getLexInfo());
+  key = ee->stack.pop(getLexInfo());
+
+  m = findMap(map, getLexInfo(), ee);
+  mapKey(key, &k, getLexInfo(), ee);
+
+  m->lock();
+  m->remove(&k);
+  m->unlock();
+
+  m->release(getLexInfo());
+  map->release(getLexInfo());
+  key->release(getLexInfo());
+
+  return or_continue;
+}
+
+MapSize::MapSize(LexInfo *li) : Operation(li) { }
+
+OperatorReturn MapSize::action(ExecutionEnvironment *ee) {
+  Object *map;
+  Map *m;
+  INT n;
+
+  map = ee->stack.pop(getLexInfo());
+
+  m = findMap(map, getLexInfo(), ee);
+
+  m->lock();
+  n = m->size();
+  m->unlock();
+
+  ee->stack.push(ee->cache.newNumber(n));
+
+  m->release(getLexInfo());
+  map->release(getLexInfo());
+
+  return or_continue;
+}
+
+MapEach::MapEach(LexInfo *li) : Operation(li) { }
+
+// The entries are copied before any code runs, so the code is free to change
+// the map, and other threads can use it, while we go through them.
+OperatorReturn MapEach::action(ExecutionEnvironment *ee) {
+  Object *map;
+  Object *code;
+  Map *m;
+  Code *c;
+  MapEntry *e;
+  INT n;
+  INT i;
+  OperatorReturn ret;
+
+  code = ee->stack.pop(getLexInfo());
+  map = ee->stack.pop(getLexInfo());
+
+  m = findMap(map, getLexInfo(), ee);
+  c = code->getCode(getLexInfo(), ee);
+
+  m->lock();
+  try {
+    n = m->entries(&e);
+  } catch(Exception *ex) {
+    m->unlock();
+    ex->rechuck(getLexInfo());
+  }
+  m->unlock();
+
+  ret = or_continue;
+  for(i = 0; i < n; i++) {
+    try {
+      switch(e[i].kind) {
+        case MAP_INT: ee->stack.push(ee->cache.newNumber(e[i].i)); break;
+        case MAP_DOUBLE: ee->stack.push(ee->cache.newNumber(e[i].d)); break;
+        case MAP_STRING: ee->stack.push(ee->cache.newString(e[i].s, true)); break;
+      }
+      ee->stack.push(e[i].value);
+      ret = c->action(ee);
+    } catch(Exception *ex) {
+      for(i++; i < n; i++) {
+        if(e[i].kind == MAP_STRING) free(e[i].s);
+        e[i].value->release(getLexInfo());
+      }
+      free(e);
+      ex->rechuck(getLexInfo());
+    }
+    if(ret != or_continue) {
+      if(ret == or_break) ret = or_continue;
+      for(i++; i < n; i++) {
+        if(e[i].kind == MAP_STRING) free(e[i].s);
+        e[i].value->release(getLexInfo());
+      }
+      break;
+    }
+  }
+  free(e);
+
+  c->release(getLexInfo());
+  m->release(getLexInfo());
+  code->release(getLexInfo());
+  map->release(getLexInfo());
+
+  return ret;
+}
@@ -0,0 +1,653 @@
+/*
+
+MIT License
+
+Copyright (c) 2020-2023 Graeme Elsworthy <github@sharkshead.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "shalelib.h"
+
+#define MAJOR   (INT) 1
+#define MINOR   (INT) 0
+#define MICRO   (INT) 1
+
+const char *matrixHelp[] = {
+  "Matrix library:",
+  "  {rows} {cols} create matrix::()          - push a new matrix of zeros",
+  "  {n} identity matrix::()                  - push a new {n} by {n} identity matrix",
+  "  {row} {col} {m} get matrix::()           - element {row}, {col}, counting from 0",
+  "  {value} {row} {col} {m} set matrix::()   - set element {row}, {col} to {value}",
+  "  {m} rows matrix::()                      - number of rows",
+  "  {m} cols matrix::()                      - number of columns",
+  "  {m} transpose matrix::()                 - push the transpose of {m}",
+  "  {a} {b} add matrix::()                   - push {a} + {b}",
+  "  {factor} {m} scale matrix::()            - push {m} with every element multiplied by {factor}",
+  "  {a} {b} multiply matrix::()              - push {a} times {b}. big products use a thread per",
+  "                                             processor",
+  "  {n} threads matrix::()                   - use at most {n} threads for a product, 1 for none",
+  "  {m} lu matrix::()                        - LU decomposition with partial pivoting. pushes the",
+  "                                             permutation matrix P, the unit lower triangular L and",
+  "                                             the upper triangular U, where P{m} = LU",
+  "  {a} {b} solve matrix::()                 - push the matrix x where {a}x = {b}",
+  "  {m} det matrix::()                       - determinant of {m}",
+  "  {m} show matrix::()                      - print {m}",
+  "  major version:: matrix::                 - major version number",
+  "  minor version:: matrix::                 - minor version number",
+  "  micro version:: matrix::                 - micro version number",
+  "  help matrix::()                          - this",
+  (const char *) 0
+};
+
+const char *matrixType = "matrix";
+
+#define MATRIX_HELP       0
+#define MATRIX_CREATE     1
+#define MATRIX_IDENTITY   2
+#define MATRIX_GET        3
+#define MATRIX_SET        4
+#define MATRIX_ROWS       5
+#define MATRIX_COLS       6
+#define MATRIX_TRANSPOSE  7
+#define MATRIX_ADD        8
+#define MATRIX_SCALE      9
+#define MATRIX_MULTIPLY   10
+#define MATRIX_LU         11
+#define MATRIX_SOLVE      12
+#define MATRIX_DET        13
+#define MATRIX_SHOW       14
+#define MATRIX_THREADS    15
+
+// Blocks of this many rows, columns and inner products keep the three tiles
+// being worked on within the L1 and L2 caches.
+#define BLOCK             64
+
+// Products with fewer multiplies than this aren't worth starting threads for.
+#define PARALLEL_MIN      ((INT) 1 << 21)
+#define PARALLEL_THREADS  16
+
+// The most threads a product may use, set by threads matrix::().
+static int parallelThreads = PARALLEL_THREADS;
+
+// Row major doubles on a cache line boundary. Apart from set, everything makes
+// a new matrix rather than changing one. set takes the write lock and anything
+// reading elements the read lock, so a set from another thread waits for a
+// product using the matrix to finish rather than changing it part way through.
+class Matrix : public Handle {
+  public:
+    Matrix(INT, INT, Cache *);
+    ~Matrix();
+    INT getRows();
+    INT getCols();
+    double *getData();
+    double *row(INT);
+    void readLock();
+    void writeLock();
+    void unlock();
+
+  private:
+    INT rows;
+    INT cols;
+    double *data;
+    pthread_rwlock_t lock;
+};
+
+class MatrixFunction : public Operation {
+  public:
+    MatrixFunction(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+static void addFunction(const char *name, int function) {
+  OperationList *ol;
+  Variable *v;
+
+  ol = new OperationList;
+  ol->addOperation(new MatrixFunction(function, (LexInfo *) 0));
+  v = new Variable(name);
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
+extern "C" void slmain() {
+  Variable *v;
+
+  // Are we already loaded?
+  if(btree.findVariable("/help/matrix") != (Variable *) 0) return;
+
+  addFunction("/help/matrix", MATRIX_HELP);
+
+  v = new Variable("/major/version/matrix");
+  v->setObject(mainEE.cache.newNumber(MAJOR));
+  btree.addVariable(v);
+
+  v = new Variable("/minor/version/matrix");
+  v->setObject(mainEE.cache.newNumber(MINOR));
+  btree.addVariable(v);
+
+  v = new Variable("/micro/version/matrix");
+  v->setObject(mainEE.cache.newNumber(MICRO));
+  btree.addVariable(v);
+
+  addFunction("/create/matrix", MATRIX_CREATE);
+  addFunction("/identity/matrix", MATRIX_IDENTITY);
+  addFunction("/get/matrix", MATRIX_GET);
+  addFunction("/set/matrix", MATRIX_SET);
+  addFunction("/rows/matrix", MATRIX_ROWS);
+  addFunction("/cols/matrix", MATRIX_COLS);
+  addFunction("/transpose/matrix", MATRIX_TRANSPOSE);
+  addFunction("/add/matrix", MATRIX_ADD);
+  addFunction("/scale/matrix", MATRIX_SCALE);
+  addFunction("/multiply/matrix", MATRIX_MULTIPLY);
+  addFunction("/lu/matrix", MATRIX_LU);
+  addFunction("/solve/matrix", MATRIX_SOLVE);
+  addFunction("/det/matrix", MATRIX_DET);
+  addFunction("/show/matrix", MATRIX_SHOW);
+  addFunction("/threads/matrix", MATRIX_THREADS);
+}
+
+Matrix::Matrix(INT r, INT c, Cache *ca) : Handle(matrixType, ca), rows(r), cols(c) {
+  void *p;
+  INT n;
+
+  n = (r * c < 1 ? 1 : r * c);
+  if(posix_memalign(&p, 64, n * sizeof(double)) != 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  memset(p, 0, n * sizeof(double));
+  data = (double *) p;
+  pthread_rwlock_init(&lock, NULL);
+}
+
+Matrix::~Matrix() { pthread_rwlock_destroy(&lock); free(data); }
+INT Matrix::getRows() { return rows; }
+INT Matrix::getCols() { return cols; }
+double *Matrix::getData() { return data; }
+double *Matrix::row(INT r) { return data + r * cols; }
+void Matrix::readLock() { pthread_rwlock_rdlock(&lock); }
+void Matrix::writeLock() { pthread_rwlock_wrlock(&lock); }
+void Matrix::unlock() { pthread_rwlock_unlock(&lock); }
+
+class MultiplyPart {
+  public:
+    const double *a;
+    const double *b;
+    double *c;
+    INT n;
+    INT m;
+    INT p;
+    INT from;
+    INT to;
+};
+
+// c[from..to) += a[from..to) b, where a is n x m and b is m x p, in blocks. The
+// innermost loop runs along a row of b and of c, so it's contiguous and the
+// compiler turns it into vector multiply-adds.
+static void multiplyRows(const double *__restrict__ a, const double *__restrict__ b, double *__restrict__ c, INT m, INT p, INT from, INT to) {
+  INT ii;
+  INT kk;
+  INT jj;
+  INT i;
+  INT k;
+  INT j;
+  INT iend;
+  INT kend;
+  INT jend;
+  double x;
+  const double *brow;
+  double *crow;
+
+  for(ii = from; ii < to; ii += BLOCK) {
+    iend = (ii + BLOCK < to ? ii + BLOCK : to);
+    for(kk = 0; kk < m; kk += BLOCK) {
+      kend = (kk + BLOCK < m ? kk + BLOCK : m);
+      for(jj = 0; jj < p; jj += BLOCK) {
+        jend = (jj + BLOCK < p ? jj + BLOCK : p);
+        for(i = ii; i < iend; i++) {
+          crow = c + i * p;
+          for(k = kk; k < kend; k++) {
+            x = a[i * m + k];
+            brow = b + k * p;
+            for(j = jj; j < jend; j++) crow[j] += x * brow[j];
+          }
+        }
+      }
+    }
+  }
+}
+
+static void *multiplyThread(void *v) {
+  MultiplyPart *mp = (MultiplyPart *) v;
+
+  multiplyRows(mp->a, mp->b, mp->c, mp->m, mp->p, mp->from, mp->to);
+
+  return (void *) 0;
+}
+
+static void multiply(Matrix *a, Matrix *b, Matrix *c) {
+  MultiplyPart parts[PARALLEL_THREADS];
+  pthread_t threads[PARALLEL_THREADS];
+  bool started[PARALLEL_THREADS];
+  INT n;
+  INT m;
+  INT p;
+  long cpus;
+  int count;
+  int i;
+
+  n = a->getRows();
+  m = a->getCols();
+  p = b->getCols();
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  count = __atomic_load_n(&parallelThreads, __ATOMIC_RELAXED);
+  if(cpus < count) count = (int) cpus;
+  if((n * m * p < PARALLEL_MIN) || (count < 2) || (n < 2)) {
+    multiplyRows(a->getData(), b->getData(), c->getData(), m, p, 0, n);
+    return;
+  }
+
+  if(count > n) count = (int) n;
+  for(i = 0; i < count; i++) {
+    parts[i].a = a->getData();
+    parts[i].b = b->getData();
+    parts[i].c = c->getData();
+    parts[i].m = m;
+    parts[i].p = p;
+    parts[i].from = (n * i) / count;
+    parts[i].to = (n * (i + 1)) / count;
+    // If a thread can't be had, do it here.
+    started[i] = (pthread_create(&threads[i], NULL, multiplyThread, &parts[i]) == 0);
+    if(! started[i]) multiplyThread(&parts[i]);
+  }
+  for(i = 0; i < count; i++) if(started[i]) pthread_join(threads[i], NULL);
+}
+
+// Doolittle LU with partial pivoting, in place in lu. perm[i] is the row of
+// the original that ended up as row i. Returns the sign of the permutation,
+// or 0 if the matrix is singular.
+static int decompose(Matrix *lu, INT *perm) {
+  INT n;
+  INT i;
+  INT j;
+  INT k;
+  INT best;
+  INT t;
+  double *d;
+  double *rk;
+  double *ri;
+  double f;
+  double x;
+  int sign;
+
+  n = lu->getRows();
+  d = lu->getData();
+  for(i = 0; i < n; i++) perm[i] = i;
+  sign = 1;
+
+  for(k = 0; k < n; k++) {
+    best = k;
+    for(i = k + 1; i < n; i++) {
+      if(fabs(d[i * n + k]) > fabs(d[best * n + k])) best = i;
+    }
+    if(d[best * n + k] == 0.0) return 0;
+    if(best != k) {
+      for(j = 0; j < n; j++) {
+        x = d[k * n + j];
+        d[k * n + j] = d[best * n + j];
+        d[best * n + j] = x;
+      }
+      t = perm[k];
+      perm[k] = perm[best];
+      perm[best] = t;
+      sign = -sign;
+    }
+
+    rk = lu->row(k);
+    for(i = k + 1; i < n; i++) {
+      ri = lu->row(i);
+      f = ri[k] / rk[k];
+      ri[k] = f;
+      for(j = k + 1; j < n; j++) ri[j] -= f * rk[j];
+    }
+  }
+
+  return sign;
+}
+
+static Matrix *findMatrix(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(matrixType)) {
+    h->release(li);
+    slexception.chuck("matrix not found", li);
+  }
+
+  return (Matrix *) h;
+}
+
+static INT getInt(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  INT i;
+
+  n = o->getNumber(li, ee);
+  i = n->getInt();
+  n->release(li);
+
+  return i;
+}
+
+static double getDouble(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  double d;
+
+  n = o->getNumber(li, ee);
+  d = n->getDouble();
+  n->release(li);
+
+  return d;
+}
+
+// Both of a pair of arguments, which may be the same matrix, read locked.
+static void lockBoth(Matrix *a, Matrix *b) {
+  a->readLock();
+  if(b != a) b->readLock();
+}
+
+static void unlockBoth(Matrix *a, Matrix *b) {
+  if(b != a) b->unlock();
+  a->unlock();
+}
+
+// A copy of a square matrix decomposed, with its permutation. Chucks if the
+// matrix is singular.
+static Matrix *luCopy(Matrix *m, INT **perm, int *sign, ExecutionEnvironment *ee, LexInfo *li) {
+  Matrix *lu;
+  INT n;
+
+  n = m->getRows();
+  if(n != m->getCols()) slexception.chuck("matrix isn't square", li);
+  lu = new Matrix(n, n, &ee->cache);
+  m->readLock();
+  memcpy(lu->getData(), m->getData(), n * n * sizeof(double));
+  m->unlock();
+  if((*perm = (INT *) malloc((n < 1 ? 1 : n) * sizeof(INT))) == (INT *) 0) slexception.chuck("malloc error", li);
+  *sign = decompose(lu, *perm);
+
+  return lu;
+}
+
+MatrixFunction::MatrixFunction(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn MatrixFunction::action(ExecutionEnvironment *ee) {
+  const char **p;
+  Object *o1;
+  Object *o2;
+  Object *o3;
+  Object *o4;
+  Matrix *a;
+  Matrix *b;
+  Matrix *c;
+  Matrix *l;
+  Matrix *u;
+  INT rows;
+  INT cols;
+  INT n;
+  INT i;
+  INT j;
+  INT k;
+  INT *perm;
+  int sign;
+  double d;
+  double *x;
+  double *y;
+  double *z;
+
+  switch(function) {
+    case MATRIX_HELP:
+      for(p = matrixHelp; *p != (const char *) 0; p++) {
+        printf("%s\n", *p);
+      }
+      break;
+
+    case MATRIX_CREATE:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      cols = getInt(o1, getLexInfo(), ee);
+      rows = getInt(o2, getLexInfo(), ee);
+      if((rows < 1) || (cols < 1)) slexception.chuck("a matrix needs at least one row and column", getLexInfo());
+      ee->stack.push(new Matrix(rows, cols, &ee->cache));
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+
+    case MATRIX_THREADS:
+      o1 = ee->stack.pop(getLexInfo());
+      n = getInt(o1, getLexInfo(), ee);
+      if(n < 1) slexception.chuck("a product needs at least one thread", getLexInfo());
+      __atomic_store_n(&parallelThreads, (n > PARALLEL_THREADS ? PARALLEL_THREADS : (int) n), __ATOMIC_RELAXED);
+      o1->release(getLexInfo());
+      break;
+
+    case MATRIX_IDENTITY:
+      o1 = ee->stack.pop(getLexInfo());
+      n = getInt(o1, getLexInfo(), ee);
+      if(n < 1) slexception.chuck("a matrix needs at least one row and column", getLexInfo());
+      c = new Matrix(n, n, &ee->cache);
+      for(i = 0; i < n; i++) c->row(i)[i] = 1.0;
+      ee->stack.push(c);
+      o1->release(getLexInfo());
+      break;
+
+    case MATRIX_GET:
+    case MATRIX_SET:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      o4 = (function == MATRIX_SET ? ee->stack.pop(getLexInfo()) : (Object *) 0);
+      a = findMatrix(o1, getLexInfo(), ee);
+      j = getInt(o2, getLexInfo(), ee);
+      i = getInt(o3, getLexInfo(), ee);
+      if((i < 0) || (i >= a->getRows()) || (j < 0) || (j >= a->getCols())) slexception.chuck("index out of range", getLexInfo());
+      if(function == MATRIX_GET) {
+        a->readLock();
+        d = a->row(i)[j];
+        a->unlock();
+        ee->stack.push(ee->cache.newNumber(d));
+      } else {
+        d = getDouble(o4, getLexInfo(), ee);
+        a->writeLock();
+        a->row(i)[j] = d;
+        a->unlock();
+        o4->release(getLexInfo());
+      }
+      a->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case MATRIX_ROWS:
+    case MATRIX_COLS:
+    case MATRIX_TRANSPOSE:
+    case MATRIX_DET:
+    case MATRIX_SHOW:
+    case MATRIX_LU:
+      o1 = ee->stack.pop(getLexInfo());
+      a = findMatrix(o1, getLexInfo(), ee);
+      rows = a->getRows();
+      cols = a->getCols();
+      switch(function) {
+        case MATRIX_ROWS: ee->stack.push(ee->cache.newNumber(rows)); break;
+        case MATRIX_COLS: ee->stack.push(ee->cache.newNumber(cols)); break;
+
+        case MATRIX_TRANSPOSE:
+          c = new Matrix(cols, rows, &ee->cache);
+          a->readLock();
+          for(i = 0; i < rows; i++) {
+            x = a->row(i);
+            for(j = 0; j < cols; j++) c->row(j)[i] = x[j];
+          }
+          a->unlock();
+          ee->stack.push(c);
+          break;
+
+        case MATRIX_SHOW:
+          a->readLock();
+          for(i = 0; i < rows; i++) {
+            x = a->row(i);
+            for(j = 0; j < cols; j++) printf(" %10.4f", x[j]);
+            printf("\n");
+          }
+          a->unlock();
+          break;
+
+        case MATRIX_DET:
+          c = luCopy(a, &perm, &sign, ee, getLexInfo());
+          d = sign;
+          for(i = 0; (sign != 0) && (i < rows); i++) d *= c->row(i)[i];
+          free(perm);
+          c->release(getLexInfo());
+          ee->stack.push(ee->cache.newNumber(d));
+          break;
+
+        case MATRIX_LU:
+          c = luCopy(a, &perm, &sign, ee, getLexInfo());
+          if(sign == 0) {
+            free(perm);
+            c->release(getLexInfo());
+            slexception.chuck("matrix is singular", getLexInfo());
+          }
+          b = new Matrix(rows, rows, &ee->cache);
+          l = new Matrix(rows, rows, &ee->cache);
+          u = new Matrix(rows, rows, &ee->cache);
+          for(i = 0; i < rows; i++) {
+            b->row(i)[perm[i]] = 1.0;
+            for(j = 0; j < rows; j++) {
+              if(j < i) l->row(i)[j] = c->row(i)[j];
+              else u->row(i)[j] = c->row(i)[j];
+            }
+            l->row(i)[i] = 1.0;
+          }
+          free(perm);
+          c->release(getLexInfo());
+          ee->stack.push(b);
+          ee->stack.push(l);
+          ee->stack.push(u);
+          break;
+      }
+      a->release(getLexInfo());
+      o1->release(getLexInfo());
+      break;
+
+    case MATRIX_SCALE:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      a = findMatrix(o1, getLexInfo(), ee);
+      d = getDouble(o2, getLexInfo(), ee);
+      n = a->getRows() * a->getCols();
+      c = new Matrix(a->getRows(), a->getCols(), &ee->cache);
+      x = a->getData();
+      z = c->getData();
+      a->readLock();
+      for(i = 0; i < n; i++) z[i] = x[i] * d;
+      a->unlock();
+      ee->stack.push(c);
+      a->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+
+    case MATRIX_ADD:
+    case MATRIX_MULTIPLY:
+    case MATRIX_SOLVE:
+      o1 = ee->stack.pop(getLexInfo());
+      o2 = ee->stack.pop(getLexInfo());
+      b = findMatrix(o1, getLexInfo(), ee);
+      a = findMatrix(o2, getLexInfo(), ee);
+
+      if(function == MATRIX_ADD) {
+        if((a->getRows() != b->getRows()) || (a->getCols() != b->getCols())) slexception.chuck("matrices are different sizes", getLexInfo());
+        n = a->getRows() * a->getCols();
+        c = new Matrix(a->getRows(), a->getCols(), &ee->cache);
+        x = a->getData();
+        y = b->getData();
+        z = c->getData();
+        lockBoth(a, b);
+        for(i = 0; i < n; i++) z[i] = x[i] + y[i];
+        unlockBoth(a, b);
+      } else if(function == MATRIX_MULTIPLY) {
+        if(a->getCols() != b->getRows()) slexception.chuck("matrix sizes don't match", getLexInfo());
+        c = new Matrix(a->getRows(), b->getCols(), &ee->cache);
+        lockBoth(a, b);
+        multiply(a, b, c);
+        unlockBoth(a, b);
+      } else {
+        if(a->getRows() != b->getRows()) slexception.chuck("matrix sizes don't match", getLexInfo());
+        l = luCopy(a, &perm, &sign, ee, getLexInfo());
+        if(sign == 0) {
+          free(perm);
+          l->release(getLexInfo());
+          slexception.chuck("matrix is singular", getLexInfo());
+        }
+        n = a->getRows();
+        cols = b->getCols();
+        c = new Matrix(n, cols, &ee->cache);
+
+        // Permute b into c, then solve Ly = Pb and Ux = y in place, a row
+        // at a time so every column of b is done together.
+        b->readLock();
+        for(i = 0; i < n; i++) memcpy(c->row(i), b->row(perm[i]), cols * sizeof(double));
+        b->unlock();
+        for(i = 0; i < n; i++) {
+          z = c->row(i);
+          for(k = 0; k < i; k++) {
+            d = l->row(i)[k];
+            y = c->row(k);
+            for(j = 0; j < cols; j++) z[j] -= d * y[j];
+          }
+        }
+        for(i = n - 1; i >= 0; i--) {
+          z = c->row(i);
+          for(k = i + 1; k < n; k++) {
+            d = l->row(i)[k];
+            y = c->row(k);
+            for(j = 0; j < cols; j++) z[j] -= d * y[j];
+          }
+          d = l->row(i)[i];
+          for(j = 0; j < cols; j++) z[j] /= d;
+        }
+        free(perm);
+        l->release(getLexInfo());
+      }
+
+      ee->stack.push(c);
+      a->release(getLexInfo());
+      b->release(getLexInfo());
+      o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      break;
+  }
+
+  return or_continue;
+}
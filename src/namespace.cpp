@@ -28,7 +28,7 @@ SOFTWARE.
 
 #define MAJOR   (INT) 1
 #define MINOR   (INT) 0
-#define MICRO   (INT) 0
+#define MICRO   (INT) 3
 
 class NamespaceHelp : public Operation {
   public:
@@ -42,9 +42,153 @@ class NamespaceStatic : public Operation {
     OperatorReturn action(ExecutionEnvironment *);
 };
 
+class NamespaceSnapshot : public Operation {
+  public:
+    NamespaceSnapshot(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class NamespaceRestore : public Operation {
+  public:
+    NamespaceRestore(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class NamespaceDiscard : public Operation {
+  public:
+    NamespaceDiscard(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class NamespacePublish : public Operation {
+  public:
+    NamespacePublish(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class NamespaceAttach : public Operation {
+  public:
+    NamespaceAttach(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class NamespaceUnpublish : public Operation {
+  public:
+    NamespaceUnpublish(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+#define SHARED_ADD   0
+#define SHARED_CAS   1
+
+class NamespaceShared : public Operation {
+  public:
+    NamespaceShared(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+// A published namespace lives in a POSIX shared memory segment. Everything in it
+// is addressed by its offset from the start of the segment, so each process can
+// map it wherever it likes. The layout is the header, the hash table of entry
+// offsets, the entries, then the names and string values.
+
+#define SHARED_MAGIC    "shalens"
+#define SHARED_INT      1
+#define SHARED_DOUBLE   2
+#define SHARED_STRING   3
+
+class SharedHeader {
+  public:
+    char magic[8];
+    unsigned long size;
+    unsigned long intSize;
+    unsigned long count;
+    unsigned long buckets;
+    unsigned long table;
+};
+
+class SharedEntry {
+  public:
+    unsigned long next;
+    unsigned long name;
+    unsigned long hash;
+    unsigned long type;
+    union {
+      INT valueInt;
+      double valueDouble;
+      unsigned long valueString;
+    };
+};
+
+// Numbers are read from the segment each time they're used, and in a writable
+// segment assigning to one stores the new value straight into the segment.
+// Assignment is a plain store, so x++ or x += 1 in two scripts at once can lose
+// an update. add and cas change a number with one atomic instruction.
+
+class SharedNumber : public Object {
+  public:
+    SharedNumber(SharedEntry *, bool);
+    Number *getNumber(LexInfo *, ExecutionEnvironment *);
+    bool setValue(Object *);
+    void add(Number *, LexInfo *);
+    bool compareExchange(Number *, Number *, LexInfo *);
+    void debug();
+
+  private:
+    SharedEntry *entry;
+    bool writable;
+};
+
+class SharedString : public String {
+  public:
+    SharedString(const char *);
+    bool setValue(Object *);
+};
+
+class SharedSegment : public VariableResolver {
+  public:
+    SharedSegment(char *, bool);
+    Variable *resolve(const char *);
+    static Object *newObject(char *, SharedEntry *, bool);
+
+  private:
+    char *base;
+    bool writable;
+};
+
+class SharedCollector : public NamespaceVisitor {
+  public:
+    SharedCollector();
+    ~SharedCollector();
+    void visit(Variable *);
+    Variable **list;
+    int count;
+
+  private:
+    int size;
+};
+
 const char *namespaceHelp[] = {
   "Namespace library",
   "  {ns} static namespace::()     - possibly improve access speed to the {ns} namespace.",
+  "  {ns} snapshot namespace::()   - take a snapshot of the {ns} namespace, returns a snapshot id.",
+  "  {id} restore namespace::()    - put the namespace back as it was when snapshot {id} was taken.",
+  "                                  Later snapshots are dropped, {id} remains.",
+  "  {id} discard namespace::()    - drop snapshot {id}, and any later snapshots, keeping the current values.",
+  "  {ns} {seg} publish namespace::()",
+  "                                - copy the numbers and strings in the {ns} namespace to the shared memory",
+  "                                  segment {seg} and use them from there, returns the number of variables.",
+  "  {seg} {rw} attach namespace::()",
+  "                                - make the variables in segment {seg} available to this script. If {rw}",
+  "                                  is true numbers can be changed, atomically, otherwise they're read only.",
+  "  {seg} unpublish namespace::() - remove the segment {seg} once every script has finished with it.",
+  "  {v} {n} add namespace::()     - atomically add {n} to the shared number {v}.",
+  "  {v} {old} {new} cas namespace::()",
+  "                                - set the shared integer {v} to {new} if it holds {old}, atomically.",
+  "                                  Pushes true if it was set.",
   "  major version:: namespace::   - major version number",
   "  minor version:: namespace::   - minor version number",
   "  micro version:: namespace::   - micro version number",
@@ -82,6 +226,71 @@ extern "C" void slmain() {
   v = new Variable("/static/namespace");
   v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
   btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespaceSnapshot((LexInfo *) 0));
+  v = new Variable("/snapshot/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespaceRestore((LexInfo *) 0));
+  v = new Variable("/restore/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespaceDiscard((LexInfo *) 0));
+  v = new Variable("/discard/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespacePublish((LexInfo *) 0));
+  v = new Variable("/publish/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespaceAttach((LexInfo *) 0));
+  v = new Variable("/attach/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespaceUnpublish((LexInfo *) 0));
+  v = new Variable("/unpublish/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespaceShared(SHARED_ADD, (LexInfo *) 0));
+  v = new Variable("/add/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new NamespaceShared(SHARED_CAS, (LexInfo *) 0));
+  v = new Variable("/cas/namespace");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+}
+
+static unsigned long sharedHash(const char *n) {
+  unsigned long h;
+
+  for(h = 14695981039346656037UL; *n != 0; n++) {
+    h ^= (unsigned char) *n;
+    h *= 1099511628211UL;
+  }
+
+  return h;
+}
+
+// Shared memory segment names are /shale.{seg}.
+static void sharedName(char *buf, const char *seg, LexInfo *li) {
+  if((*seg == 0) || (strchr(seg, '/') != (char *) 0) || (strlen(seg) > 200)) slexception.chuck("invalid segment name", li);
+  sprintf(buf, "/shale.%s", seg);
 }
 
 NamespaceHelp::NamespaceHelp(LexInfo *li) : Operation(li) { }
@@ -111,3 +320,449 @@ OperatorReturn NamespaceStatic::action(ExecutionEnvironment *ee) {
 
   return or_continue;
 }
+
+NamespaceSnapshot::NamespaceSnapshot(LexInfo *li) : Operation(li) { }
+
+OperatorReturn NamespaceSnapshot::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Name *ns;
+  unsigned long id;
+
+  o = ee->stack.pop(getLexInfo());
+  ns = o->getName(getLexInfo(), ee);
+
+  if((id = btree.snapshot(ns->getValue())) == 0) slexception.chuck("namespace name too long", getLexInfo());
+  ee->stack.push(ee->cache.newNumber((INT) id));
+
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+NamespaceRestore::NamespaceRestore(LexInfo *li) : Operation(li) { }
+
+OperatorReturn NamespaceRestore::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Number *n;
+
+  o = ee->stack.pop(getLexInfo());
+  n = o->getNumber(getLexInfo(), ee);
+
+  if(! n->isInt()) slexception.chuck("snapshot id must be an integer", getLexInfo());
+  if(! btree.restore((unsigned long) n->getInt())) slexception.chuck("no such snapshot", getLexInfo());
+
+  n->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+NamespaceDiscard::NamespaceDiscard(LexInfo *li) : Operation(li) { }
+
+OperatorReturn NamespaceDiscard::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Number *n;
+
+  o = ee->stack.pop(getLexInfo());
+  n = o->getNumber(getLexInfo(), ee);
+
+  if(! n->isInt()) slexception.chuck("snapshot id must be an integer", getLexInfo());
+  if(! btree.discard((unsigned long) n->getInt())) slexception.chuck("no such snapshot", getLexInfo());
+
+  n->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+SharedNumber::SharedNumber(SharedEntry *e, bool w) : Object(&mainEE.cache, IS_STATIC), entry(e), writable(w) { }
+
+Number *SharedNumber::getNumber(LexInfo *li, ExecutionEnvironment *ee) {
+  Cache *c;
+  double d;
+
+  c = (ee == (ExecutionEnvironment *) 0 ? cache : &ee->cache);
+  if(entry->type == SHARED_INT) return c->newNumber(__atomic_load_n(&entry->valueInt, __ATOMIC_ACQUIRE));
+  __atomic_load(&entry->valueDouble, &d, __ATOMIC_ACQUIRE);
+  return c->newNumber(d);
+}
+
+bool SharedNumber::setValue(Object *o) {
+  Number *n;
+  double d;
+
+  if(! writable) slexception.chuck("shared variable is read only", (LexInfo *) 0);
+
+  n = (Number *) 0;
+  try {
+    n = o->getNumber((LexInfo *) 0, (ExecutionEnvironment *) 0);
+  } catch(Exception *e) { }
+  if(n == (Number *) 0) slexception.chuck("shared variables can only be set to numbers", (LexInfo *) 0);
+
+  if(entry->type == SHARED_INT) {
+    if(! n->isInt()) {
+      n->release((LexInfo *) 0);
+      slexception.chuck("shared integers can only be set to integers", (LexInfo *) 0);
+    }
+    __atomic_store_n(&entry->valueInt, n->getInt(), __ATOMIC_RELEASE);
+  } else {
+    d = n->getDouble();
+    __atomic_store(&entry->valueDouble, &d, __ATOMIC_RELEASE);
+  }
+  n->release((LexInfo *) 0);
+
+  return true;
+}
+
+// Doubles have no atomic add, so they're swapped in a loop until no other
+// script has changed the number in between.
+void SharedNumber::add(Number *n, LexInfo *li) {
+  double expected;
+  double desired;
+
+  if(! writable) slexception.chuck("shared variable is read only", li);
+  if(entry->type == SHARED_INT) {
+    if(! n->isInt()) slexception.chuck("shared integers can only be set to integers", li);
+    __atomic_add_fetch(&entry->valueInt, n->getInt(), __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  __atomic_load(&entry->valueDouble, &expected, __ATOMIC_ACQUIRE);
+  do {
+    desired = expected + n->getDouble();
+  } while(! __atomic_compare_exchange(&entry->valueDouble, &expected, &desired, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+}
+
+bool SharedNumber::compareExchange(Number *expected, Number *desired, LexInfo *li) {
+  INT e;
+
+  if(! writable) slexception.chuck("shared variable is read only", li);
+  if(entry->type != SHARED_INT) slexception.chuck("cas only works on shared integers", li);
+  if(! expected->isInt() || ! desired->isInt()) slexception.chuck("shared integers can only be set to integers", li);
+  e = expected->getInt();
+
+  return __atomic_compare_exchange_n(&entry->valueInt, &e, desired->getInt(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+void SharedNumber::debug() {
+  printf("Shared ");
+  getNumber((LexInfo *) 0, (ExecutionEnvironment *) 0)->debug();
+}
+
+SharedString::SharedString(const char *s) : String(s, &mainEE.cache, IS_STATIC) { }
+
+bool SharedString::setValue(Object *o) {
+  slexception.chuck("shared strings are read only", (LexInfo *) 0);
+  return true;
+}
+
+SharedSegment::SharedSegment(char *b, bool w) : base(b), writable(w) { }
+
+Object *SharedSegment::newObject(char *base, SharedEntry *e, bool writable) {
+  if(e->type == SHARED_STRING) return new SharedString(base + e->valueString);
+  return new SharedNumber(e, writable);
+}
+
+Variable *SharedSegment::resolve(const char *name) {
+  SharedHeader *h;
+  SharedEntry *e;
+  Variable *v;
+  unsigned long hash;
+  unsigned long off;
+
+  h = (SharedHeader *) base;
+  hash = sharedHash(name);
+  for(off = ((unsigned long *) (base + h->table))[hash & (h->buckets - 1)]; off != 0; off = e->next) {
+    e = (SharedEntry *) (base + off);
+    if((e->hash == hash) && (strcmp(base + e->name, name) == 0)) {
+      v = new Variable(name);
+      v->restoreObject(newObject(base, e, writable));
+      // If another thread added it first use theirs.
+      if(! btree.addVariable(v)) {
+        delete v->getObject();
+        delete v;
+        v = btree.findVariable(name);
+      }
+      return v;
+    }
+  }
+
+  return (Variable *) 0;
+}
+
+SharedCollector::SharedCollector() : list((Variable **) 0), count(0), size(0) { }
+
+SharedCollector::~SharedCollector() {
+  if(list != (Variable **) 0) free(list);
+}
+
+void SharedCollector::visit(Variable *v) {
+  Variable **l;
+
+  if(! v->isInitialised()) return;
+
+  if(count == size) {
+    size = (size == 0 ? 64 : size * 2);
+    if((l = (Variable **) realloc(list, size * sizeof(Variable *))) == (Variable **) 0) slexception.chuck("malloc failed", (LexInfo *) 0);
+    list = l;
+  }
+  list[count++] = v;
+}
+
+// Let go of the values collected for publishing, when it fails part way.
+static void releaseCollected(Number **numbers, String **strings, int count) {
+  int i;
+
+  for(i = 0; i < count; i++) {
+    if((numbers != (Number **) 0) && (numbers[i] != (Number *) 0)) numbers[i]->release((LexInfo *) 0);
+    if((strings != (String **) 0) && (strings[i] != (String *) 0)) strings[i]->release((LexInfo *) 0);
+  }
+  free(numbers);
+  free(strings);
+}
+
+NamespacePublish::NamespacePublish(LexInfo *li) : Operation(li) { }
+
+OperatorReturn NamespacePublish::action(ExecutionEnvironment *ee) {
+  SharedCollector sc;
+  SharedHeader *h;
+  SharedEntry *e;
+  Object *seg;
+  Object *o;
+  Number **numbers;
+  String **strings;
+  Name *ns;
+  String *s;
+  char *base;
+  char shmName[256];
+  unsigned long *table;
+  unsigned long buckets;
+  unsigned long size;
+  unsigned long entries;
+  unsigned long str;
+  int count;
+  int fd;
+  int i;
+
+  seg = ee->stack.pop(getLexInfo());
+  o = ee->stack.pop(getLexInfo());
+  s = seg->getString(getLexInfo(), ee);
+  ns = o->getName(getLexInfo(), ee);
+
+  sharedName(shmName, s->getValue(), getLexInfo());
+  btree.visitNamespace(ns->getValue(), &sc);
+
+  // Only numbers and strings can be shared.
+  numbers = (Number **) calloc(sc.count + 1, sizeof(Number *));
+  strings = (String **) calloc(sc.count + 1, sizeof(String *));
+  if((numbers == (Number **) 0) || (strings == (String **) 0)) {
+    releaseCollected(numbers, strings, 0);
+    slexception.chuck("malloc failed", getLexInfo());
+  }
+  count = 0;
+  size = 0;
+  for(i = 0; i < sc.count; i++) {
+    try {
+      numbers[i] = sc.list[i]->getObject()->getNumber(getLexInfo(), ee);
+    } catch(Exception *e) { }
+    if(numbers[i] == (Number *) 0) {
+      try {
+        strings[i] = sc.list[i]->getObject()->getString(getLexInfo(), ee);
+        size += strlen(strings[i]->getValue()) + 1;
+      } catch(Exception *e) { }
+    }
+    if((numbers[i] != (Number *) 0) || (strings[i] != (String *) 0)) {
+      size += strlen(sc.list[i]->getName()) + 1;
+      count++;
+    }
+  }
+
+  for(buckets = 16; buckets < (unsigned long) count * 2; buckets *= 2) ;
+  entries = sizeof(SharedHeader) + buckets * sizeof(unsigned long);
+  str = entries + count * sizeof(SharedEntry);
+  size += str;
+
+  if((fd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+    releaseCollected(numbers, strings, sc.count);
+    slexception.chuck("can't create shared segment, it may already exist", getLexInfo());
+  }
+  if(ftruncate(fd, size) < 0) {
+    close(fd);
+    shm_unlink(shmName);
+    releaseCollected(numbers, strings, sc.count);
+    slexception.chuck("can't size shared segment", getLexInfo());
+  }
+  base = (char *) mmap((void *) 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == (char *) MAP_FAILED) {
+    shm_unlink(shmName);
+    releaseCollected(numbers, strings, sc.count);
+    slexception.chuck("can't map shared segment", getLexInfo());
+  }
+
+  h = (SharedHeader *) base;
+  strcpy(h->magic, SHARED_MAGIC);
+  h->size = size;
+  h->intSize = sizeof(INT);
+  h->count = count;
+  h->buckets = buckets;
+  h->table = sizeof(SharedHeader);
+  table = (unsigned long *) (base + h->table);
+
+  e = (SharedEntry *) (base + entries);
+  for(i = 0; i < sc.count; i++) {
+    if((numbers[i] == (Number *) 0) && (strings[i] == (String *) 0)) continue;
+
+    e->name = str;
+    strcpy(base + str, sc.list[i]->getName());
+    str += strlen(sc.list[i]->getName()) + 1;
+    e->hash = sharedHash(sc.list[i]->getName());
+
+    if(numbers[i] != (Number *) 0) {
+      if(numbers[i]->isInt()) {
+        e->type = SHARED_INT;
+        e->valueInt = numbers[i]->getInt();
+      } else {
+        e->type = SHARED_DOUBLE;
+        e->valueDouble = numbers[i]->getDouble();
+      }
+      numbers[i]->release(getLexInfo());
+    } else {
+      e->type = SHARED_STRING;
+      e->valueString = str;
+      strcpy(base + str, strings[i]->getValue());
+      str += strlen(strings[i]->getValue()) + 1;
+      strings[i]->release(getLexInfo());
+    }
+
+    e->next = table[e->hash & (buckets - 1)];
+    table[e->hash & (buckets - 1)] = (char *) e - base;
+
+    // From now on this script uses the shared copy too.
+    sc.list[i]->restoreObject(SharedSegment::newObject(base, e, true));
+    e++;
+  }
+
+  free(numbers);
+  free(strings);
+
+  ee->stack.push(ee->cache.newNumber((INT) count));
+
+  s->release(getLexInfo());
+  seg->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+NamespaceAttach::NamespaceAttach(LexInfo *li) : Operation(li) { }
+
+OperatorReturn NamespaceAttach::action(ExecutionEnvironment *ee) {
+  SharedHeader *h;
+  struct stat st;
+  Object *rw;
+  Object *seg;
+  Number *n;
+  String *s;
+  char *base;
+  char shmName[256];
+  bool writable;
+  int fd;
+
+  rw = ee->stack.pop(getLexInfo());
+  seg = ee->stack.pop(getLexInfo());
+  n = rw->getNumber(getLexInfo(), ee);
+  s = seg->getString(getLexInfo(), ee);
+  writable = (n->getInt() != 0);
+
+  sharedName(shmName, s->getValue(), getLexInfo());
+  if((fd = shm_open(shmName, (writable ? O_RDWR : O_RDONLY), 0)) < 0) slexception.chuck("can't open shared segment", getLexInfo());
+  if((fstat(fd, &st) < 0) || (st.st_size < (off_t) sizeof(SharedHeader))) {
+    close(fd);
+    slexception.chuck("invalid shared segment", getLexInfo());
+  }
+  base = (char *) mmap((void *) 0, st.st_size, (writable ? PROT_READ | PROT_WRITE : PROT_READ), MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == (char *) MAP_FAILED) slexception.chuck("can't map shared segment", getLexInfo());
+
+  h = (SharedHeader *) base;
+  if((strcmp(h->magic, SHARED_MAGIC) != 0) || (h->size != (unsigned long) st.st_size) || (h->intSize != sizeof(INT))) {
+    munmap(base, st.st_size);
+    slexception.chuck("invalid shared segment", getLexInfo());
+  }
+
+  btree.addResolver(new SharedSegment(base, writable));
+
+  ee->stack.push(ee->cache.newNumber((INT) h->count));
+
+  n->release(getLexInfo());
+  s->release(getLexInfo());
+  rw->release(getLexInfo());
+  seg->release(getLexInfo());
+
+  return or_continue;
+}
+
+NamespaceUnpublish::NamespaceUnpublish(LexInfo *li) : Operation(li) { }
+
+OperatorReturn NamespaceUnpublish::action(ExecutionEnvironment *ee) {
+  Object *seg;
+  String *s;
+  char shmName[256];
+
+  seg = ee->stack.pop(getLexInfo());
+  s = seg->getString(getLexInfo(), ee);
+
+  sharedName(shmName, s->getValue(), getLexInfo());
+  if(shm_unlink(shmName) < 0) slexception.chuck("can't remove shared segment", getLexInfo());
+
+  s->release(getLexInfo());
+  seg->release(getLexInfo());
+
+  return or_continue;
+}
+
+NamespaceShared::NamespaceShared(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn NamespaceShared::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Object *o1;
+  Object *o2;
+  Number *n1;
+  Number *n2;
+  Name *name;
+  Variable *v;
+  SharedNumber *sn;
+  bool ok;
+
+  o2 = (function == SHARED_CAS ? ee->stack.pop(getLexInfo()) : (Object *) 0);
+  o1 = ee->stack.pop(getLexInfo());
+  o = ee->stack.pop(getLexInfo());
+
+  name = o->getName(getLexInfo(), ee);
+  v = name->findVariable(ee);
+  if((v == (Variable *) 0) || ((sn = dynamic_cast<SharedNumber *>(v->getObject())) == (SharedNumber *) 0)) slexception.chuck("shared number not found", getLexInfo());
+
+  n1 = o1->getNumber(getLexInfo(), ee);
+  n2 = (Number *) 0;
+  try {
+    if(function == SHARED_ADD) sn->add(n1, getLexInfo());
+    else {
+      n2 = o2->getNumber(getLexInfo(), ee);
+      ok = sn->compareExchange(n1, n2, getLexInfo());
+      ee->stack.push(ok ? trueValue : falseValue);
+    }
+  } catch(Exception *e) {
+    n1->release(getLexInfo());
+    if(n2 != (Number *) 0) n2->release(getLexInfo());
+    e->rechuck(getLexInfo());
+  }
+
+  n1->release(getLexInfo());
+  if(n2 != (Number *) 0) n2->release(getLexInfo());
+  if(o2 != (Object *) 0) o2->release(getLexInfo());
+  o1->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
@@ -893,6 +893,12 @@ void syntax() {
   printf("  If you want floating point indices and names to be something other than 3 decimal places, use sprintf to\n");
   printf("  format them to a string with the required number of decimal places.\n");
   printf("\n");
+  printf("Thread-local tls:: namespace\n");
+  printf("  Variables in the tls:: namespace, such as 'x tls::' or 'i.value counts:: tls::', belong to the thread\n");
+  printf("  that creates them. Every thread has its own, other threads never see them, and using them takes no locks.\n");
+  printf("  A pool thread keeps its tls:: variables from one task to the next, so declare them when they're not\n");
+  printf("  yet defined.\n");
+  printf("\n");
   printf("Special shale:: namespace\n");
   printf("  The shale:: namespace is used by shale to provide interaction between the script and shale.\n");
   printf("    file arg:: shale::\n");
@@ -900,6 +906,13 @@ void syntax() {
   printf("    major version:: shale::\n");
   printf("    minor version:: shale::\n");
   printf("    micro version:: shale::\n");
+  printf("    {code} {n} memo shale::()                     push a memoised version of the function {code}, which takes {n} number\n");
+  printf("                                                  or string arguments and returns one number or string\n");
+  printf("    {code} {n} {size} limit memo:: shale::()      as memo, keeping only the {size} most recently used results\n");
+  printf("    {memo} hits memo:: shale::()                  number of calls answered from the cache\n");
+  printf("    {memo} misses memo:: shale::()                number of calls that ran the function\n");
+  printf("    {memo} size memo:: shale::()                  number of cached results\n");
+  printf("    {memo} clear memo:: shale::()                 empty the cache and zero the counts\n");
   printf("\n");
   printf("Libraries\n");
   printf("  Libraries are loaded with the library keyword\n");
@@ -909,8 +922,15 @@ void syntax() {
   printf("  once the library is loaded, and will detail all of the functionality the library provides.\n");
   printf("  Current libraries are:\n");
   printf("    array       - support for sparse and fully populated arrays. See help array::() for details.\n");
+  printf("    bitset      - packed sets of bits with bulk boolean operations. See help bitset::() for details.\n");
+  printf("    combinatorics - permutations, combinations and products. See help combinatorics::() for details.\n");
+  printf("    deque       - double ended queues. See help deque::() for details.\n");
   printf("    file        - some stdio functions. See help file::() for details.\n");
+  printf("    graph       - graphs with native searches and shortest paths. See help graph::() for details.\n");
+  printf("    heap        - priority queues. See help heap::() for details.\n");
+  printf("    map         - hash maps with number and string keys. See help map::() for details.\n");
   printf("    maths       - pi, e, log functions, etc. See help maths::() for details.\n");
+  printf("    matrix      - dense matrices, multiplication and LU. See help matrix::() for details.\n");
   printf("    namespace   - namespace operations\n");
   printf("    primes      - generate primes\n");
   printf("    string      - string handling\n");
@@ -956,6 +976,404 @@ void version() {
   exit(0);
 }
 
+// Memoised functions.
+
+Memo *memos = (Memo *) 0;
+pthread_mutex_t memosMutex = PTHREAD_MUTEX_INITIALIZER;
+
+Memo::Memo(Code *c, INT a, INT l) : code(c), arity(a), limit(l), count(0), hits(0), misses(0), buckets(MEMO_BUCKETS), newest((MemoEntry *) 0), oldest((MemoEntry *) 0) {
+  unsigned long i;
+
+  table = (MemoEntry **) malloc(buckets * sizeof(MemoEntry *));
+  if(table == (MemoEntry **) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  for(i = 0; i < buckets; i++) table[i] = (MemoEntry *) 0;
+  pthread_mutex_init(&mutex, NULL);
+
+  operationList = new OperationList;
+  memoCall = new MemoCall(this, (LexInfo *) 0);
+  operationList->addOperation(memoCall);
+
+  pthread_mutex_lock(&memosMutex);
+  next = memos;
+  memos = this;
+  pthread_mutex_unlock(&memosMutex);
+}
+
+// Operation lists are never freed, and + can copy the call into another one,
+// so the call is kept but told the memo has gone.
+Memo::~Memo() {
+  Memo **m;
+
+  pthread_mutex_lock(&memosMutex);
+  for(m = &memos; *m != this; m = &(*m)->next) ;
+  *m = next;
+  pthread_mutex_unlock(&memosMutex);
+
+  clear();
+  free(table);
+  pthread_mutex_destroy(&mutex);
+  memoCall->forget();
+  code->release((LexInfo *) 0);
+}
+
+OperationList *Memo::getOperationList() { return operationList; }
+Memo *Memo::getNext() { return next; }
+INT Memo::getHits() { return hits; }
+INT Memo::getMisses() { return misses; }
+INT Memo::getSize() { return count; }
+
+// Casting a double outside INT's range to an INT is undefined, so check the
+// range first. The bounds are powers of two, so they're exact as doubles, and
+// NaN fails both comparisons.
+static bool integral(double d) {
+  double limit;
+
+  limit = ldexp(1.0, sizeof(INT) * 8 - 1);
+
+  return (d >= -limit) && (d < limit) && (d == (double) (INT) d);
+}
+
+// Arguments and results are kept as plain values, so an entry can be handed
+// to any execution environment. Integral doubles are kept as ints so 3 and
+// 3.0 are the same argument.
+bool Memo::getValue(Object *o, MemoValue *mv, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  String *s;
+
+  try {
+    n = o->getNumber(li, ee);
+    if(n->isInt()) {
+      mv->type = MEMO_INT;
+      mv->valueInt = n->getInt();
+    } else if(integral(n->getDouble())) {
+      mv->type = MEMO_INT;
+      mv->valueInt = (INT) n->getDouble();
+    } else {
+      mv->type = MEMO_DOUBLE;
+      mv->valueDouble = n->getDouble();
+    }
+    n->release(li);
+    return true;
+  } catch(Exception *e) { }
+
+  try {
+    s = o->getString(li, ee);
+    mv->type = MEMO_STRING;
+    mv->str = (char *) s->getValue();
+    s->release(li);
+    return true;
+  } catch(Exception *e) { }
+
+  return false;
+}
+
+// FNV-1a over the argument types and values.
+unsigned long Memo::hashArgs(MemoValue *args) {
+  unsigned long h;
+  unsigned char *p;
+  unsigned char *end;
+  INT i;
+
+  h = 14695981039346656037UL;
+  for(i = 0; i < arity; i++) {
+    h = (h ^ (unsigned char) args[i].type) * 1099511628211UL;
+    if(args[i].type == MEMO_STRING) {
+      for(p = (unsigned char *) args[i].str; *p != 0; p++) h = (h ^ *p) * 1099511628211UL;
+    } else {
+      if(args[i].type == MEMO_INT) { p = (unsigned char *) &args[i].valueInt; end = p + sizeof(INT); }
+      else { p = (unsigned char *) &args[i].valueDouble; end = p + sizeof(double); }
+      for( ; p < end; p++) h = (h ^ *p) * 1099511628211UL;
+    }
+  }
+
+  return h;
+}
+
+bool Memo::sameArgs(MemoValue *a, MemoValue *b) {
+  INT i;
+
+  for(i = 0; i < arity; i++) {
+    if(a[i].type != b[i].type) return false;
+    switch(a[i].type) {
+      case MEMO_INT: if(a[i].valueInt != b[i].valueInt) return false; break;
+      case MEMO_DOUBLE: if(a[i].valueDouble != b[i].valueDouble) return false; break;
+      case MEMO_STRING: if(strcmp(a[i].str, b[i].str) != 0) return false; break;
+    }
+  }
+
+  return true;
+}
+
+MemoEntry *Memo::find(unsigned long h, MemoValue *args) {
+  MemoEntry *me;
+
+  for(me = table[h & (buckets - 1)]; me != (MemoEntry *) 0; me = me->chain) {
+    if((me->hash == h) && sameArgs(me->args, args)) return me;
+  }
+
+  return (MemoEntry *) 0;
+}
+
+// Add an entry as the newest, growing the table and dropping the oldest
+// entries as needed.
+void Memo::add(MemoEntry *me) {
+  MemoEntry **t;
+  MemoEntry *e;
+  MemoEntry *n;
+  unsigned long i;
+
+  if(count >= (INT) buckets) {
+    t = (MemoEntry **) malloc(2 * buckets * sizeof(MemoEntry *));
+    if(t != (MemoEntry **) 0) {
+      for(i = 0; i < 2 * buckets; i++) t[i] = (MemoEntry *) 0;
+      for(i = 0; i < buckets; i++) {
+        for(e = table[i]; e != (MemoEntry *) 0; e = n) {
+          n = e->chain;
+          e->chain = t[e->hash & (2 * buckets - 1)];
+          t[e->hash & (2 * buckets - 1)] = e;
+        }
+      }
+      free(table);
+      table = t;
+      buckets *= 2;
+    }
+  }
+
+  me->chain = table[me->hash & (buckets - 1)];
+  table[me->hash & (buckets - 1)] = me;
+  me->older = newest;
+  me->newer = (MemoEntry *) 0;
+  if(newest != (MemoEntry *) 0) newest->newer = me;
+  else oldest = me;
+  newest = me;
+  count++;
+
+  while((limit > 0) && (count > limit)) {
+    e = oldest;
+    unlink(e);
+    for(t = &table[e->hash & (buckets - 1)]; *t != e; t = &(*t)->chain) ;
+    *t = e->chain;
+    freeEntry(e);
+    count--;
+  }
+}
+
+// Take an entry out of the newest to oldest list.
+void Memo::unlink(MemoEntry *me) {
+  if(me->newer != (MemoEntry *) 0) me->newer->older = me->older;
+  else newest = me->older;
+  if(me->older != (MemoEntry *) 0) me->older->newer = me->newer;
+  else oldest = me->newer;
+}
+
+void Memo::freeEntry(MemoEntry *me) {
+  INT i;
+
+  for(i = 0; i < arity; i++) {
+    if(me->args[i].type == MEMO_STRING) free(me->args[i].str);
+  }
+  if(me->result.type == MEMO_STRING) free(me->result.str);
+  free(me->args);
+  free(me);
+}
+
+void Memo::clear() {
+  MemoEntry *me;
+  MemoEntry *n;
+  unsigned long i;
+
+  pthread_mutex_lock(&mutex);
+  for(me = newest; me != (MemoEntry *) 0; me = n) {
+    n = me->older;
+    freeEntry(me);
+  }
+  for(i = 0; i < buckets; i++) table[i] = (MemoEntry *) 0;
+  newest = oldest = (MemoEntry *) 0;
+  count = hits = misses = 0;
+  pthread_mutex_unlock(&mutex);
+}
+
+// Look the arguments up while they're still on the stack. On a hit they're
+// replaced by the saved result. On a miss the function is called as usual and
+// the value it leaves on the stack is saved. The lock isn't held during the
+// call, so recursive and concurrent calls work; if two calls race on the same
+// arguments the first result saved is kept.
+OperatorReturn Memo::call(ExecutionEnvironment *ee, LexInfo *li) {
+  MemoValue *args;
+  MemoValue result;
+  MemoEntry *me;
+  StackItem *si;
+  OperatorReturn ret;
+  unsigned long h;
+  int depth;
+  INT i;
+
+  args = (MemoValue *) malloc((arity > 0 ? arity : 1) * sizeof(MemoValue));
+  if(args == (MemoValue *) 0) slexception.chuck("malloc error", li);
+  si = ee->stack.getStack();
+  for(i = arity - 1; i >= 0; i--) {
+    if((si == (StackItem *) 0) || ! getValue(si->getObject(), &args[i], li, ee)) {
+      free(args);
+      if(si == (StackItem *) 0) slexception.chuck("stack pop error", li);
+      slexception.chuck("memo arguments must be numbers or strings", li);
+    }
+    si = si->getDown();
+  }
+  h = hashArgs(args);
+
+  pthread_mutex_lock(&mutex);
+  if((me = find(h, args)) != (MemoEntry *) 0) {
+    hits++;
+    if(me != newest) {
+      unlink(me);
+      me->older = newest;
+      me->newer = (MemoEntry *) 0;
+      newest->newer = me;
+      newest = me;
+    }
+    result = me->result;
+    if(result.type == MEMO_STRING) result.str = strdup(result.str);
+    pthread_mutex_unlock(&mutex);
+
+    free(args);
+    for(i = 0; i < arity; i++) ee->stack.pop(li)->release(li);
+    switch(result.type) {
+      case MEMO_INT: ee->stack.push(ee->cache.newNumber(result.valueInt)); break;
+      case MEMO_DOUBLE: ee->stack.push(ee->cache.newNumber(result.valueDouble)); break;
+      case MEMO_STRING: ee->stack.push(ee->cache.newString(result.str, true)); break;
+    }
+    return or_continue;
+  }
+  misses++;
+  pthread_mutex_unlock(&mutex);
+
+  // The string arguments point into objects the call is about to release.
+  for(i = 0; i < arity; i++) {
+    if(args[i].type == MEMO_STRING) args[i].str = strdup(args[i].str);
+  }
+  me = (MemoEntry *) malloc(sizeof(MemoEntry));
+  if(me == (MemoEntry *) 0) slexception.chuck("malloc error", li);
+  me->args = args;
+  me->result.type = MEMO_INT;
+  me->hash = h;
+
+  depth = ee->stack.getStackSize();
+  try {
+    ret = code->action(ee);
+  } catch(Exception *e) {
+    freeEntry(me);
+    e->rechuck(li);
+  }
+
+  if((ret != or_continue) || (ee->stack.getStackSize() != depth - arity + 1) || ! getValue(ee->stack.getStack()->getObject(), &result, li, ee)) {
+    freeEntry(me);
+    if(ret != or_continue) return ret;
+    slexception.chuck("memo function must return a number or string", li);
+  }
+  if(result.type == MEMO_STRING) result.str = strdup(result.str);
+  me->result = result;
+
+  pthread_mutex_lock(&mutex);
+  if(find(h, args) == (MemoEntry *) 0) add(me);
+  else freeEntry(me);
+  pthread_mutex_unlock(&mutex);
+
+  return or_continue;
+}
+
+MemoCall::MemoCall(Memo *m, LexInfo *li) : Operation(li), memo(m) { }
+
+OperatorReturn MemoCall::action(ExecutionEnvironment *ee) {
+  if(memo == (Memo *) 0) slexception.chuck("memo function has been freed", getLexInfo());
+  return memo->call(ee, getLexInfo());
+}
+
+void MemoCall::forget() { memo = (Memo *) 0; }
+
+MemoCode::MemoCode(Memo *m, Cache *c) : Code(m->getOperationList(), c), memo(m) { }
+MemoCode::~MemoCode() { delete memo; }
+
+MemoFunction::MemoFunction(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn MemoFunction::action(ExecutionEnvironment *ee) {
+  Object *o1;
+  Object *o2;
+  Object *o3;
+  Code *code;
+  Number *n;
+  Memo *memo;
+  INT arity;
+  INT limit;
+  INT ret;
+
+  switch(function) {
+    case MEMO_CREATE:
+    case MEMO_LIMIT:
+      o1 = (function == MEMO_LIMIT ? ee->stack.pop(getLexInfo()) : (Object *) 0);
+      o2 = ee->stack.pop(getLexInfo());
+      o3 = ee->stack.pop(getLexInfo());
+      limit = 0;
+      if(o1 != (Object *) 0) {
+        n = o1->getNumber(getLexInfo(), ee);
+        limit = n->getInt();
+        n->release(getLexInfo());
+        if(limit < 1) slexception.chuck("memo limit must be at least 1", getLexInfo());
+      }
+      n = o2->getNumber(getLexInfo(), ee);
+      arity = n->getInt();
+      n->release(getLexInfo());
+      if(arity < 0) slexception.chuck("memo arity can't be negative", getLexInfo());
+      code = o3->getCode(getLexInfo(), ee);
+      memo = new Memo(code, arity, limit);
+      ee->stack.push(new MemoCode(memo, &ee->cache));
+      if(o1 != (Object *) 0) o1->release(getLexInfo());
+      o2->release(getLexInfo());
+      o3->release(getLexInfo());
+      break;
+
+    case MEMO_HITS:
+    case MEMO_MISSES:
+    case MEMO_SIZE:
+    case MEMO_CLEAR:
+      o1 = ee->stack.pop(getLexInfo());
+      code = o1->getCode(getLexInfo(), ee);
+      pthread_mutex_lock(&memosMutex);
+      for(memo = memos; (memo != (Memo *) 0) && (memo->getOperationList() != code->getOperationList()); memo = memo->getNext()) ;
+      pthread_mutex_unlock(&memosMutex);
+      if(memo == (Memo *) 0) {
+        code->release(getLexInfo());
+        o1->release(getLexInfo());
+        slexception.chuck("not a memo function", getLexInfo());
+      }
+
+      // The code is held until we're done, so the memo can't be freed under us.
+      ret = 0;
+      switch(function) {
+        case MEMO_HITS: ret = memo->getHits(); break;
+        case MEMO_MISSES: ret = memo->getMisses(); break;
+        case MEMO_SIZE: ret = memo->getSize(); break;
+        case MEMO_CLEAR: memo->clear(); break;
+      }
+      code->release(getLexInfo());
+      o1->release(getLexInfo());
+      if(function != MEMO_CLEAR) ee->stack.push(ee->cache.newNumber(ret));
+      break;
+  }
+
+  return or_continue;
+}
+
+static void addMemoFunction(const char *name, int function) {
+  OperationList *ol;
+  Variable *v;
+
+  ol = new OperationList;
+  ol->addOperation(new MemoFunction(function, (LexInfo *) 0));
+  v = new Variable(name);
+  v->setObject(new Code(ol, &mainEE.cache));
+  btree.addVariable(v);
+}
+
 void setupShaleNamespace(const char *arg0) {
   Variable *v;
 
@@ -978,6 +1396,13 @@ void setupShaleNamespace(const char *arg0) {
   v = new Variable("/language/option/shale");
   v->setObject(mainEE.cache.newString("en", false));
   btree.addVariable(v);
+
+  addMemoFunction("/memo/shale", MEMO_CREATE);
+  addMemoFunction("/limit/memo/shale", MEMO_LIMIT);
+  addMemoFunction("/hits/memo/shale", MEMO_HITS);
+  addMemoFunction("/misses/memo/shale", MEMO_MISSES);
+  addMemoFunction("/size/memo/shale", MEMO_SIZE);
+  addMemoFunction("/clear/memo/shale", MEMO_CLEAR);
 }
 
 int main(int ac, char **av) {
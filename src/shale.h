@@ -34,7 +34,7 @@ SOFTWARE.
 
 #define MAJOR ((INT)  1)
 #define MINOR ((INT)  3)
-#define MICRO ((INT) 16)
+#define MICRO ((INT) 27)
 
 // Lexical analyser stuff.
 
@@ -145,3 +145,105 @@ struct Keyword {
 
 // Size of the stack to keep track of nested code segments.
 #define OL_STACK_SIZE 256
+
+// Memoised functions, from memo shale::(). A Memo wraps a code fragment and
+// caches its result against the values of its arguments.
+
+#define MEMO_CREATE   0
+#define MEMO_LIMIT    1
+#define MEMO_HITS     2
+#define MEMO_MISSES   3
+#define MEMO_SIZE     4
+#define MEMO_CLEAR    5
+
+// Start with this many hash buckets, doubling whenever there are as many
+// entries as buckets.
+#define MEMO_BUCKETS  64
+
+#define MEMO_INT      'i'
+#define MEMO_DOUBLE   'd'
+#define MEMO_STRING   's'
+
+struct MemoValue {
+  char type;
+  INT valueInt;
+  double valueDouble;
+  char *str;
+};
+
+struct MemoEntry {
+  unsigned long hash;
+  MemoValue *args;
+  MemoValue result;
+  MemoEntry *chain;
+  MemoEntry *newer;
+  MemoEntry *older;
+};
+
+class MemoCall;
+
+class Memo {
+  public:
+    Memo(Code *, INT, INT);
+    ~Memo();
+    OperatorReturn call(ExecutionEnvironment *, LexInfo *);
+    OperationList *getOperationList();
+    Memo *getNext();
+    INT getHits();
+    INT getMisses();
+    INT getSize();
+    void clear();
+
+  private:
+    bool getValue(Object *, MemoValue *, LexInfo *, ExecutionEnvironment *);
+    unsigned long hashArgs(MemoValue *);
+    bool sameArgs(MemoValue *, MemoValue *);
+    MemoEntry *find(unsigned long, MemoValue *);
+    void add(MemoEntry *);
+    void unlink(MemoEntry *);
+    void freeEntry(MemoEntry *);
+
+    Code *code;
+    OperationList *operationList;
+    MemoCall *memoCall;
+    INT arity;
+    INT limit;
+    INT count;
+    INT hits;
+    INT misses;
+    unsigned long buckets;
+    MemoEntry **table;
+    MemoEntry *newest;
+    MemoEntry *oldest;
+    pthread_mutex_t mutex;
+    Memo *next;
+};
+
+class MemoCall : public Operation {
+  public:
+    MemoCall(Memo *, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+    void forget();
+
+  private:
+    Memo *memo;
+};
+
+// The code memo pushes. The memo lives as long as it does.
+class MemoCode : public Code {
+  public:
+    MemoCode(Memo *, Cache *);
+    ~MemoCode();
+
+  private:
+    Memo *memo;
+};
+
+class MemoFunction : public Operation {
+  public:
+    MemoFunction(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
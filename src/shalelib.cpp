@@ -42,6 +42,7 @@ int LexInfo::getIndex() { return index; }
 
 Exception::Exception() : lexInfo((LexInfo *) 0), message("internal error") { }
 void Exception::chuck(const char *m, LexInfo *li) { message = m; lexInfo = li; throw this; }
+void Exception::rechuck(LexInfo *li) { if(lexInfo == (LexInfo *) 0) lexInfo = li; throw this; }
 void Exception::printError() {
   const char *f;
   int i;
@@ -69,7 +70,16 @@ void CacheDebug::decUsed() { used--; }
 void CacheDebug::incNew() { news++; }
 void CacheDebug::debug() { printf("count %d, free %d", news, used); }
 
-Cache::Cache() : usedNumbers((ObjectBag *) 0), usedStrings((ObjectBag *) 0), usedPointers((ObjectBag *) 0), unusedBags((ObjectBag *) 0), usedMutexes((MutexBag *) 0), unusedMutexBags((MutexBag *) 0) { }
+// A cache belongs to the thread that created it, or that last claimed it. The
+// free lists and counts aren't locked, so objects released by any other thread,
+// such as the old value of a namespace variable another thread created, are
+// freed rather than cached, and other threads allocating from it get new
+// objects, without touching either. The owner itself is read by other threads,
+// so it's loaded and stored atomically.
+Cache::Cache() : usedNumbers((ObjectBag *) 0), usedStrings((ObjectBag *) 0), usedPointers((ObjectBag *) 0), unusedBags((ObjectBag *) 0), usedMutexes((MutexBag *) 0), unusedMutexBags((MutexBag *) 0), owner(pthread_self()) { }
+
+void Cache::claim() { __atomic_store_n(&owner, pthread_self(), __ATOMIC_RELEASE); }
+bool Cache::isOwner() { return pthread_equal(__atomic_load_n(&owner, __ATOMIC_ACQUIRE), pthread_self()); }
 
 void Cache::incUnused() { unused++; }
 void Cache::decUnused() { unused--; }
@@ -78,6 +88,8 @@ Number *Cache::newNumber(INT i) {
   ObjectBag *nb;
   Number *ret;
 
+  if(! isOwner()) return new Number(i, this);
+
   if(usedNumbers != (ObjectBag *) 0) {
     nb = usedNumbers;
     usedNumbers = usedNumbers->next;
@@ -100,6 +112,8 @@ Number *Cache::newNumber(double d) {
   ObjectBag *nb;
   Number *ret;
 
+  if(! isOwner()) return new Number(d, this);
+
   if(usedNumbers != (ObjectBag *) 0) {
     nb = usedNumbers;
     usedNumbers = usedNumbers->next;
@@ -121,6 +135,11 @@ Number *Cache::newNumber(double d) {
 void Cache::deleteNumber(Number *n) {
   ObjectBag *ob;
 
+  if(! isOwner()) {
+    delete n;
+    return;
+  }
+
   if(unusedBags != (ObjectBag *) 0) {
     ob = unusedBags;
     unusedBags = unusedBags->next;
@@ -140,6 +159,8 @@ String *Cache::newString(const char *s, bool rsf) {
   ObjectBag *ob;
   String *ret;
 
+  if(! isOwner()) return new String(s, this, rsf);
+
   if(usedStrings != (ObjectBag *) 0) {
     ob = usedStrings;
     usedStrings = usedStrings->next;
@@ -162,6 +183,11 @@ String *Cache::newString(const char *s, bool rsf) {
 void Cache::deleteString(String *str) {
   ObjectBag *ob;
 
+  if(! isOwner()) {
+    delete str;
+    return;
+  }
+
   if(str->getRemoveStringFlag()) free((void *) str->getValue());
   if(unusedBags != (ObjectBag *) 0) {
     ob = unusedBags;
@@ -180,6 +206,8 @@ Pointer *Cache::newPointer(Object *o) {
   ObjectBag *pb;
   Pointer *ret;
 
+  if(! isOwner()) return new Pointer(o, this);
+
   if(usedPointers != (ObjectBag *) 0) {
     pb = usedPointers;
     usedPointers = usedPointers->next;
@@ -201,6 +229,11 @@ Pointer *Cache::newPointer(Object *o) {
 void Cache::deletePointer(Pointer *p) {
   ObjectBag *ob;
 
+  if(! isOwner()) {
+    delete p;
+    return;
+  }
+
   if(unusedBags != (ObjectBag *) 0) {
     ob = unusedBags;
     unusedBags = unusedBags->next;
@@ -218,6 +251,12 @@ pthread_mutex_t *Cache::newMutex() {
   MutexBag *mb;
   pthread_mutex_t *ret;
 
+  if(! isOwner()) {
+    ret = new pthread_mutex_t;
+    pthread_mutex_init(ret, NULL);
+    return ret;
+  }
+
   if(usedMutexes != (MutexBag *) 0) {
     mb = usedMutexes;
     usedMutexes = usedMutexes->next;
@@ -236,6 +275,12 @@ pthread_mutex_t *Cache::newMutex() {
 void Cache::deleteMutex(pthread_mutex_t *mutex) {
   MutexBag *mb;
 
+  if(! isOwner()) {
+    pthread_mutex_destroy(mutex);
+    delete mutex;
+    return;
+  }
+
   if(unusedMutexBags != (MutexBag *) 0) {
     mb = unusedMutexBags;
     unusedMutexBags = unusedMutexBags->next;
@@ -265,6 +310,20 @@ bool Object::isName() { return false; }
 Name *Object::getName(LexInfo *li, ExecutionEnvironment *ee) { slexception.chuck("name not found", li); return (Name *) 0; }
 Code *Object::getCode(LexInfo *li, ExecutionEnvironment *ee) { slexception.chuck("code not found", li); return (Code *) 0; }
 Pointer *Object::getPointer(LexInfo *li, ExecutionEnvironment *ee) { slexception.chuck("pointer not found", li); return (Pointer *) 0; }
+Handle *Object::getHandle(LexInfo *li, ExecutionEnvironment *ee) { slexception.chuck("handle not found", li); return (Handle *) 0; }
+// The object a variable is given when this is assigned to it, held. Libraries
+// that store values use it too, so a name is stored as the value of its variable.
+Object *Object::resolveValue(LexInfo *li, ExecutionEnvironment *ee) {
+  try { return getNumber(li, ee); } catch(Exception *e) { }
+  try { return getString(li, ee); } catch(Exception *e) { }
+  try { return getCode(li, ee); } catch(Exception *e) { }
+  try { return getPointer(li, ee); } catch(Exception *e) { }
+  try { return getHandle(li, ee); } catch(Exception *e) { }
+
+  slexception.chuck("value not found", li);
+  return (Object *) 0;
+}
+bool Object::setValue(Object *o) { return false; }   // true if this object takes the value itself rather than being replaced
 bool Object::isDynamic() { return ! isStatic; }
 void Object::hold() {
   if(! isStatic) {
@@ -369,7 +428,7 @@ void String::debug() { printf("String: %s\n", str); }
 
 // Name class
 
-Name::Name(const char *n, Cache *c) : Object(c) {
+Name::Name(const char *n, Cache *c) : Object(c), variable((Variable *) 0) {
   int i;
 
   for(i = 0; (i < (MAX_NAME_LENGTH - 1)) && (n[i] != 0); i++) {
@@ -378,7 +437,7 @@ Name::Name(const char *n, Cache *c) : Object(c) {
   name[i] = 0;
 }
 
-Name::Name(const char *n, Cache *c, ObjectOption oo) : Object(c, oo) {
+Name::Name(const char *n, Cache *c, ObjectOption oo) : Object(c, oo), variable((Variable *) 0) {
   int i;
 
   for(i = 0; (i < (MAX_NAME_LENGTH - 1)) && (n[i] != 0); i++) {
@@ -401,7 +460,7 @@ char *Name::getValue() {
 
 Number *Name::getNumber(LexInfo *li, ExecutionEnvironment *ee) {
   static char buf[128];
-  Variable *v = ee->variableStack.findVariable(name);
+  Variable *v = findVariable(ee);
   if(v == (Variable *) 0) { sprintf(buf, "variable error: %s not found", name); slexception.chuck(buf, li); }
   if(! v->isInitialised()) { sprintf(buf, "variable error: %s not initialised", name); slexception.chuck(buf, li); }
   return v->getObject()->getNumber(li, ee);
@@ -409,7 +468,7 @@ Number *Name::getNumber(LexInfo *li, ExecutionEnvironment *ee) {
 
 String *Name::getString(LexInfo *li, ExecutionEnvironment *ee) {
   static char buf[128];
-  Variable *v = ee->variableStack.findVariable(name);
+  Variable *v = findVariable(ee);
   if(v == (Variable *) 0) { sprintf(buf, "variable error: %s not found", name); slexception.chuck(buf, li); }
   if(! v->isInitialised()) { sprintf(buf, "variable error: %s not initialised", name); slexception.chuck(buf, li); }
   return v->getObject()->getString(li, ee);
@@ -417,7 +476,7 @@ String *Name::getString(LexInfo *li, ExecutionEnvironment *ee) {
 
 Code *Name::getCode(LexInfo *li, ExecutionEnvironment *ee) {
   static char buf[128];
-  Variable *v = ee->variableStack.findVariable(name);
+  Variable *v = findVariable(ee);
   if(v == (Variable *) 0) { sprintf(buf, "variable error: %s not found", name); slexception.chuck(buf, li); }
   if(! v->isInitialised()) { sprintf(buf, "variable error: %s not initialised", name); slexception.chuck(buf, li); }
   return v->getObject()->getCode(li, ee);
@@ -425,12 +484,36 @@ Code *Name::getCode(LexInfo *li, ExecutionEnvironment *ee) {
 
 Pointer *Name::getPointer(LexInfo *li, ExecutionEnvironment *ee) {
   static char buf[128];
-  Variable *v = ee->variableStack.findVariable(name);
+  Variable *v = findVariable(ee);
   if(v == (Variable *) 0) { sprintf(buf, "variable error: %s not found", name); slexception.chuck(buf, li); }
   if(! v->isInitialised()) { sprintf(buf, "variable error: %s not initialised", name); slexception.chuck(buf, li); }
   return v->getObject()->getPointer(li, ee);
 }
 
+Handle *Name::getHandle(LexInfo *li, ExecutionEnvironment *ee) {
+  static char buf[128];
+  Variable *v = findVariable(ee);
+  if(v == (Variable *) 0) { sprintf(buf, "variable error: %s not found", name); slexception.chuck(buf, li); }
+  if(! v->isInitialised()) { sprintf(buf, "variable error: %s not initialised", name); slexception.chuck(buf, li); }
+  return v->getObject()->getHandle(li, ee);
+}
+
+// Namespace variables are never removed, so once a namespace name has been found
+// the Variable is remembered and later lookups through this Name are free.
+Variable *Name::findVariable(ExecutionEnvironment *ee) {
+  Variable *v;
+
+  if(name[0] != '/') return ee->variableStack.findVariable(name);
+
+  if((v = __atomic_load_n(&variable, __ATOMIC_ACQUIRE)) != (Variable *) 0) return v;
+  v = ee->variableStack.findVariable(name);
+  // Only variables in the btree, which are all in the namespace index, stay put.
+  // A resolver may hand back one that moves, like an array element.
+  if((v != (Variable *) 0) && (v->getNamespace() != (NamespaceNode *) 0)) __atomic_store_n(&variable, v, __ATOMIC_RELEASE);
+
+  return v;
+}
+
 void Name::debug() { printf("Name: %s\n", name); }
 
 // Code class
@@ -470,6 +553,23 @@ void Pointer::release(LexInfo *li) {
 }
 void Pointer::debug() { printf("Pointer\n"); }
 
+// Handle class
+
+Handle::Handle(const char *t, Cache *c) : Object(c), type(t) { }
+Handle *Handle::getHandle(LexInfo *li, ExecutionEnvironment *ee) { this->hold(); return this; }
+const char *Handle::getType() { return type; }
+bool Handle::isType(const char *t) { return strcmp(type, t) == 0; }
+void Handle::hold() { if(! isStatic) __atomic_add_fetch(&referenceCount, 1, __ATOMIC_RELAXED); }
+void Handle::release(LexInfo *li) {
+  int n;
+
+  if(isStatic) return;
+  n = __atomic_sub_fetch(&referenceCount, 1, __ATOMIC_ACQ_REL);
+  if(n < -1) slexception.chuck("reference error", li);
+  if(n == -1) delete(this);
+}
+void Handle::debug() { printf("Handle: %s\n", type); }
+
 // Operation classes
 
 Operation::Operation(LexInfo *li) : lexInfo(li) { }
@@ -504,13 +604,13 @@ Operation *OperationListItem::getOperation() {
 
 // OperationList class
 
-OperationList::OperationList() : head((OperationListItem *) 0), tail((OperationListItem *) 0), newVariableStack(false), isFn(false) { }
+OperationList::OperationList() : head((OperationListItem *) 0), tail((OperationListItem *) 0), newVariableStack(false), variableCount(0), isFn(false) { }
 
 void OperationList::addOperation(Operation *op) {
   OperationListItem *oli = new OperationListItem(op);
   if(head == (OperationListItem *) 0) { head = tail = oli; }
   else { tail->setNext(oli); tail = oli; }
-  if(op->isVar()) newVariableStack = true;
+  if(op->isVar()) { newVariableStack = true; variableCount++; }
   if(op->isFunction()) isFn = true;
 }
 
@@ -526,7 +626,7 @@ OperatorReturn OperationList::action(ExecutionEnvironment *ee) {
   OperatorReturn ret;
 
   ret = or_continue;
-  if(newVariableStack) ee->variableStack.addVariableStack();
+  if(newVariableStack) ee->variableStack.addVariableStack(variableCount);
   for(OperationListItem *oli = head; oli != (OperationListItem *) 0; oli = oli->getNext()) {
     if((ret = oli->getOperation()->action(ee)) != or_continue) {
       break;
@@ -542,7 +642,7 @@ OperatorReturn OperationList::actionLatest(ExecutionEnvironment *ee) {
   OperatorReturn ret;
 
   ret = or_continue;
-  if(newVariableStack && ee->variableStack.isEmpty()) ee->variableStack.addVariableStack();
+  if(newVariableStack && ee->variableStack.isEmpty()) ee->variableStack.addVariableStack(variableCount);
   oli = tail;
   if(oli != (OperationListItem *) 0) {
     ret = oli->getOperation()->action(ee);
@@ -1001,9 +1101,11 @@ Var::Var(LexInfo *li) : Operation(li) { }
 
 OperatorReturn Var::action(ExecutionEnvironment *ee) {
   Object *o;
+  Name *n;
 
   o = ee->stack.pop(getLexInfo());
-  ee->variableStack.addVariable(o->getName(getLexInfo(), ee)->getValue(), getLexInfo());
+  n = o->getName(getLexInfo(), ee);
+  ee->variableStack.addVariable(n->getValue(), ! n->isDynamic(), getLexInfo());
   o->release(getLexInfo());
 
   return or_continue;
@@ -1018,60 +1120,24 @@ Assign::Assign(LexInfo *li) : Operation(li) { }
 OperatorReturn Assign::action(ExecutionEnvironment *ee) {
   Object *var;
   Object *val;
-  Number *number;
-  String *string;
-  Code *code;
-  Pointer *pointer;
   Object *o;
   Variable *v;
   bool varfound;
   bool valfound;
-  static char message[1024];
 
   val = ee->stack.pop(getLexInfo());
   var = ee->stack.pop(getLexInfo());
   varfound = false;
   valfound = false;
+  o = (Object *) 0;
 
   // Is this a variable we're assigning?
   try {
-    v = ee->variableStack.findVariable(var->getName(getLexInfo(), ee)->getValue());
+    v = var->getName(getLexInfo(), ee)->findVariable(ee);
     if(v != (Variable *) 0) {
       varfound = true;
-
-      try {
-        number = val->getNumber(getLexInfo(), ee);
-        v->setObject(number);
-        number->release(getLexInfo());
-        valfound = true;
-      } catch(Exception *e) { }
-
-      if(! valfound) {
-        try {
-          string = val->getString(getLexInfo(), ee);
-          v->setObject(string);
-          string->release(getLexInfo());
-          valfound = true;
-        } catch(Exception *e) { }
-      }
-
-      if(! valfound) {
-        try {
-          code = val->getCode(getLexInfo(), ee);
-          v->setObject(code);
-          code->release(getLexInfo());
-          valfound = true;
-        } catch(Exception *e) { }
-      }
-
-      if(! valfound) {
-        try {
-          pointer = val->getPointer(getLexInfo(), ee);
-          v->setObject(pointer);
-          pointer->release(getLexInfo());
-          valfound = true;
-        } catch(Exception *e) { }
-      }
+      o = val->resolveValue(getLexInfo(), ee);
+      valfound = true;
     }
   } catch(Exception *e) { }
 
@@ -1083,6 +1149,15 @@ OperatorReturn Assign::action(ExecutionEnvironment *ee) {
     }
   }
 
+  // The variable may refuse the value, eg a read-only shared variable.
+  try {
+    v->setObject(o);
+  } catch(Exception *e) {
+    o->release(getLexInfo());
+    e->rechuck(getLexInfo());
+  }
+  o->release(getLexInfo());
+
   val->release(getLexInfo());
   var->release(getLexInfo());
 
@@ -1113,7 +1188,7 @@ OperatorReturn AssignAdd::action(ExecutionEnvironment *ee) {
   found = false;
 
   // Is this a variable we're assigning?
-  v = ee->variableStack.findVariable(var->getName(getLexInfo(), ee)->getValue());
+  v = var->getName(getLexInfo(), ee)->findVariable(ee);
   if(v != (Variable *) 0) {
     try {
       lnumber = var->getNumber(getLexInfo(), ee);
@@ -1176,7 +1251,7 @@ OperatorReturn AssignSub::action(ExecutionEnvironment *ee) {
   found = false;
 
   // Is this a variable we're assigning?
-  v = ee->variableStack.findVariable(var->getName(getLexInfo(), ee)->getValue());
+  v = var->getName(getLexInfo(), ee)->findVariable(ee);
   if(v != (Variable *) 0) {
     // Is it a number, string or code
     try {
@@ -1220,7 +1295,7 @@ OperatorReturn AssignMul::action(ExecutionEnvironment *ee) {
   found = false;
 
   // Is this a variable we're assigning?
-  v = ee->variableStack.findVariable(var->getName(getLexInfo(), ee)->getValue());
+  v = var->getName(getLexInfo(), ee)->findVariable(ee);
   if(v != (Variable *) 0) {
     // Is it a number, string or code
     try {
@@ -1264,7 +1339,7 @@ OperatorReturn AssignDiv::action(ExecutionEnvironment *ee) {
   found = false;
 
   // Is this a variable we're assigning?
-  v = ee->variableStack.findVariable(var->getName(getLexInfo(), ee)->getValue());
+  v = var->getName(getLexInfo(), ee)->findVariable(ee);
   if(v != (Variable *) 0) {
     // Is it a number, string or code
     try {
@@ -1306,7 +1381,7 @@ OperatorReturn PointerAssign::action(ExecutionEnvironment *ee) {
   found = false;
 
   try {
-    v = ee->variableStack.findVariable(var->getName(getLexInfo(), ee)->getValue());
+    v = var->getName(getLexInfo(), ee)->findVariable(ee);
     if(v != (Variable *) 0) {
       p = ee->cache.newPointer(val);
       v->setObject(p);
@@ -1356,12 +1431,14 @@ OperatorReturn PlusPlus::action(ExecutionEnvironment *ee) {
   Number *n;
   Number *newn;
   static char buf[128];
+  Name *name;
   char *vname;
 
   o = ee->stack.pop(getLexInfo());
 
-  vname = o->getName(getLexInfo(), ee)->getValue();
-  v = ee->variableStack.findVariable(vname);
+  name = o->getName(getLexInfo(), ee);
+  vname = name->getValue();
+  v = name->findVariable(ee);
   if(v == (Variable *) 0) slexception.chuck("variable error", getLexInfo());
   no = v->getObject();
   if(no == (Object *) 0) {
@@ -1392,12 +1469,14 @@ OperatorReturn MinusMinus::action(ExecutionEnvironment *ee) {
   Number *n;
   Number *newn;
   static char buf[128];
+  Name *name;
   char *vname;
 
   o = ee->stack.pop(getLexInfo());
 
-  vname = o->getName(getLexInfo(), ee)->getValue();
-  v = ee->variableStack.findVariable(vname);
+  name = o->getName(getLexInfo(), ee);
+  vname = name->getValue();
+  v = name->findVariable(ee);
   if(v == (Variable *) 0) slexception.chuck("variable error", getLexInfo());
   no = v->getObject();
   if(no == (Object *) 0) {
@@ -1892,6 +1971,12 @@ OperatorReturn Value::action(ExecutionEnvironment *ee) {
     return or_continue;
   } catch (Exception *e) { }
 
+  try {
+    ee->stack.push(o->getHandle(getLexInfo(), ee));
+    o->release(getLexInfo());
+    return or_continue;
+  } catch (Exception *e) { }
+
   slexception.chuck("value error", getLexInfo());
 
   return or_continue;
@@ -1937,7 +2022,7 @@ OperatorReturn ToName::action(ExecutionEnvironment *ee) {
 
 // Namespace class
 
-Namespace::Namespace(LexInfo *li) : Operation(li) { }
+Namespace::Namespace(LexInfo *li) : Operation(li), cached((Name *) 0) { }
 
 OperatorReturn Namespace::action(ExecutionEnvironment *ee) {
   Object *nsobject;
@@ -1956,6 +2041,8 @@ OperatorReturn Namespace::action(ExecutionEnvironment *ee) {
   bool inreleasestring;
   bool found;
   char namebuf[1024];
+  Name *cn;
+  Name *nn;
   const char *p;
   int i;
   int j;
@@ -2042,7 +2129,23 @@ OperatorReturn Namespace::action(ExecutionEnvironment *ee) {
   if(p[j] != 0) slexception.chuck("name too long", getLexInfo());
 
   namebuf[i] = 0;
-  ee->stack.push(new Name(namebuf, &ee->cache));
+
+  // Most :: sites build the same name every time, so the first name built here is
+  // kept and pushed again whenever it matches. It also remembers its Variable.
+  cn = __atomic_load_n(&cached, __ATOMIC_ACQUIRE);
+  if((cn != (Name *) 0) && (strcmp(cn->getValue(), namebuf) == 0)) {
+    ee->stack.push(cn);
+  } else if(cn == (Name *) 0) {
+    cn = new Name(namebuf, &ee->cache, IS_STATIC);
+    nn = (Name *) 0;
+    if(! __atomic_compare_exchange_n(&cached, &nn, cn, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      delete(cn);
+      cn = new Name(namebuf, &ee->cache);
+    }
+    ee->stack.push(cn);
+  } else {
+    ee->stack.push(new Name(namebuf, &ee->cache));
+  }
 
   if(nsreleasestring) nsstring->release(getLexInfo());
   if(inreleasestring) instring->release(getLexInfo());
@@ -2295,7 +2398,7 @@ OperatorReturn Defined::action(ExecutionEnvironment *ee) {
 
   n = 1;
   if(o->isName()) {
-    v = ee->variableStack.findVariable(o->getName(getLexInfo(), ee)->getValue());
+    v = o->getName(getLexInfo(), ee)->findVariable(ee);
     if(v == (Variable *) 0) n = 0;
   }
   ee->stack.push(ee->cache.newNumber(n));
@@ -2316,7 +2419,7 @@ OperatorReturn Initialised::action(ExecutionEnvironment *ee) {
 
   n = 1;
   if(o->isName()) {
-    v = ee->variableStack.findVariable(o->getName(getLexInfo(), ee)->getValue());
+    v = o->getName(getLexInfo(), ee)->findVariable(ee);
     if((v == (Variable *) 0) || (! v->isInitialised())) n = 0;
   }
   ee->stack.push(ee->cache.newNumber(n));
@@ -2337,6 +2440,7 @@ OperatorReturn PrintStack::action(ExecutionEnvironment *ee) {
   String *s;
   Code *c;
   Pointer *p;
+  Handle *h;
   Number *no;
   int i;
   bool found;
@@ -2381,6 +2485,15 @@ OperatorReturn PrintStack::action(ExecutionEnvironment *ee) {
       } catch(Exception *e) { }
     }
 
+    if(! found) {
+      try {
+        h = o->getHandle(getLexInfo(), ee);
+        printf("... %s ...\n", h->getType());
+        h->release(getLexInfo());
+        found = true;
+      } catch(Exception *e) { }
+    }
+
     if(! found) {
       try {
         no = o->getNumber(getLexInfo(), ee);
@@ -2423,7 +2536,10 @@ OperatorReturn BTreeDebug::action(ExecutionEnvironment *ee) {
 
 // Variable class
 
-Variable::Variable(const char *n) : object((Object *) 0), next((Variable *) 0) {
+// Used for the slots in a call frame, which supplies the name buffer.
+Variable::Variable() : name((char *) 0), object((Object *) 0), next((Variable *) 0), ns((NamespaceNode *) 0), nsNext((Variable *) 0), stamp(0) { }
+
+Variable::Variable(const char *n) : object((Object *) 0), next((Variable *) 0), ns((NamespaceNode *) 0), nsNext((Variable *) 0), stamp(0) {
   if((name = (char *) malloc(strlen(n) + 1)) == (char *) 0) slexception.chuck("variable error: malloc failed", (LexInfo *) 0);
   strcpy(name, n);
 }
@@ -2436,17 +2552,45 @@ char *Variable::getName() {
   return name;
 }
 
+void Variable::setName(char *n) {
+  name = n;
+}
+
 Object *Variable::getObject() {
   return object;
 }
 
+// An object that takes the value itself, like a number in a shared namespace
+// segment, keeps it outside the variable. Those changes aren't recorded for
+// snapshots, since restoring one would change the value for every script
+// sharing the segment.
 void Variable::setObject(Object *o) {
+  if((name[0] == '/') && (object != (Object *) 0) && object->setValue(o)) return;
   o->hold();
-  if(name[0] == '/') o->allocateMutex();
+  if(name[0] == '/') {
+    o->allocateMutex();
+    // If a snapshot wants the old object it keeps our hold on it.
+    if((ns != (NamespaceNode *) 0) && btree.isTracking() && btree.recordChange(this)) {
+      object = o;
+      return;
+    }
+  }
   if(object != (Object *) 0) object->release((LexInfo *) 0);
   object = o;
 }
 
+// Set the object without holding it, the caller passes its own hold to us.
+// Used to put back an object taken by a namespace snapshot.
+void Variable::restoreObject(Object *o) {
+  if(object != (Object *) 0) object->release((LexInfo *) 0);
+  object = o;
+}
+
+void Variable::unsetObject() {
+  if(object != (Object *) 0) object->release((LexInfo *) 0);
+  object = (Object *) 0;
+}
+
 bool Variable::isInitialised() {
   return object != (Object *) 0;
 }
@@ -2459,20 +2603,42 @@ void Variable::setNext(Variable *n) {
   next = n; 
 }
 
+NamespaceNode *Variable::getNamespace() {
+  return ns;
+}
+
+void Variable::setNamespace(NamespaceNode *n) {
+  ns = n;
+}
+
+Variable *Variable::getNamespaceNext() {
+  return nsNext;
+}
+
+void Variable::setNamespaceNext(Variable *n) {
+  nsNext = n;
+}
+
+unsigned long Variable::getStamp() {
+  return stamp;
+}
+
+void Variable::setStamp(unsigned long s) {
+  stamp = s;
+}
+
 // VariableStackItem class
 
-VariableStackItem::VariableStackItem(VariableStackItem *d) : list((Variable *) 0), down(d) { }
+VariableStackItem::VariableStackItem(VariableStackItem *d) : slots((Variable *) 0), names((char *) 0), capacity(0), used(0), list((Variable *) 0), down(d) { }
 
 VariableStackItem::~VariableStackItem() {
-  Variable *t, *l = list;
-  Object *o;
+  int i;
 
-  while(l != (Variable *) 0) {
-    o = l->getObject();
-    if(o != (Object *) 0) o->release((LexInfo *) 0);
-    t = l->getNext();
-    delete(l);
-    l = t;
+  clear();
+  if(slots != (Variable *) 0) {
+    for(i = 0; i < capacity; i++) slots[i].setName((char *) 0);
+    delete [] slots;
+    free(names);
   }
 }
 
@@ -2484,11 +2650,53 @@ void VariableStackItem::setDown(VariableStackItem *d) {
   down = d;
 }
 
+// Grow the slot array to hold n variables. Only called on an empty frame. A
+// frame keeps its slots while it's pooled, and frees them when it's deleted.
+void VariableStackItem::reserve(int n) {
+  int i;
+
+  if(n <= capacity) return;
+
+  if(slots != (Variable *) 0) {
+    for(i = 0; i < capacity; i++) slots[i].setName((char *) 0);
+    delete [] slots;
+    free(names);
+    slots = (Variable *) 0;
+    names = (char *) 0;
+  }
+  capacity = n;
+  slots = new Variable[n];
+  if((names = (char *) malloc(n * MAX_NAME_LENGTH)) == (char *) 0) slexception.chuck("variable error: malloc failed", (LexInfo *) 0);
+}
+
+// Release the variables, leaving the slots ready for the next call.
+void VariableStackItem::clear() {
+  Variable *t, *l = list;
+  int i;
+
+  for(i = 0; i < used; i++) slots[i].unsetObject();
+  used = 0;
+
+  while(l != (Variable *) 0) {
+    l->unsetObject();
+    t = l->getNext();
+    delete(l);
+    l = t;
+  }
+  list = (Variable *) 0;
+}
+
 Variable *VariableStackItem::addVariable(char *v) {
-  return addVariable(v, (LexInfo *) 0);
+  return addVariable(v, false, (LexInfo *) 0);
 }
 
 Variable *VariableStackItem::addVariable(char *v, LexInfo *li) {
+  return addVariable(v, false, li);
+}
+
+// If the name outlives the frame, as a name in the parsed script does, a slot
+// points at it rather than taking a copy.
+Variable *VariableStackItem::addVariable(char *v, bool keep, LexInfo *li) {
   Variable *l;
   static char msg[64];
 
@@ -2501,15 +2709,23 @@ Variable *VariableStackItem::addVariable(char *v, LexInfo *li) {
       slexception.chuck(msg, li);
     }
   } else {
-    for(l = list; l != (Variable *) 0; l = l->getNext()) {
-      if(strcmp(v, l->getName()) == 0) {
-        sprintf(msg, "variable %s already defined", v);
-        slexception.chuck(msg, li);
+    if(findVariable(v) != (Variable *) 0) {
+      sprintf(msg, "variable %s already defined", v);
+      slexception.chuck(msg, li);
+    }
+    if((used < capacity) && (keep || (strlen(v) < MAX_NAME_LENGTH))) {
+      l = &slots[used];
+      if(keep) l->setName(v);
+      else {
+        l->setName(&names[used * MAX_NAME_LENGTH]);
+        strcpy(l->getName(), v);
       }
+      used++;
+    } else {
+      l = new Variable(v);
+      l->setNext(list);
+      list = l;
     }
-    l = new Variable(v);
-    l->setNext(list);
-    list = l;
   }
 
   return l;
@@ -2517,10 +2733,12 @@ Variable *VariableStackItem::addVariable(char *v, LexInfo *li) {
 
 Variable *VariableStackItem::findVariable(char *v) {
   Variable *l;
+  int i;
 
   if(v[0] == '/') {
     if((l = btree.findVariable(v)) != (Variable *) 0) return l;
   } else {
+    for(i = 0; i < used; i++) if(strcmp(v, slots[i].getName()) == 0) return &slots[i];
     for(l = list; l != (Variable *) 0; l = l->getNext()) if(strcmp(v, l->getName()) == 0) return l;
   }
 
@@ -2529,31 +2747,59 @@ Variable *VariableStackItem::findVariable(char *v) {
 
 // VariableStack class
 
-VariableStack::VariableStack() : head((VariableStackItem *) 0) { }
+VariableStack::VariableStack() : head((VariableStackItem *) 0), unused((VariableStackItem *) 0), depth(0) { }
 
 void VariableStack::addVariableStack() {
-  VariableStackItem *vsi = new VariableStackItem(head);
+  addVariableStack(0);
+}
+
+void VariableStack::addVariableStack(int n) {
+  VariableStackItem *vsi;
+
+  if(unused != (VariableStackItem *) 0) {
+    vsi = unused;
+    unused = vsi->getDown();
+    vsi->setDown(head);
+  } else {
+    vsi = new VariableStackItem(head);
+  }
+  vsi->reserve(n);
   head = vsi;
+  depth++;
 }
 
 void VariableStack::popVariableStack() {
   VariableStackItem *vsi = head;
   if(vsi != (VariableStackItem *) 0) {
     head = vsi->getDown();
-    delete(vsi);
+    vsi->clear();
+    vsi->setDown(unused);
+    unused = vsi;
+    depth--;
   } else {
     slexception.chuck("variable stack error", (LexInfo *) 0);
   }
 }
 
 Variable *VariableStack::addVariable(char *n) {
-  if(head != (VariableStackItem *) 0) return head->addVariable(n);
-  slexception.chuck("variable stack error", (LexInfo *) 0);
-  return (Variable *) 0;
+  return addVariable(n, (LexInfo *) 0);
 }
 
 Variable *VariableStack::addVariable(char *n, LexInfo *li) {
-  if(head != (VariableStackItem *) 0) return head->addVariable(n, li);
+  return addVariable(n, false, li);
+}
+
+Variable *VariableStack::addVariable(char *n, bool keep, LexInfo *li) {
+  static char msg[64];
+
+  if((*n == '/') && ThreadLocals::isThreadLocal(n)) {
+    if(locals.findVariable(n) != (Variable *) 0) {
+      sprintf(msg, "variable %s already defined", n);
+      slexception.chuck(msg, li);
+    }
+    return locals.addVariable(n);
+  }
+  if(head != (VariableStackItem *) 0) return head->addVariable(n, keep, li);
   slexception.chuck("variable stack error", li);
   return (Variable *) 0;
 }
@@ -2563,6 +2809,7 @@ Variable *VariableStack::findVariable(char *n) {
   VariableStackItem *vsi = head;
 
   if(*n == '/') {
+    if(ThreadLocals::isThreadLocal(n)) return locals.findVariable(n);
     return btree.findVariable(n);
   } else {
     while(vsi != (VariableStackItem *) 0) {
@@ -2577,6 +2824,89 @@ bool VariableStack::isEmpty() {
   return head == (VariableStackItem *) 0;
 }
 
+int VariableStack::getDepth() {
+  return depth;
+}
+
+// ThreadLocals class
+
+ThreadLocals::ThreadLocals() : buckets((Variable **) 0), size(0), count(0) { }
+
+ThreadLocals::~ThreadLocals() {
+  Variable *v, *t;
+  unsigned int i;
+
+  for(i = 0; i < size; i++) {
+    for(v = buckets[i]; v != (Variable *) 0; v = t) {
+      t = v->getNext();
+      v->unsetObject();
+      delete v;
+    }
+  }
+  delete [] buckets;
+}
+
+bool ThreadLocals::isThreadLocal(const char *n) {
+  size_t l = strlen(n);
+
+  return (l >= 4) && (strcmp(n + l - 4, "/tls") == 0);
+}
+
+unsigned int ThreadLocals::hash(const char *n) {
+  unsigned int h = 2166136261u;
+
+  while(*n != 0) { h ^= (unsigned char) *n++; h *= 16777619u; }
+
+  return h;
+}
+
+Variable *ThreadLocals::findVariable(const char *n) {
+  Variable *v;
+
+  if(count == 0) return (Variable *) 0;
+  for(v = buckets[hash(n) & (size - 1)]; v != (Variable *) 0; v = v->getNext()) {
+    if(strcmp(n, v->getName()) == 0) return v;
+  }
+
+  return (Variable *) 0;
+}
+
+Variable *ThreadLocals::addVariable(const char *n) {
+  Variable *v;
+  unsigned int b;
+
+  if(count >= size) grow();
+  v = new Variable(n);
+  b = hash(n) & (size - 1);
+  v->setNext(buckets[b]);
+  buckets[b] = v;
+  count++;
+
+  return v;
+}
+
+// Double the table, or start it at 16 buckets, keeping no more than one
+// variable per bucket on average.
+void ThreadLocals::grow() {
+  Variable **old = buckets;
+  Variable *v, *t;
+  unsigned int oldSize = size;
+  unsigned int i, b;
+
+  size = (size == 0) ? 16 : size * 2;
+  buckets = new Variable *[size];
+  for(i = 0; i < size; i++) buckets[i] = (Variable *) 0;
+  for(i = 0; i < oldSize; i++) {
+    for(v = old[i]; v != (Variable *) 0; v = t) {
+      t = v->getNext();
+      b = hash(v->getName()) & (size - 1);
+      v->setNext(buckets[b]);
+      buckets[b] = v;
+    }
+  }
+  delete [] old;
+}
+
 // The BTree classes
 
 BTreeNode::BTreeNode(bool l) : leaf(l), number(0) { }
@@ -2588,6 +2918,16 @@ BTreeNode::BTreeNode(bool l, BTreeNode *left, Variable *d, BTreeNode *right) : l
   pointer[1] = right;
 }
 
+BTreeNode::BTreeNode(BTreeNode *n) : leaf(n->leaf), number(n->number) {
+  int i;
+
+  for(i = 0; i < number; i++) {
+    data[i] = n->data[i];
+    pointer[i] = n->pointer[i];
+  }
+  pointer[number] = n->pointer[number];
+}
+
 bool BTreeNode::isLeaf() { return leaf; }
 
 int BTreeNode::getNumber() { return number; }
@@ -2737,135 +3077,579 @@ bool BTreeNode::addDataToNode(BTreeNode *l, Variable *d, BTreeNode *r, BTreeNode
   return true;
 }
 
-BTree::BTree() : tree((BTreeNode *) 0), depth(0), nodes(0), entries(0), mutex((pthread_rwlock_t *) 0) { }
+// The namespace index
+
+NamespaceNode::NamespaceNode(const char *n, int len, NamespaceNode *p) : parent(p), children((NamespaceNode *) 0), sibling((NamespaceNode *) 0), hashNext((NamespaceNode *) 0), members((Variable *) 0), snapshots(0) {
+  if((name = (char *) malloc(len + 1)) == (char *) 0) slexception.chuck("namespace error: malloc failed", (LexInfo *) 0);
+  strncpy(name, n, len);
+  name[len] = 0;
+}
+
+NamespaceIndex::NamespaceIndex() : root("", 0, (NamespaceNode *) 0), table((NamespaceNode **) 0), size(0), count(0), trail((SnapshotChangeItem *) 0), trailSize(0), trailUsed(0), snapshots((SnapshotItem *) 0), snapshotSize(0), snapshotUsed(0), lastSnapshot(0) { }
+
+NamespaceNode *NamespaceIndex::getRoot() {
+  return &root;
+}
+
+unsigned long NamespaceIndex::hash(NamespaceNode *parent, const char *n, int len) {
+  unsigned long h;
+  int i;
+
+  h = 14695981039346656037UL ^ ((unsigned long) parent >> 4);
+  for(i = 0; i < len; i++) {
+    h ^= (unsigned char) n[i];
+    h *= 1099511628211UL;
+  }
+
+  return h;
+}
+
+// Find the namespace called n (len characters) within parent, optionally creating it.
+NamespaceNode *NamespaceIndex::child(NamespaceNode *parent, const char *n, int len, bool create) {
+  NamespaceNode **newTable;
+  NamespaceNode *node;
+  NamespaceNode *next;
+  unsigned long newSize;
+  unsigned long h;
+  unsigned long i;
+
+  if(table != (NamespaceNode **) 0) {
+    for(node = table[hash(parent, n, len) & (size - 1)]; node != (NamespaceNode *) 0; node = node->hashNext) {
+      if((node->parent == parent) && (strncmp(node->name, n, len) == 0) && (node->name[len] == 0)) return node;
+    }
+  }
+  if(! create) return (NamespaceNode *) 0;
+
+  if(count >= size) {
+    newSize = (size == 0 ? 64 : size * 2);
+    if((newTable = (NamespaceNode **) calloc(newSize, sizeof(NamespaceNode *))) == (NamespaceNode **) 0) slexception.chuck("namespace error: malloc failed", (LexInfo *) 0);
+    for(i = 0; i < size; i++) {
+      for(node = table[i]; node != (NamespaceNode *) 0; node = next) {
+        next = node->hashNext;
+        h = hash(node->parent, node->name, strlen(node->name)) & (newSize - 1);
+        node->hashNext = newTable[h];
+        newTable[h] = node;
+      }
+    }
+    if(table != (NamespaceNode **) 0) free(table);
+    table = newTable;
+    size = newSize;
+  }
+
+  node = new NamespaceNode(n, len, parent);
+  h = hash(parent, n, len) & (size - 1);
+  node->hashNext = table[h];
+  table[h] = node;
+  node->sibling = parent->children;
+  parent->children = node;
+  count++;
+
+  return node;
+}
+
+// Add a namespace variable to the index. The last part of its name is the
+// outermost namespace, and the first part is its name within the innermost one.
+void NamespaceIndex::addVariable(Variable *v) {
+  NamespaceNode *node;
+  const char *name;
+  const char *p;
+  const char *q;
+
+  name = v->getName();
+  node = &root;
+  p = name + strlen(name);
+  for(;;) {
+    for(q = p; (q > name) && (q[-1] != '/'); q--) ;
+    if(q <= name + 1) break;
+    node = child(node, q, p - q, true);
+    p = q - 1;
+  }
+
+  v->setNamespace(node);
+  v->setNamespaceNext(node->members);
+  node->members = v;
+}
+
+// Find the namespace given as a path, like i/b/a, the node a -> b -> i.
+NamespaceNode *NamespaceIndex::findNamespace(const char *ns) {
+  return findNamespace(ns, false);
+}
+
+NamespaceNode *NamespaceIndex::findNamespace(const char *ns, bool create) {
+  NamespaceNode *node;
+  const char *p;
+  const char *q;
+
+  if(*ns == '/') ns++;
+  node = &root;
+  p = ns + strlen(ns);
+  while((node != (NamespaceNode *) 0) && (p > ns)) {
+    for(q = p; (q > ns) && (q[-1] != '/'); q--) ;
+    node = child(node, q, p - q, create);
+    p = (q > ns ? q - 1 : q);
+  }
+
+  return node;
+}
+
+// Start a snapshot of a namespace and everything below it, returning its id.
+unsigned long NamespaceIndex::snapshot(NamespaceNode *node) {
+  SnapshotItem *ns;
+
+  if(snapshotUsed == snapshotSize) {
+    snapshotSize = (snapshotSize == 0 ? 16 : snapshotSize * 2);
+    if((ns = (SnapshotItem *) realloc(snapshots, snapshotSize * sizeof(SnapshotItem))) == (SnapshotItem *) 0) slexception.chuck("namespace error: malloc failed", (LexInfo *) 0);
+    snapshots = ns;
+  }
+
+  ns = &snapshots[snapshotUsed];
+  ns->node = node;
+  ns->id = ++lastSnapshot;
+  ns->mark = trailUsed;
+  node->snapshots++;
+  __atomic_store_n(&snapshotUsed, snapshotUsed + 1, __ATOMIC_RELEASE);
+
+  return ns->id;
+}
+
+int NamespaceIndex::findSnapshot(unsigned long id) {
+  int i;
+
+  for(i = snapshotUsed - 1; i >= 0; i--) if(snapshots[i].id == id) return i;
+
+  return -1;
+}
+
+// Put back every object on the trail above mark.
+void NamespaceIndex::undo(int mark) {
+  SnapshotChangeItem *c;
+
+  while(trailUsed > mark) {
+    c = &trail[--trailUsed];
+    c->variable->restoreObject(c->object);
+    c->variable->setStamp(c->stamp);
+  }
+}
+
+// Return the snapshot's namespaces to the state they were in when it was taken.
+// The snapshot stays, so it can be restored again, but any later ones are dropped.
+bool NamespaceIndex::restore(unsigned long id) {
+  int i;
+
+  if((i = findSnapshot(id)) < 0) return false;
+
+  undo(snapshots[i].mark);
+  while(snapshotUsed > i + 1) snapshots[--snapshotUsed].node->snapshots--;
+
+  return true;
+}
+
+// Drop a snapshot, and any later ones, keeping the current state.
+bool NamespaceIndex::discard(unsigned long id) {
+  Object *o;
+  int i;
+
+  if((i = findSnapshot(id)) < 0) return false;
+
+  while(snapshotUsed > i) snapshots[--snapshotUsed].node->snapshots--;
+
+  // With nothing left to restore to the trail can go.
+  if(snapshotUsed == 0) {
+    while(trailUsed > 0) {
+      o = trail[--trailUsed].object;
+      if(o != (Object *) 0) o->release((LexInfo *) 0);
+    }
+  }
+
+  return true;
+}
+
+bool NamespaceIndex::isTracking() {
+  return __atomic_load_n(&snapshotUsed, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Called as v is about to change. If v is in a snapshotted namespace and hasn't
+// been logged since the latest snapshot, its object moves to the trail.
+bool NamespaceIndex::recordChange(Variable *v) {
+  SnapshotChangeItem *c;
+  NamespaceNode *node;
+  unsigned long current;
+
+  if(snapshotUsed == 0) return false;
+  current = snapshots[snapshotUsed - 1].id;
+  if(v->getStamp() == current) return false;
+
+  for(node = v->getNamespace(); node != (NamespaceNode *) 0; node = node->parent) {
+    if(node->snapshots != 0) break;
+  }
+  if(node == (NamespaceNode *) 0) return false;
+
+  if(trailUsed == trailSize) {
+    trailSize = (trailSize == 0 ? 256 : trailSize * 2);
+    if((c = (SnapshotChangeItem *) realloc(trail, trailSize * sizeof(SnapshotChangeItem))) == (SnapshotChangeItem *) 0) slexception.chuck("namespace error: malloc failed", (LexInfo *) 0);
+    trail = c;
+  }
+
+  c = &trail[trailUsed++];
+  c->variable = v;
+  c->object = v->getObject();
+  c->stamp = v->getStamp();
+  v->setStamp(current);
+
+  return true;
+}
+
+VariableResolver::VariableResolver() : next((VariableResolver *) 0) { }
+
+VariableResolver::~VariableResolver() { }
+
+NamespaceVisitor::~NamespaceVisitor() { }
+
+BTreeReader::BTreeReader() : epoch(0), inUse(true), next((BTreeReader *) 0) { }
+
+BTreeRetired::BTreeRetired(BTreeNode *n, unsigned long e, BTreeRetired *nx) : node(n), epoch(e), next(nx) { }
+
+// Called as a thread exits, handing its reader record back for another thread to use.
+static void releaseBTreeReader(void *r) {
+  __atomic_store_n(&((BTreeReader *) r)->inUse, false, __ATOMIC_RELEASE);
+}
+
+BTree::BTree() : tree((BTreeNode *) 0), depth(0), nodes(0), entries(0), mutex((pthread_mutex_t *) 0), epoch(1), readers((BTreeReader *) 0), retired((BTreeRetired *) 0), resolvers((VariableResolver *) 0) { }
 
 bool BTree::addVariable(Variable *d) {
-  BTreeNode *left;
-  BTreeNode *right;
-  Variable *data;
+  BTreeNode *old;
+  BTreeNode *root;
+  BTreeNode *p;
+  BTreeNode *copy;
+  BTreeNode *path[BTREE_MAX_DEPTH];
+  BTreeNode *copies[BTREE_MAX_DEPTH];
+  unsigned long e;
+  int count;
+  int c;
+  int n;
+  int i;
 
-  if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_wrlock(mutex);
+  if(mutex == (pthread_mutex_t *) 0) {
+    if(tree == (BTreeNode *) 0) {
+      tree = new BTreeNode(true, (BTreeNode *) 0, d, (BTreeNode *) 0);
+      depth = 1;
+      nodes = 1;
+      entries = 1;
+    } else {
+      if((root = insert(tree, d)) == (BTreeNode *) 0) return false;
+      tree = root;
+    }
+    index.addVariable(d);
+    return true;
+  }
 
-  if(tree == (BTreeNode *) 0) {
-    tree = new BTreeNode(true, (BTreeNode *) 0, d, (BTreeNode *) 0);
+  pthread_mutex_lock(mutex);
+
+  old = tree;
+  if(old == (BTreeNode *) 0) {
     depth = 1;
     nodes = 1;
     entries = 1;
-  } else {
-    left = (BTreeNode *) 0;
-    if(! tree->addData(d, &left, &data, &right, &nodes)) {
-      if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_unlock(mutex);
-      return false;
-    }
-    if(left != (BTreeNode *) 0) {
-      delete(tree);
-      tree = new BTreeNode(false, left, data, right);
-      depth++;
-      nodes++;
+    __atomic_store_n(&tree, new BTreeNode(true, (BTreeNode *) 0, d, (BTreeNode *) 0), __ATOMIC_SEQ_CST);
+    index.addVariable(d);
+    pthread_mutex_unlock(mutex);
+    return true;
+  }
+
+  // Readers may be walking the current tree, so copy the path from the root down to
+  // the leaf this entry belongs in and insert into the copy.
+  count = 0;
+  p = old;
+  copy = new BTreeNode(p);
+  path[count] = p;
+  copies[count++] = copy;
+  for(;;) {
+    for(n = 0; n < p->getNumber(); n++) {
+      c = strcmp(d->getName(), p->getData(n)->getName());
+      if(c == 0) {
+        for(i = 0; i < count; i++) delete(copies[i]);
+        pthread_mutex_unlock(mutex);
+        return false;
+      }
+      if(c < 0) break;
     }
-    entries++;
+    if(p->isLeaf()) break;
+    if(count == BTREE_MAX_DEPTH) slexception.chuck("btree too deep", (LexInfo *) 0);
+    p = p->getPointer(n);
+    copies[count] = new BTreeNode(p);
+    copy->setPointer(n, copies[count]);
+    copy = copies[count];
+    path[count++] = p;
   }
 
-  if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_unlock(mutex);
+  root = insert(copies[0], d);
+
+  // Publish the new root, then retire the nodes it replaced.
+  __atomic_store_n(&tree, root, __ATOMIC_SEQ_CST);
+  e = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+  for(i = 0; i < count; i++) retired = new BTreeRetired(path[i], e, retired);
+  reclaim();
+  index.addVariable(d);
+
+  pthread_mutex_unlock(mutex);
 
   return true;
 }
 
+// Inserts into the tree rooted at root, returning the (possibly new) root, or
+// null if the name already exists.
+BTreeNode *BTree::insert(BTreeNode *root, Variable *d) {
+  BTreeNode *left;
+  BTreeNode *right;
+  Variable *data;
+
+  left = (BTreeNode *) 0;
+  if(! root->addData(d, &left, &data, &right, &nodes)) return (BTreeNode *) 0;
+  if(left != (BTreeNode *) 0) {
+    delete(root);
+    root = new BTreeNode(false, left, data, right);
+    depth++;
+    nodes++;
+  }
+  entries++;
+
+  return root;
+}
+
 Variable *BTree::findVariable(const char *v) {
   BTreeNode *p;
   Variable *d;
+  Variable *ret;
   int c;
   int n;
   int i;
 
-  if(tree == (BTreeNode *) 0) return (Variable *) 0;
-
-  if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_rdlock(mutex);
-
-  p = tree;
+  ret = (Variable *) 0;
+  p = enterRead();
   while(p != (BTreeNode *) 0) {
     n = p->getNumber();
     for(i = 0; i < n; i++) {
       d = p->getData(i);
       c = strcmp(v, d->getName());
       if(c == 0) {
-        if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_unlock(mutex);
-        return d;
+        ret = d;
+        p = (BTreeNode *) 0;
+        break;
       }
       if(c < 0) {
-        if(p->isLeaf()) {
-          if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_unlock(mutex);
-          return (Variable *) 0;
-        }
-        p = p->getPointer(i);
+        p = (p->isLeaf() ? (BTreeNode *) 0 : p->getPointer(i));
         break;
       }
     }
-    if(i >= n) {
-      if(p->isLeaf()) {
-        if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_unlock(mutex);
-        return (Variable *) 0;
-      }
-      p = p->getPointer(n);
-    }
+    if(i >= n) p = (p->isLeaf() ? (BTreeNode *) 0 : p->getPointer(n));
   }
+  exitRead();
+
+  if((ret == (Variable *) 0) && (__atomic_load_n(&resolvers, __ATOMIC_ACQUIRE) != (VariableResolver *) 0)) ret = resolve(v);
+
+  return ret;
+}
+
+// Ask each resolver for a variable that isn't in the tree.
+Variable *BTree::resolve(const char *v) {
+  VariableResolver *r;
+  Variable *d;
+
+  if(*v != '/') return (Variable *) 0;
 
-  if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_unlock(mutex);
+  for(r = __atomic_load_n(&resolvers, __ATOMIC_ACQUIRE); r != (VariableResolver *) 0; r = r->next) {
+    if((d = r->resolve(v)) != (Variable *) 0) return d;
+  }
 
   return (Variable *) 0;
 }
 
-void BTree::toStatic(const char *ns) {
-  if(tree == (BTreeNode *) 0) return;
+void BTree::addResolver(VariableResolver *r) {
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_lock(mutex);
+  r->next = resolvers;
+  __atomic_store_n(&resolvers, r, __ATOMIC_RELEASE);
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_unlock(mutex);
+}
+
+// Announce this thread as a reader and return the current root.
+BTreeNode *BTree::enterRead() {
+  BTreeReader *r;
 
-  setNodeToStatic(tree, ns);
+  if(mutex == (pthread_mutex_t *) 0) return tree;
+
+  r = getReader();
+  __atomic_store_n(&r->epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&tree, __ATOMIC_SEQ_CST);
 }
 
-void BTree::setNodeToStatic(BTreeNode *node, const char *ns) {
-  Variable *v;
-  int n;
+void BTree::exitRead() {
+  if(mutex == (pthread_mutex_t *) 0) return;
 
-  if(node == (BTreeNode *) 0) return;
+  __atomic_store_n(&((BTreeReader *) pthread_getspecific(readerKey))->epoch, 0, __ATOMIC_RELEASE);
+}
 
-  for(n = 0; n < node->getNumber(); n++) {
-    if(! node->isLeaf()) setNodeToStatic(node->getPointer(n), ns);
-    v = node->getData(n);
-    if(isNamespace(v, ns)) {
-      v->getObject()->setStatic();
-    }
+BTreeReader *BTree::getReader() {
+  BTreeReader *r;
+  bool unused;
+
+  if((r = (BTreeReader *) pthread_getspecific(readerKey)) != (BTreeReader *) 0) return r;
+
+  // Reuse the record of a thread that has finished, otherwise add a new one.
+  for(r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != (BTreeReader *) 0; r = r->next) {
+    unused = false;
+    if(__atomic_compare_exchange_n(&r->inUse, &unused, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+  }
+  if(r == (BTreeReader *) 0) {
+    r = new BTreeReader;
+    r->next = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+    while(! __atomic_compare_exchange_n(&readers, &r->next, r, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) ;
   }
-  if(! node->isLeaf()) setNodeToStatic(node->getPointer(n), ns);
+  pthread_setspecific(readerKey, r);
+
+  return r;
 }
 
-bool BTree::isNamespace(Variable *v, const char *ns) {
-  const char *nsp;
-  const char *vp;
+// Delete the retired nodes no reader can still see. Called with the mutex held.
+void BTree::reclaim() {
+  BTreeReader *r;
+  BTreeRetired **rp;
+  BTreeRetired *t;
+  unsigned long oldest;
+  unsigned long e;
 
-  nsp = (ns[0] == '/' ? &ns[1] : &ns[0]);
-  vp = v->getName();
-  while(*vp == '/') {
-    vp++;
-    if(strcmp(vp, nsp) == 0) return true;
-    while((*vp != 0) && (*vp != '/')) vp++;
+  oldest = 0;
+  for(r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != (BTreeReader *) 0; r = r->next) {
+    e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    if((e != 0) && ((oldest == 0) || (e < oldest))) oldest = e;
   }
 
-  return false;
+  rp = &retired;
+  while(*rp != (BTreeRetired *) 0) {
+    t = *rp;
+    if((oldest == 0) || (t->epoch <= oldest)) {
+      *rp = t->next;
+      delete(t->node);
+      delete(t);
+    } else {
+      rp = &t->next;
+    }
+  }
+}
+
+// Set the variable named ns, and every variable within the ns namespace, to static.
+void BTree::toStatic(const char *ns) {
+  Variable *v;
+  char name[MAX_NAME_LENGTH + 1];
+
+  if(*ns == '/') ns++;
+  if(strlen(ns) >= MAX_NAME_LENGTH) return;
+  sprintf(name, "/%s", ns);
+
+  v = findVariable(name);
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_lock(mutex);
+
+  if((v != (Variable *) 0) && v->isInitialised()) v->getObject()->setStatic();
+  setNamespaceToStatic(index.findNamespace(ns));
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_unlock(mutex);
+}
+
+// Snapshot the ns namespace. Returns 0 if the name is too long.
+unsigned long BTree::snapshot(const char *ns) {
+  unsigned long id;
+
+  if(strlen(ns) >= MAX_NAME_LENGTH) return 0;
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_lock(mutex);
+  id = index.snapshot(index.findNamespace(ns, true));
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_unlock(mutex);
+
+  return id;
+}
+
+bool BTree::restore(unsigned long id) {
+  bool ret;
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_lock(mutex);
+  ret = index.restore(id);
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_unlock(mutex);
+
+  return ret;
+}
+
+bool BTree::discard(unsigned long id) {
+  bool ret;
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_lock(mutex);
+  ret = index.discard(id);
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_unlock(mutex);
+
+  return ret;
+}
+
+bool BTree::isTracking() {
+  return index.isTracking();
+}
+
+bool BTree::recordChange(Variable *v) {
+  bool ret;
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_lock(mutex);
+  ret = index.recordChange(v);
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_unlock(mutex);
+
+  return ret;
+}
+
+// Call the visitor for the variable named ns and every variable within the ns namespace.
+void BTree::visitNamespace(const char *ns, NamespaceVisitor *nv) {
+  Variable *v;
+  char name[MAX_NAME_LENGTH + 1];
+
+  if(*ns == '/') ns++;
+  if(strlen(ns) >= MAX_NAME_LENGTH) return;
+  sprintf(name, "/%s", ns);
+
+  // Look this up before locking, a resolver may need to add it.
+  v = findVariable(name);
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_lock(mutex);
+
+  if(v != (Variable *) 0) nv->visit(v);
+  visitNamespaceNode(index.findNamespace(ns), nv);
+
+  if(mutex != (pthread_mutex_t *) 0) pthread_mutex_unlock(mutex);
+}
+
+void BTree::visitNamespaceNode(NamespaceNode *node, NamespaceVisitor *nv) {
+  NamespaceNode *c;
+  Variable *v;
+
+  if(node == (NamespaceNode *) 0) return;
+
+  for(v = node->members; v != (Variable *) 0; v = v->getNamespaceNext()) nv->visit(v);
+  for(c = node->children; c != (NamespaceNode *) 0; c = c->sibling) visitNamespaceNode(c, nv);
+}
+
+void BTree::setNamespaceToStatic(NamespaceNode *node) {
+  NamespaceNode *c;
+  Variable *v;
+
+  if(node == (NamespaceNode *) 0) return;
+
+  for(v = node->members; v != (Variable *) 0; v = v->getNamespaceNext()) {
+    if(v->isInitialised()) v->getObject()->setStatic();
+  }
+  for(c = node->children; c != (NamespaceNode *) 0; c = c->sibling) setNamespaceToStatic(c);
 }
 
 void BTree::setThreadSafe() {
-  pthread_rwlockattr_t attr;
+  if(mutex != (pthread_mutex_t *) 0) return;
 
-  mutex = new pthread_rwlock_t;
-  pthread_rwlockattr_init(&attr);
-  pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_PRIVATE);
-#ifdef PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
-  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
-#else /* PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP */
-#if defined __USE_POSIX199506 || defined __USE_UNIX98
-  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
-#endif /* defined __USE_POSIX199506 || defined __USE_UNIX98 */
-#endif /* PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP */
-  pthread_rwlock_init(mutex, &attr);
+  pthread_key_create(&readerKey, releaseBTreeReader);
+  mutex = new pthread_mutex_t;
+  pthread_mutex_init(mutex, NULL);
 }
 
 void BTree::debug() {
@@ -2873,9 +3657,11 @@ void BTree::debug() {
 }
 
 void BTree::print() {
-  if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_rdlock(mutex);
-  printTree(tree);
-  if(mutex != (pthread_rwlock_t *) 0) pthread_rwlock_unlock(mutex);
+  BTreeNode *root;
+
+  root = enterRead();
+  if(root != (BTreeNode *) 0) printTree(root);
+  exitRead();
 }
 
 void BTree::printTree(BTreeNode *t) {
@@ -2894,6 +3680,7 @@ void BTree::printDetail(BTreeNode *t, int i) {
   Number *n;
   String *s;
   Pointer *p;
+  Handle *h;
   Code *c;
   bool found;
   char fmt[32];
@@ -2945,6 +3732,15 @@ void BTree::printDetail(BTreeNode *t, int i) {
     } catch(Exception *e) { }
   }
 
+  if(! found) {
+    try {
+      h = o->getHandle((LexInfo *) 0, (ExecutionEnvironment *) 0);
+      printf("...%s...", h->getType());
+      h->release((LexInfo *) 0);
+      found = true;
+    } catch(Exception *e) { }
+  }
+
   if(! found) printf("...unknown");
 
   if(! o->isDynamic()) printf(" (static)");
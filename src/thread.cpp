@@ -24,16 +24,434 @@ SOFTWARE.
 
 */
 
+// ucontext is deprecated on macOS, and only declared for XOPEN programs.
+#ifdef __APPLE__
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#endif
+
 #include "shalelib.h"
+#include <limits.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#if defined(__x86_64__) && defined(__linux__)
+#define GREEN_SWITCH
+#else
+#include <ucontext.h>
+#endif
 
 #define MAJOR   (INT) 1
 #define MINOR   (INT) 0
-#define MICRO   (INT) 7
+#define MICRO   (INT) 17
+
+// Threads created by create thread::() are tasks run by a pool of worker
+// threads. There's a worker per processor to begin with, each with its own
+// deque of tasks. Workers run the tasks they create themselves newest first,
+// take tasks created outside the pool from a shared queue, and steal the
+// oldest task from other workers when they run out. A monitor adds a spare
+// worker when queued tasks stop making progress, so tasks that block or never
+// finish can't starve the rest, and spare workers retire after being idle for
+// a while.
+//
+// Workers can be pinned, one to each processor the process may run on. A
+// pinned worker creates its execution environment after moving to its
+// processor, so its cache comes from memory on the same NUMA node. Pinning is
+// only done on Linux, and everywhere else workers go where the scheduler puts
+// them.
+
+// How often the monitor looks for starvation, and how long a spare worker sits
+// idle before retiring, in milliseconds.
+#define POOL_MONITOR_MS    10
+#define POOL_RETIRE_MS     1000
+#define POOL_MAX_SPARES    8
+#define POOL_MAX_WORKERS   4096
+#define POOL_STACK_SIZE    (1024 * 1024)
+#define POOL_MAX_CPUS      1024
+
+// A value left on a spawned thread's stack. Numbers and strings are copied so
+// they can be recreated in the joining thread's cache.
+class TaskValue {
+  public:
+    char type;
+    INT valueInt;
+    double valueDouble;
+    char *str;
+    Object *object;
+};
+
+#define TASK_INT      'i'
+#define TASK_DOUBLE   'd'
+#define TASK_STRING   's'
+#define TASK_OBJECT   'o'
+
+const char *taskType = "task";
+
+// The handle spawn thread::() returns. It's completed by the worker that runs
+// the thread, and joined by anyone holding it.
+class Task : public Handle {
+  public:
+    Task(Cache *);
+    ~Task();
+    void finish(ExecutionEnvironment *, bool);
+    void wait();
+    void pushValues(ExecutionEnvironment *, LexInfo *);
+
+  private:
+    int done;
+    int waiters;
+    bool failed;
+    TaskValue *values;
+    int count;
+};
+
+// parallel and reduce split a range of integers into chunks, run by the
+// calling thread and by helper tasks on the pool. The chunks depend only on the
+// range, and reduce combines the chunk results in order, so the result doesn't
+// depend on the number of processors or how the chunks were scheduled.
+#define RANGE_CHUNKS  256
+
+class RangeJob {
+  public:
+    RangeJob(INT, INT, Code *, Code *);
+    void work(ExecutionEnvironment *);
+    void wait();
+    void combine(ExecutionEnvironment *, LexInfo *);
+    bool hasFailed();
+    int getChunks();
+    void hold();
+    void release();
+
+  private:
+    ~RangeJob();
+    void runChunk(ExecutionEnvironment *, int);
+    INT chunkStart(int);
+
+    INT from;
+    INT to;
+    Code *code;
+    Code *combiner;
+    int chunks;
+    int next;
+    int finished;
+    int waiters;
+    int references;
+    bool failed;
+    TaskValue *results;
+};
+
+// Green threads, started by go thread::(), are coroutines. Each has a small
+// stack of its own and belongs to one of a few carrier threads, which switch
+// between their green threads when one yields, sleeps or waits on a channel.
+// A switch saves a few registers and changes stacks, with no trip through the
+// kernel. Green threads never move to another carrier, so a carrier owns the
+// caches of all its green threads. Stacks are mapped but only take memory as
+// they're used, and a finished green thread's stack and execution environment
+// are kept for the next one started on its carrier.
+#define GREEN_STACK_SIZE     (1024 * 1024)
+#define GREEN_MAX_CARRIERS   8
+
+#define GREEN_RUNNABLE   0
+#define GREEN_RUNNING    1
+#define GREEN_YIELDING   2
+#define GREEN_SLEEPING   3
+#define GREEN_PARKED     4
+#define GREEN_DONE       5
+
+class GreenContext {
+  public:
+#ifdef GREEN_SWITCH
+    void *sp;
+#else
+    ucontext_t uc;
+#endif
+};
+
+class GreenCarrier;
+
+class GreenThread {
+  public:
+    GreenContext context;
+    char *stack;
+    ExecutionEnvironment *ee;
+    Code *code;
+    Object *arg;
+    GreenCarrier *carrier;
+    int state;
+    bool woken;
+    bool waiting;
+    int *waitAddress;
+    struct timespec wakeAt;
+    GreenThread *next;
+    GreenThread *waitNext;
+};
+
+// Green threads waiting on something, first come first served.
+class GreenWaiters {
+  public:
+    GreenWaiters();
+    void add(GreenThread *);
+    GreenThread *remove();
+    GreenThread *remove(int *);
+    void remove(GreenThread *);
+
+  private:
+    GreenThread *head;
+    GreenThread *tail;
+};
+
+class GreenCarrier {
+  public:
+    GreenCarrier();
+    void start(Code *, Object *, LexInfo *);
+    void run();
+    void yield();
+    void sleep(INT, LexInfo *);
+    void park();
+    void wake(GreenThread *);
+    void finish();
+
+  private:
+    void enqueue(GreenThread *);
+    void addSleeper(GreenThread *);
+    GreenThread *removeSleeper();
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    GreenContext context;
+    GreenThread *runHead;
+    GreenThread *runTail;
+    GreenThread *spare;
+    GreenThread **sleepers;
+    int sleeperCount;
+    int sleeperSize;
+    bool started;
+};
+
+#define GO_START   0
+#define GO_YIELD   1
+#define GO_SLEEP   2
+
+// A bounded multi-producer multi-consumer queue of values. Each slot has a
+// sequence number saying whether it's ready to be written or read for the
+// current lap of the ring, so senders and receivers only contend on atomic
+// positions. Blocking sends and receives fall back to a mutex and condition
+// variables, which are only touched when someone is waiting.
+const char *channelType = "channel";
+
+class ChannelSlot {
+  public:
+    unsigned long sequence;
+    TaskValue value;
+};
 
-class ThreadPack {
+class Channel : public Handle {
+  public:
+    Channel(INT, Cache *);
+    ~Channel();
+    bool trySend(TaskValue *);
+    bool tryRecv(TaskValue *);
+    void send(TaskValue *, LexInfo *);
+    bool recv(TaskValue *);
+    void close();
+    bool isClosed();
+
+  private:
+    bool enqueue(TaskValue *);
+    bool dequeue(TaskValue *);
+    void wake(pthread_cond_t *, int *, GreenWaiters *);
+    void waitGreen(GreenWaiters *, GreenThread *);
+
+    ChannelSlot *slots;
+    unsigned long mask;
+    unsigned long sendPosition;
+    unsigned long recvPosition;
+    bool closed;
+    int sendersWaiting;
+    int receiversWaiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t notFull;
+    pthread_cond_t notEmpty;
+    GreenWaiters greenSenders;
+    GreenWaiters greenReceivers;
+};
+
+#define CHANNEL_CREATE    0
+#define CHANNEL_SEND      1
+#define CHANNEL_TRYSEND   2
+#define CHANNEL_RECV      3
+#define CHANNEL_TRYRECV   4
+#define CHANNEL_CLOSE     5
+
+// A 64-bit integer that threads update with atomic instructions rather than a
+// mutex. It's a handle, so every thread holding it sees the same integer.
+const char *atomicType = "atomic";
+
+class Atomic : public Handle {
+  public:
+    Atomic(INT, Cache *);
+    INT load();
+    void add(INT);
+    INT exchange(INT);
+    bool compareExchange(INT, INT);
+
+  private:
+    INT value;
+};
+
+#define ATOMIC_CREATE     0
+#define ATOMIC_ADD        1
+#define ATOMIC_SUB        2
+#define ATOMIC_CAS        3
+#define ATOMIC_EXCHANGE   4
+#define ATOMIC_LOAD       5
+
+// Mutexes, semaphores, condition variables and barriers are handles, so they
+// can be kept in any variable or passed on the stack, and named ones are
+// handles kept in the btree. They keep their state in integers and sleep on a
+// futex, so a system call is only made when a thread really has to wait or be
+// woken. Where there are no futexes a sleeping thread parks on one of a table
+// of condition variables, and a green thread parks on its carrier either way.
+const char *mutexType = "mutex";
+const char *semaphoreType = "semaphore";
+const char *conditionType = "condition";
+const char *barrierType = "barrier";
+
+class Mutex : public Handle {
+  public:
+    Mutex(Cache *);
+    void lock();
+    void unlock();
+
+  private:
+    int state;
+};
+
+class Semaphore : public Handle {
+  public:
+    Semaphore(int, Cache *);
+    void wait();
+    void post();
+
+  private:
+    int count;
+    int waiters;
+};
+
+class Condition : public Handle {
+  public:
+    Condition(Cache *);
+    void wait(Mutex *);
+    void signal(bool);
+
+  private:
+    int sequence;
+    int waiters;
+};
+
+class Barrier : public Handle {
+  public:
+    Barrier(int, Cache *);
+    void wait();
+
+  private:
+    int parties;
+    int arrived;
+    int generation;
+};
+
+#define CONDITION_CREATE      0
+#define CONDITION_SIGNAL      1
+#define CONDITION_BROADCAST   2
+
+class ThreadTask {
   public:
-    ExecutionEnvironment ee;
     Code *code;
+    Object *arg;
+    Task *task;
+    RangeJob *job;
+    int cpu;
+    ThreadTask *next;
+};
+
+// Only the owning worker pushes and pops at the bottom, thieves take from the
+// top.
+class TaskDeque {
+  public:
+    TaskDeque();
+    void pushBottom(ThreadTask *);
+    ThreadTask *popBottom();
+    ThreadTask *popTop();
+
+  private:
+    pthread_mutex_t mutex;
+    ThreadTask **tasks;
+    unsigned long size;
+    unsigned long top;
+    unsigned long bottom;
+};
+
+// Execution environments outlive the workers that use them, since objects
+// created in a worker keep a pointer to its cache. A retiring worker leaves
+// its environment for the next worker to start.
+class Worker {
+  public:
+    Worker();
+    TaskDeque deque;
+    ExecutionEnvironment *ee;
+    pthread_t thread;
+    int cpu;
+    int node;
+    bool active;
+    bool spare;
+};
+
+class ThreadPool {
+  public:
+    ThreadPool();
+    void submit(ThreadTask *, LexInfo *);
+    void runWorker(Worker *);
+    void monitor();
+    int getBaseWorkers();
+    void blocking();
+    void unblocking();
+    void setPinning(bool);
+    void setStackSize(size_t);
+    bool cpuAvailable(int);
+
+  private:
+    ThreadTask *nextTask(Worker *);
+    void runTask(Worker *, ThreadTask *);
+    bool startWorker(bool);
+    void localEE(Worker *);
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    ThreadTask *injectHead;
+    ThreadTask *injectTail;
+    Worker workers[POOL_MAX_WORKERS];
+    ExecutionEnvironment *spareEEs[POOL_MAX_WORKERS];
+    int spareEENodes[POOL_MAX_WORKERS];
+    int spareEECount;
+    int cpuList[POOL_MAX_CPUS];
+    int cpuNodes[POOL_MAX_CPUS];
+    int cpuCount;
+    bool nodesKnown;
+    bool pinWorkers;
+    size_t stackSize;
+    int workerCount;
+    int highWater;
+    int baseWorkers;
+    int idle;
+    int blocked;
+    unsigned long pending;
+    unsigned long completed;
+    bool monitorStarted;
 };
 
 class ThreadHelp : public Operation {
@@ -48,10 +466,61 @@ class ThreadCreate : public Operation {
     OperatorReturn action(ExecutionEnvironment *);
 };
 
+class ThreadSpawn : public Operation {
+  public:
+    ThreadSpawn(bool, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    bool pinned;
+};
+
+class ThreadJoin : public Operation {
+  public:
+    ThreadJoin(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class ThreadWaitAll : public Operation {
+  public:
+    ThreadWaitAll(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class ThreadParallel : public Operation {
+  public:
+    ThreadParallel(bool, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    bool reduce;
+};
+
+class ThreadChannel : public Operation {
+  public:
+    ThreadChannel(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+class ThreadAtomic : public Operation {
+  public:
+    ThreadAtomic(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
 class ThreadMutex : public Operation {
   public:
-    ThreadMutex(LexInfo *);
+    ThreadMutex(bool, LexInfo *);
     OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    bool unnamed;
 };
 
 class ThreadLock : public Operation {
@@ -68,8 +537,11 @@ class ThreadUnlock : public Operation {
 
 class ThreadSemaphore : public Operation {
   public:
-    ThreadSemaphore(LexInfo *);
+    ThreadSemaphore(bool, LexInfo *);
     OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    bool unnamed;
 };
 
 class ThreadWait : public Operation {
@@ -84,19 +556,104 @@ class ThreadPost : public Operation {
     OperatorReturn action(ExecutionEnvironment *);
 };
 
+class ThreadCondition : public Operation {
+  public:
+    ThreadCondition(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+class ThreadBarrier : public Operation {
+  public:
+    ThreadBarrier(LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+};
+
+class ThreadGo : public Operation {
+  public:
+    ThreadGo(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int function;
+};
+
+#define SETTING_PIN         0
+#define SETTING_STACKSIZE   1
+
+class ThreadSetting : public Operation {
+  public:
+    ThreadSetting(int, LexInfo *);
+    OperatorReturn action(ExecutionEnvironment *);
+
+  private:
+    int setting;
+};
+
 const char *threadHelp[] = {
   "Thread library",
-  "  {arg} {code} create thread::()  - create a new thread running the given code",
-  "  {m} mutex thread::()            - create and initialise a mutex",
-  "  {m} lock thread::()             - lock a mutex",
-  "  {m} unlock thread::()           - unlock a mutex",
-  "  {s} semaphore thread::()        - create and initialise a semaphore",
-  "  {s} wait thread::()             - wait on a semaphore",
-  "  {s} post thread::()             - post to a semaphore",
-  "  major version:: thread::        - major version number",
-  "  minor version:: thread::        - minor version number",
-  "  micro version:: thread::        - micro version number",
-  "  help thread::()                 - this",
+  "  {arg} {code} create thread::()                   - run the given code in its own thread, on a pool of",
+  "                                                     workers",
+  "  {arg} {code} spawn thread::()                    - as create, and push a task handle for join",
+  "  {arg} {cpu} {code} pinned thread::()             - as spawn, with the task run on processor {cpu}",
+  "  {flag} pin thread::()                            - if {flag} is true, pin each worker started from now on to",
+  "                                                     a processor of its own, with its cache on that processor's",
+  "                                                     NUMA node. ignored where pinning isn't supported",
+  "  {bytes} stacksize thread::()                     - the stack size of workers started from now on, 1MB to",
+  "                                                     begin with",
+  "  {arg} {code} go thread::()                       - run the given code in a green thread, a coroutine with a",
+  "                                                     small stack. green threads share a few carrier threads,",
+  "                                                     and switch when one yields, sleeps or waits",
+  "  yield thread::()                                 - let other green threads run",
+  "  {ms} sleep thread::()                            - sleep for {ms} milliseconds, letting other green threads",
+  "                                                     run",
+  "  {task} join thread::()                           - wait for the task to finish and push the values left",
+  "                                                     on its stack, bottom first",
+  "  {task1} ... {n} waitall thread::()               - wait for all {n} tasks to finish",
+  "  {from} {to} {code} parallel thread::()           - run {code} for each integer from {from} up to but not",
+  "                                                     including {to}, which is pushed before each run. the",
+  "                                                     range is shared between this thread and the pool",
+  "  {from} {to} {code} {combiner} reduce thread::()  - as parallel, where {code} leaves a value and",
+  "                                                     {combiner} combines two values into one. pushes the",
+  "                                                     combined value, always combined in the same order",
+  "  {size} channel thread::()                        - create a channel holding up to {size} values, rounded",
+  "                                                     up to a power of two",
+  "  {value} {channel} send thread::()                - send a value, waiting while the channel is full",
+  "  {value} {channel} trysend thread::()             - send a value if there's room. pushes true if sent",
+  "  {channel} recv thread::()                        - wait for a value and push it and true, or false once",
+  "                                                     the channel is closed and empty",
+  "  {channel} tryrecv thread::()                     - push a value and true if one is waiting, otherwise false",
+  "  {channel} close thread::()                       - close a channel. waiting receivers get what's left",
+  "                                                     then false, and sending chucks",
+  "  {v} atomic thread::()                            - turn the number in variable {v} into an atomic integer",
+  "  {n} atomic thread::()                            - push a new atomic integer holding {n}",
+  "  {a} {n} add thread::()                           - atomically add {n} to atomic integer {a}",
+  "  {a} {n} sub thread::()                           - atomically subtract {n} from atomic integer {a}",
+  "  {a} {old} {new} cas thread::()                   - set {a} to {new} if it holds {old}. pushes true if set",
+  "  {a} {n} exchange thread::()                      - set {a} to {n} and push the value it held",
+  "  {a} load thread::()                              - push the value of atomic integer {a}",
+  "  {m} mutex thread::()                             - create and initialise a mutex named {m}",
+  "  newmutex thread::()                              - push an unnamed mutex",
+  "  {m} lock thread::()                              - lock a mutex",
+  "  {m} unlock thread::()                            - unlock a mutex",
+  "  {s} semaphore thread::()                         - create and initialise a semaphore named {s}",
+  "  {count} newsemaphore thread::()                  - push an unnamed semaphore starting at {count}",
+  "  {s} wait thread::()                              - wait on a semaphore",
+  "  {s} post thread::()                              - post to a semaphore",
+  "  condition thread::()                             - push a condition variable",
+  "  {m} {c} wait thread::()                          - unlock mutex {m}, wait until condition {c} is signalled,",
+  "                                                     then lock {m} again. wakeups can be spurious, so check",
+  "                                                     what you're waiting for in a loop",
+  "  {c} signal thread::()                            - wake a thread waiting on condition {c}",
+  "  {c} broadcast thread::()                         - wake every thread waiting on condition {c}",
+  "  {n} barrier thread::()                           - push a barrier for {n} threads",
+  "  {b} wait thread::()                              - wait until {n} threads have reached barrier {b}",
+  "  major version:: thread::                         - major version number",
+  "  minor version:: thread::                         - minor version number",
+  "  micro version:: thread::                         - micro version number",
+  "  help thread::()                                  - this",
   (const char *) 0
 };
 
@@ -134,11 +691,155 @@ extern "C" void slmain() {
   btree.addVariable(v);
 
   ol = new OperationList;
-  ol->addOperation(new ThreadMutex((LexInfo *) 0));
+  ol->addOperation(new ThreadSpawn(false, (LexInfo *) 0));
+  v = new Variable("/spawn/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadSpawn(true, (LexInfo *) 0));
+  v = new Variable("/pinned/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadSetting(SETTING_PIN, (LexInfo *) 0));
+  v = new Variable("/pin/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadSetting(SETTING_STACKSIZE, (LexInfo *) 0));
+  v = new Variable("/stacksize/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadGo(GO_START, (LexInfo *) 0));
+  v = new Variable("/go/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadGo(GO_YIELD, (LexInfo *) 0));
+  v = new Variable("/yield/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadGo(GO_SLEEP, (LexInfo *) 0));
+  v = new Variable("/sleep/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadJoin((LexInfo *) 0));
+  v = new Variable("/join/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadWaitAll((LexInfo *) 0));
+  v = new Variable("/waitall/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadParallel(false, (LexInfo *) 0));
+  v = new Variable("/parallel/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadParallel(true, (LexInfo *) 0));
+  v = new Variable("/reduce/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadChannel(CHANNEL_CREATE, (LexInfo *) 0));
+  v = new Variable("/channel/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadChannel(CHANNEL_SEND, (LexInfo *) 0));
+  v = new Variable("/send/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadChannel(CHANNEL_TRYSEND, (LexInfo *) 0));
+  v = new Variable("/trysend/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadChannel(CHANNEL_RECV, (LexInfo *) 0));
+  v = new Variable("/recv/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadChannel(CHANNEL_TRYRECV, (LexInfo *) 0));
+  v = new Variable("/tryrecv/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadChannel(CHANNEL_CLOSE, (LexInfo *) 0));
+  v = new Variable("/close/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadAtomic(ATOMIC_CREATE, (LexInfo *) 0));
+  v = new Variable("/atomic/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadAtomic(ATOMIC_ADD, (LexInfo *) 0));
+  v = new Variable("/add/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadAtomic(ATOMIC_SUB, (LexInfo *) 0));
+  v = new Variable("/sub/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadAtomic(ATOMIC_CAS, (LexInfo *) 0));
+  v = new Variable("/cas/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadAtomic(ATOMIC_EXCHANGE, (LexInfo *) 0));
+  v = new Variable("/exchange/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadAtomic(ATOMIC_LOAD, (LexInfo *) 0));
+  v = new Variable("/load/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadMutex(false, (LexInfo *) 0));
   v = new Variable("/mutex/thread");
   v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
   btree.addVariable(v);
 
+  ol = new OperationList;
+  ol->addOperation(new ThreadMutex(true, (LexInfo *) 0));
+  v = new Variable("/newmutex/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
   ol = new OperationList;
   ol->addOperation(new ThreadLock((LexInfo *) 0));
   v = new Variable("/lock/thread");
@@ -152,11 +853,17 @@ extern "C" void slmain() {
   btree.addVariable(v);
 
   ol = new OperationList;
-  ol->addOperation(new ThreadSemaphore((LexInfo *) 0));
+  ol->addOperation(new ThreadSemaphore(false, (LexInfo *) 0));
   v = new Variable("/semaphore/thread");
   v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
   btree.addVariable(v);
 
+  ol = new OperationList;
+  ol->addOperation(new ThreadSemaphore(true, (LexInfo *) 0));
+  v = new Variable("/newsemaphore/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
   ol = new OperationList;
   ol->addOperation(new ThreadWait((LexInfo *) 0));
   v = new Variable("/wait/thread");
@@ -169,6 +876,30 @@ extern "C" void slmain() {
   v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
   btree.addVariable(v);
 
+  ol = new OperationList;
+  ol->addOperation(new ThreadCondition(CONDITION_CREATE, (LexInfo *) 0));
+  v = new Variable("/condition/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadCondition(CONDITION_SIGNAL, (LexInfo *) 0));
+  v = new Variable("/signal/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadCondition(CONDITION_BROADCAST, (LexInfo *) 0));
+  v = new Variable("/broadcast/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
+  ol = new OperationList;
+  ol->addOperation(new ThreadBarrier((LexInfo *) 0));
+  v = new Variable("/barrier/thread");
+  v->setObject(new Code(ol, &mainEE.cache, IS_STATIC));
+  btree.addVariable(v);
+
   useMutex = true;
   btree.setThreadSafe();
 }
@@ -185,425 +916,2257 @@ OperatorReturn ThreadHelp::action(ExecutionEnvironment *ee) {
   return or_continue;
 }
 
-void *theThread(void *arg) {
-  ThreadPack *tp = (ThreadPack *) arg;
+// TaskDeque class
 
-  try {
-    tp->code->action(&tp->ee);
-    tp->code->release((LexInfo *) 0);
-  } catch(Exception *e) { e->printError(); }
+TaskDeque::TaskDeque() : tasks((ThreadTask **) 0), size(0), top(0), bottom(0) { pthread_mutex_init(&mutex, NULL); }
 
-  return (void *) 0;
-}
+void TaskDeque::pushBottom(ThreadTask *t) {
+  ThreadTask **nt;
+  unsigned long i;
 
-ThreadCreate::ThreadCreate(LexInfo *li) : Operation(li) { }
+  pthread_mutex_lock(&mutex);
+  if(bottom - top == size) {
+    if((nt = (ThreadTask **) malloc((size == 0 ? 16 : 2 * size) * sizeof(ThreadTask *))) == (ThreadTask **) 0) {
+      pthread_mutex_unlock(&mutex);
+      slexception.chuck("malloc error", (LexInfo *) 0);
+    }
+    for(i = top; i < bottom; i++) nt[i & (2 * size - 1)] = tasks[i & (size - 1)];
+    free(tasks);
+    tasks = nt;
+    size = (size == 0 ? 16 : 2 * size);
+  }
+  tasks[bottom & (size - 1)] = t;
+  bottom++;
+  pthread_mutex_unlock(&mutex);
+}
 
-OperatorReturn ThreadCreate::action(ExecutionEnvironment *ee) {
-  Object *o;
-  Code *code;
-  Object *arg;
-  ThreadPack *tp;
-  pthread_t thread;
-  pthread_attr_t attr;
+ThreadTask *TaskDeque::popBottom() {
+  ThreadTask *t;
 
-  o = ee->stack.pop(getLexInfo());
+  t = (ThreadTask *) 0;
+  pthread_mutex_lock(&mutex);
+  if(bottom != top) {
+    bottom--;
+    t = tasks[bottom & (size - 1)];
+  }
+  pthread_mutex_unlock(&mutex);
 
-  tp = new ThreadPack;
-  o->allocateMutex();
-  tp->code = o->getCode(getLexInfo(), ee);
-  arg = ee->stack.pop(getLexInfo());
-  arg->hold();
-  arg->allocateMutex();
-  arg->cache = &tp->ee.cache;
-  tp->ee.stack.push(arg);
+  return t;
+}
 
-  if(pthread_attr_init(&attr) != 0) slexception.chuck("Can't initialise thread attributes", getLexInfo());
-  if(pthread_attr_setstacksize(&attr, 1024*1024) != 0) slexception.chuck("Can't set thread stack size", getLexInfo());
-  if(pthread_create(&thread, &attr, theThread, tp) != 0) slexception.chuck("Can't create thread", getLexInfo());
+ThreadTask *TaskDeque::popTop() {
+  ThreadTask *t;
 
-  o->release(getLexInfo());
+  t = (ThreadTask *) 0;
+  pthread_mutex_lock(&mutex);
+  if(bottom != top) {
+    t = tasks[top & (size - 1)];
+    top++;
+  }
+  pthread_mutex_unlock(&mutex);
 
-  return or_continue;
+  return t;
 }
 
-ThreadMutex::ThreadMutex(LexInfo *li) : Operation(li) { }
+// Worker and ThreadPool classes
 
-OperatorReturn ThreadMutex::action(ExecutionEnvironment *ee) {
-  Object *o;
-  Name *n;
-  Number *no;
+Worker::Worker() : ee((ExecutionEnvironment *) 0), cpu(-1), node(0), active(false), spare(false) { }
+
+ThreadPool pool;
+__thread Worker *currentWorker = (Worker *) 0;
+__thread GreenThread *currentGreen = (GreenThread *) 0;
+
+#ifdef __linux__
+static cpu_set_t allowedCpus;
+#endif
+
+static void pinThread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void unpinThread() {
+#ifdef __linux__
+  pthread_setaffinity_np(pthread_self(), sizeof(allowedCpus), &allowedCpus);
+#endif
+}
+
+// The NUMA node a processor is on. Without a node in sysfs it's on node 0,
+// like every processor of a machine with one node.
+static int cpuNode(int cpu) {
+  char path[64];
+  DIR *dir;
+  struct dirent *de;
+  int node;
+
+  node = 0;
+  sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+  if((dir = opendir(path)) == (DIR *) 0) return node;
+  while((de = readdir(dir)) != (struct dirent *) 0) {
+    if((strncmp(de->d_name, "node", 4) == 0) && isdigit(de->d_name[4])) {
+      node = atoi(de->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+
+  return node;
+}
+
+static void *workerThread(void *arg) {
+  pool.runWorker((Worker *) arg);
+  return (void *) 0;
+}
+
+static void *monitorThread(void *arg) {
+  pool.monitor();
+  return (void *) 0;
+}
+
+ThreadPool::ThreadPool() : injectHead((ThreadTask *) 0), injectTail((ThreadTask *) 0), spareEECount(0), cpuCount(0), nodesKnown(false), pinWorkers(false), stackSize(POOL_STACK_SIZE), workerCount(0), highWater(0), idle(0), blocked(0), pending(0), completed(0), monitorStarted(false) {
+  long cpus;
+#ifdef __linux__
+  int i;
+#endif
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&wakeup, NULL);
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  baseWorkers = (cpus < 1 ? 1 : (cpus > POOL_MAX_WORKERS ? POOL_MAX_WORKERS : (int) cpus));
+
+#ifdef __linux__
+  CPU_ZERO(&allowedCpus);
+  if(sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) == 0) {
+    for(i = 0; (i < CPU_SETSIZE) && (cpuCount < POOL_MAX_CPUS); i++) {
+      if(CPU_ISSET(i, &allowedCpus)) cpuList[cpuCount++] = i;
+    }
+  }
+#endif
+}
+
+// Tasks created by a worker go on its own deque, others on the shared queue.
+// Workers are started as needed up to one per processor.
+void ThreadPool::submit(ThreadTask *t, LexInfo *li) {
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  t->next = (ThreadTask *) 0;
+  __atomic_add_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+  if(currentWorker != (Worker *) 0) currentWorker->deque.pushBottom(t);
+
+  // A worker only goes idle after seeing no pending tasks with the mutex held,
+  // so signalling with it held means no wakeup is missed.
+  pthread_mutex_lock(&mutex);
+  if(currentWorker == (Worker *) 0) {
+    if(injectTail == (ThreadTask *) 0) injectHead = t;
+    else injectTail->next = t;
+    injectTail = t;
+  }
+  if(idle > 0) pthread_cond_signal(&wakeup);
+  else if(workerCount - blocked < baseWorkers) startWorker(workerCount >= baseWorkers);
+  if(! monitorStarted) {
+    monitorStarted = true;
+    if((pthread_attr_init(&attr) != 0) || (pthread_attr_setstacksize(&attr, 64 * 1024) != 0) || (pthread_create(&thread, &attr, monitorThread, (void *) 0) != 0)) {
+      pthread_mutex_unlock(&mutex);
+      slexception.chuck("Can't create thread", li);
+    }
+    pthread_detach(thread);
+  }
+  if(workerCount == 0) {
+    pthread_mutex_unlock(&mutex);
+    slexception.chuck("Can't create thread", li);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// Called with the pool mutex held.
+bool ThreadPool::startWorker(bool spare) {
+  pthread_attr_t attr;
+  Worker *w;
+  int i;
+
+  for(i = 0; (i < POOL_MAX_WORKERS) && workers[i].active; i++) ;
+  if(i == POOL_MAX_WORKERS) return false;
+  w = &workers[i];
+
+  if(pinWorkers && (cpuCount > 0)) {
+    w->cpu = cpuList[i % cpuCount];
+    w->node = cpuNodes[i % cpuCount];
+    w->ee = (ExecutionEnvironment *) 0;
+  } else {
+    w->cpu = -1;
+    w->node = 0;
+    if(spareEECount > 0) w->ee = spareEEs[--spareEECount];
+    else w->ee = new ExecutionEnvironment;
+  }
+  w->spare = spare;
+  w->active = true;
+
+  if((pthread_attr_init(&attr) != 0) || (pthread_attr_setstacksize(&attr, stackSize) != 0) || (pthread_create(&w->thread, &attr, workerThread, w) != 0)) {
+    w->active = false;
+    if(w->ee != (ExecutionEnvironment *) 0) spareEEs[spareEECount++] = w->ee;
+    w->ee = (ExecutionEnvironment *) 0;
+    return false;
+  }
+  pthread_detach(w->thread);
+  workerCount++;
+  if(i >= highWater) highWater = i + 1;
+
+  return true;
+}
+
+// Own deque first, then the shared queue, then steal.
+ThreadTask *ThreadPool::nextTask(Worker *w) {
+  ThreadTask *t;
+  int n;
+  int i;
+  int j;
+
+  if((t = w->deque.popBottom()) != (ThreadTask *) 0) return t;
+
+  pthread_mutex_lock(&mutex);
+  if((t = injectHead) != (ThreadTask *) 0) {
+    injectHead = t->next;
+    if(injectHead == (ThreadTask *) 0) injectTail = (ThreadTask *) 0;
+  }
+  n = highWater;
+  pthread_mutex_unlock(&mutex);
+  if(t != (ThreadTask *) 0) return t;
+
+  j = (int) (w - workers);
+  for(i = 1; i < n; i++) {
+    if((t = workers[(j + i) % n].deque.popTop()) != (ThreadTask *) 0) return t;
+  }
+
+  return (ThreadTask *) 0;
+}
+
+// The environment is left clean for the next task, whatever this one did.
+void ThreadPool::runTask(Worker *w, ThreadTask *t) {
+  ExecutionEnvironment *ee;
+  bool failed;
+
+  ee = w->ee;
+  if(t->arg != (Object *) 0) {
+    t->arg->cache = &ee->cache;
+    ee->stack.push(t->arg);
+  }
+
+  if(t->job != (RangeJob *) 0) {
+    t->job->work(ee);
+    t->job->release();
+    delete t;
+    return;
+  }
+
+  failed = false;
+  if(t->cpu >= 0) pinThread(t->cpu);
+  try {
+    t->code->action(ee);
+  } catch(Exception *e) { e->printError(); failed = true; }
+  if(t->cpu >= 0) {
+    if(w->cpu >= 0) pinThread(w->cpu);
+    else unpinThread();
+  }
+
+  if(t->task != (Task *) 0) {
+    t->task->finish(ee, failed);
+    t->task->release((LexInfo *) 0);
+  }
+
+  try {
+    t->code->release((LexInfo *) 0);
+    while(ee->stack.getStack() != (StackItem *) 0) ee->stack.pop((LexInfo *) 0)->release((LexInfo *) 0);
+  } catch(Exception *e) { e->printError(); }
+  while(! ee->variableStack.isEmpty()) ee->variableStack.popVariableStack();
+
+  delete t;
+}
+
+void ThreadPool::runWorker(Worker *w) {
+  ThreadTask *t;
+  struct timespec ts;
+  bool retire;
+
+  currentWorker = w;
+  if(w->cpu >= 0) {
+    pinThread(w->cpu);
+    localEE(w);
+  }
+  w->ee->cache.claim();
+  retire = false;
+  while(! retire) {
+    if((t = nextTask(w)) != (ThreadTask *) 0) {
+      __atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+      runTask(w, t);
+      __atomic_add_fetch(&completed, 1, __ATOMIC_ACQ_REL);
+      continue;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if(__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0) {
+      idle++;
+      if(w->spare) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += POOL_RETIRE_MS / 1000;
+        ts.tv_nsec += (POOL_RETIRE_MS % 1000) * 1000000;
+        if(ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        if((pthread_cond_timedwait(&wakeup, &mutex, &ts) != 0) && (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0)) retire = true;
+      } else pthread_cond_wait(&wakeup, &mutex);
+      idle--;
+    }
+    if(retire) {
+      if(spareEECount < POOL_MAX_WORKERS) {
+        spareEENodes[spareEECount] = w->node;
+        spareEEs[spareEECount++] = w->ee;
+      }
+      w->ee = (ExecutionEnvironment *) 0;
+      w->active = false;
+      workerCount--;
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+// If tasks are waiting and no worker is idle, a worker blocked in a channel,
+// mutex, join or sleep wait is replaced straight away. Otherwise the workers
+// are busy with long running tasks or blocked somewhere the pool can't see,
+// such as reading input, so a spare is only added when nothing has finished
+// for a while. The wait doubles with each such spare and goes back to the start when
+// a task finishes, and there are never more than POOL_MAX_SPARES of them, so
+// processor bound tasks don't grow the pool without limit.
+void ThreadPool::monitor() {
+  unsigned long last;
+  unsigned long now;
+  int window;
+  int stalled;
+
+  last = 0;
+  window = POOL_MONITOR_MS;
+  stalled = 0;
+  for(;;) {
+    usleep(POOL_MONITOR_MS * 1000);
+    pthread_mutex_lock(&mutex);
+    now = __atomic_load_n(&completed, __ATOMIC_ACQUIRE);
+    if(now != last) {
+      window = POOL_MONITOR_MS;
+      stalled = 0;
+    } else stalled += POOL_MONITOR_MS;
+    last = now;
+    if((__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) && (idle == 0)) {
+      if(workerCount - blocked < baseWorkers) startWorker(workerCount >= baseWorkers);
+      else if((stalled >= window) && (workerCount - blocked < baseWorkers + POOL_MAX_SPARES)) {
+        if(startWorker(true)) {
+          window *= 2;
+          stalled = 0;
+        }
+      }
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+int ThreadPool::getBaseWorkers() { return baseWorkers; }
+
+// A pinned worker takes an environment left on its own node, or makes a new
+// one now that it's running there.
+void ThreadPool::localEE(Worker *w) {
+  int i;
+
+  pthread_mutex_lock(&mutex);
+  for(i = spareEECount - 1; (i >= 0) && (spareEENodes[i] != w->node); i--) ;
+  if(i >= 0) {
+    w->ee = spareEEs[i];
+    spareEECount--;
+    spareEEs[i] = spareEEs[spareEECount];
+    spareEENodes[i] = spareEENodes[spareEECount];
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if(w->ee == (ExecutionEnvironment *) 0) w->ee = new ExecutionEnvironment;
+}
+
+void ThreadPool::setPinning(bool p) {
+  int i;
+
+  pthread_mutex_lock(&mutex);
+  if(p && ! nodesKnown) {
+    for(i = 0; i < cpuCount; i++) cpuNodes[i] = cpuNode(cpuList[i]);
+    nodesKnown = true;
+  }
+  pinWorkers = p;
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadPool::setStackSize(size_t size) {
+  pthread_mutex_lock(&mutex);
+  stackSize = size;
+  pthread_mutex_unlock(&mutex);
+}
+
+// Where pinning isn't supported any processor number is accepted, and the
+// task runs wherever it's put.
+bool ThreadPool::cpuAvailable(int cpu) {
+  int i;
+
+  if(cpuCount == 0) return (cpu >= 0) && (cpu < baseWorkers);
+  for(i = 0; i < cpuCount; i++) {
+    if(cpuList[i] == cpu) return true;
+  }
+
+  return false;
+}
+
+// A worker about to wait for another task says so, and if there's queued work
+// and no one idle to do it, a spare is started rather than waiting for the
+// monitor to notice.
+void ThreadPool::blocking() {
+  pthread_mutex_lock(&mutex);
+  blocked++;
+  if((__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) && (idle == 0)) startWorker(true);
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadPool::unblocking() {
+  pthread_mutex_lock(&mutex);
+  blocked--;
+  pthread_mutex_unlock(&mutex);
+}
+
+ThreadCreate::ThreadCreate(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ThreadCreate::action(ExecutionEnvironment *ee) {
+  Object *o;
+  ThreadTask *t;
+
+  o = ee->stack.pop(getLexInfo());
+
+  t = new ThreadTask;
+  o->allocateMutex();
+  t->code = o->getCode(getLexInfo(), ee);
+  t->arg = ee->stack.pop(getLexInfo());
+  t->arg->hold();
+  t->arg->allocateMutex();
+  t->task = (Task *) 0;
+  t->job = (RangeJob *) 0;
+  t->cpu = -1;
+  pool.submit(t, getLexInfo());
+
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+// Values passed between threads
+
+// Copy a value so it can be pushed in another thread. Returns false if the
+// object has no value.
+static bool takeValue(Object *o, TaskValue *tv, ExecutionEnvironment *ee) {
+  Number *n;
+  String *s;
+
+  try {
+    n = o->getNumber((LexInfo *) 0, ee);
+    if(n->isInt()) { tv->type = TASK_INT; tv->valueInt = n->getInt(); }
+    else { tv->type = TASK_DOUBLE; tv->valueDouble = n->getDouble(); }
+    n->release((LexInfo *) 0);
+    return true;
+  } catch(Exception *e) { }
+
+  try {
+    s = o->getString((LexInfo *) 0, ee);
+    tv->type = TASK_STRING;
+    tv->str = strdup(s->getValue());
+    s->release((LexInfo *) 0);
+    return true;
+  } catch(Exception *e) { }
+
+  try {
+    tv->object = o->resolveValue((LexInfo *) 0, ee);
+    tv->object->allocateMutex();
+    tv->type = TASK_OBJECT;
+    return true;
+  } catch(Exception *e) { }
+
+  tv->type = TASK_INT;
+  tv->valueInt = 0;
+  return false;
+}
+
+static void pushValue(TaskValue *tv, ExecutionEnvironment *ee) {
+  switch(tv->type) {
+    case TASK_INT: ee->stack.push(ee->cache.newNumber(tv->valueInt)); break;
+    case TASK_DOUBLE: ee->stack.push(ee->cache.newNumber(tv->valueDouble)); break;
+    case TASK_STRING: ee->stack.push(ee->cache.newString(strdup(tv->str), true)); break;
+    case TASK_OBJECT: tv->object->hold(); ee->stack.push(tv->object); break;
+  }
+}
+
+static void freeValue(TaskValue *tv) {
+  if(tv->type == TASK_STRING) free(tv->str);
+  else if(tv->type == TASK_OBJECT) tv->object->release((LexInfo *) 0);
+}
+
+// Sleep while *address still holds value, and wake up to count sleepers.
+#ifdef __linux__
+static void futexWait(int *address, int value) {
+  syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futexWake(int *address, int count) {
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#else
+#define PARKING_LOTS   64
+
+class ParkingLot {
+  public:
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static ParkingLot parkingLot[PARKING_LOTS];
+static pthread_once_t parkingOnce = PTHREAD_ONCE_INIT;
+
+static void parkingInit() {
+  int i;
+
+  for(i = 0; i < PARKING_LOTS; i++) {
+    pthread_mutex_init(&parkingLot[i].mutex, NULL);
+    pthread_cond_init(&parkingLot[i].cond, NULL);
+  }
+}
+
+static ParkingLot *findParkingLot(int *address) {
+  pthread_once(&parkingOnce, parkingInit);
+  return &parkingLot[((uintptr_t) address / sizeof(int)) % PARKING_LOTS];
+}
+
+// Everyone parked on the lot is woken, as others may share it, and goes back
+// to sleep if their value hasn't changed.
+static void futexWait(int *address, int value) {
+  ParkingLot *lot;
+
+  lot = findParkingLot(address);
+  pthread_mutex_lock(&lot->mutex);
+  if(__atomic_load_n(address, __ATOMIC_SEQ_CST) == value) pthread_cond_wait(&lot->cond, &lot->mutex);
+  pthread_mutex_unlock(&lot->mutex);
+}
+
+static void futexWake(int *address, int count) {
+  ParkingLot *lot;
+
+  lot = findParkingLot(address);
+  pthread_mutex_lock(&lot->mutex);
+  pthread_cond_broadcast(&lot->cond);
+  pthread_mutex_unlock(&lot->mutex);
+}
+#endif
+
+// A green thread can't sleep in the kernel without stopping its carrier, so it
+// parks instead, on a table of lists keyed by the address it's waiting on.
+// greenWaiting counts them, and a waker only looks in the table when it's
+// above zero. Waiters count themselves in before checking the value and
+// wakers change the value before checking the count, so one sees the other.
+#define GREEN_LOTS   64
+
+class GreenLot {
+  public:
+    pthread_mutex_t mutex;
+    GreenWaiters waiters;
+};
+
+static GreenLot greenLots[GREEN_LOTS];
+static pthread_once_t greenLotsOnce = PTHREAD_ONCE_INIT;
+static int greenWaiting = 0;
+
+static void greenLotsInit() {
+  int i;
+
+  for(i = 0; i < GREEN_LOTS; i++) pthread_mutex_init(&greenLots[i].mutex, NULL);
+}
+
+static GreenLot *findGreenLot(int *address) {
+  pthread_once(&greenLotsOnce, greenLotsInit);
+  return &greenLots[((uintptr_t) address / sizeof(int)) % GREEN_LOTS];
+}
+
+// As futexWait and futexWake, for green threads as well. Either can return
+// without the value changing, so callers check again.
+static void syncWait(int *address, int value) {
+  GreenThread *g;
+  GreenLot *lot;
+
+  if((g = currentGreen) == (GreenThread *) 0) {
+    futexWait(address, value);
+    return;
+  }
+
+  lot = findGreenLot(address);
+  __atomic_add_fetch(&greenWaiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&lot->mutex);
+  if(__atomic_load_n(address, __ATOMIC_SEQ_CST) == value) {
+    g->waitAddress = address;
+    lot->waiters.add(g);
+    pthread_mutex_unlock(&lot->mutex);
+    g->carrier->park();
+    pthread_mutex_lock(&lot->mutex);
+    lot->waiters.remove(g);
+  }
+  pthread_mutex_unlock(&lot->mutex);
+  __atomic_sub_fetch(&greenWaiting, 1, __ATOMIC_SEQ_CST);
+}
+
+static void syncWake(int *address, int count) {
+  GreenThread *g;
+  GreenLot *lot;
+  int woken;
+
+  futexWake(address, count);
+  if(__atomic_load_n(&greenWaiting, __ATOMIC_SEQ_CST) == 0) return;
+
+  lot = findGreenLot(address);
+  pthread_mutex_lock(&lot->mutex);
+  for(woken = 0; (woken < count) && ((g = lot->waiters.remove(address)) != (GreenThread *) 0); woken++) g->carrier->wake(g);
+  pthread_mutex_unlock(&lot->mutex);
+}
+
+// Task class
+
+Task::Task(Cache *c) : Handle(taskType, c), done(0), waiters(0), failed(false), values((TaskValue *) 0), count(0) { }
+
+Task::~Task() {
+  int i;
+
+  for(i = 0; i < count; i++) freeValue(&values[i]);
+  free(values);
+}
+
+// Take what's left on the stack, bottom first, and wake up any joiners.
+void Task::finish(ExecutionEnvironment *ee, bool f) {
+  Object *o;
+  int i;
+
+  count = 0;
+  if(! f && (ee->stack.getStackSize() > 0)) {
+    count = ee->stack.getStackSize();
+    if((values = (TaskValue *) malloc(count * sizeof(TaskValue))) == (TaskValue *) 0) {
+      count = 0;
+      f = true;
+    }
+  }
+
+  for(i = count - 1; i >= 0; i--) {
+    o = ee->stack.pop((LexInfo *) 0);
+    if(! takeValue(o, &values[i], ee)) f = true;
+    o->release((LexInfo *) 0);
+  }
+
+  failed = f;
+  __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&waiters, __ATOMIC_SEQ_CST) > 0) syncWake(&done, INT_MAX);
+}
+
+// A green thread joining parks rather than stopping its carrier, which may be
+// the one that has to run the thread being joined.
+void Task::wait() {
+  if(__atomic_load_n(&done, __ATOMIC_ACQUIRE)) return;
+
+  if(currentWorker != (Worker *) 0) pool.blocking();
+  __atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+  while(! __atomic_load_n(&done, __ATOMIC_SEQ_CST)) syncWait(&done, 0);
+  __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+  if(currentWorker != (Worker *) 0) pool.unblocking();
+}
+
+// Values are only read once the task is done, so there's no need to lock. A
+// task can be joined any number of times.
+void Task::pushValues(ExecutionEnvironment *ee, LexInfo *li) {
+  int i;
+
+  if(failed) slexception.chuck("thread failed", li);
+  for(i = 0; i < count; i++) pushValue(&values[i], ee);
+}
+
+static Task *findTask(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(taskType)) {
+    h->release(li);
+    slexception.chuck("task not found", li);
+  }
+
+  return (Task *) h;
+}
+
+ThreadSpawn::ThreadSpawn(bool p, LexInfo *li) : Operation(li), pinned(p) { }
+
+OperatorReturn ThreadSpawn::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Object *co;
+  Number *n;
+  ThreadTask *t;
+  Task *task;
+  INT cpu;
+
+  o = ee->stack.pop(getLexInfo());
+
+  cpu = -1;
+  if(pinned) {
+    co = ee->stack.pop(getLexInfo());
+    n = co->getNumber(getLexInfo(), ee);
+    cpu = n->getInt();
+    n->release(getLexInfo());
+    co->release(getLexInfo());
+    if((cpu < 0) || (cpu > INT_MAX) || ! pool.cpuAvailable((int) cpu)) {
+      o->release(getLexInfo());
+      sprintf(threadMessage, "processor %" PCTD "d isn't available", cpu);
+      slexception.chuck(threadMessage, getLexInfo());
+    }
+  }
+
+  t = new ThreadTask;
+  o->allocateMutex();
+  t->code = o->getCode(getLexInfo(), ee);
+  t->arg = ee->stack.pop(getLexInfo());
+  t->arg->hold();
+  t->arg->allocateMutex();
+  task = new Task(&ee->cache);
+  task->hold();
+  t->task = task;
+  t->job = (RangeJob *) 0;
+  t->cpu = (int) cpu;
+  pool.submit(t, getLexInfo());
+  ee->stack.push(task);
+
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadJoin::ThreadJoin(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ThreadJoin::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Task *task;
+
+  o = ee->stack.pop(getLexInfo());
+  task = findTask(o, getLexInfo(), ee);
+  task->wait();
+  try {
+    task->pushValues(ee, getLexInfo());
+  } catch(Exception *e) {
+    task->release(getLexInfo());
+    o->release(getLexInfo());
+    e->rechuck(getLexInfo());
+  }
+  task->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadWaitAll::ThreadWaitAll(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ThreadWaitAll::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Number *n;
+  Task *task;
+  INT count;
+  INT i;
+
+  o = ee->stack.pop(getLexInfo());
+  n = o->getNumber(getLexInfo(), ee);
+  count = n->getInt();
+  n->release(getLexInfo());
+  o->release(getLexInfo());
+
+  for(i = 0; i < count; i++) {
+    o = ee->stack.pop(getLexInfo());
+    task = findTask(o, getLexInfo(), ee);
+    task->wait();
+    task->release(getLexInfo());
+    o->release(getLexInfo());
+  }
+
+  return or_continue;
+}
+
+// Mutex class
+
+// The state is 0 when unlocked, 1 when locked and 2 when locked with someone
+// waiting, so unlocking only wakes anyone when there's someone to wake. It
+// belongs to no thread, so green threads sharing a carrier can each hold it.
+Mutex::Mutex(Cache *cache) : Handle(mutexType, cache), state(0) { }
+
+// A pool worker about to wait for a mutex says so, as whoever holds it may be
+// waiting for a task queued behind this one.
+void Mutex::lock() {
+  int c;
+
+  c = 0;
+  if(__atomic_compare_exchange_n(&state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+  if(currentWorker != (Worker *) 0) pool.blocking();
+  if(c != 2) c = __atomic_exchange_n(&state, 2, __ATOMIC_SEQ_CST);
+  while(c != 0) {
+    syncWait(&state, 2);
+    c = __atomic_exchange_n(&state, 2, __ATOMIC_SEQ_CST);
+  }
+  if(currentWorker != (Worker *) 0) pool.unblocking();
+}
+
+void Mutex::unlock() {
+  if(__atomic_exchange_n(&state, 0, __ATOMIC_SEQ_CST) == 2) syncWake(&state, 1);
+}
+
+// Semaphore class
+
+Semaphore::Semaphore(int c, Cache *cache) : Handle(semaphoreType, cache), count(c), waiters(0) { }
+
+void Semaphore::wait() {
+  int c;
+
+  for(;;) {
+    c = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+    while(c > 0) {
+      if(__atomic_compare_exchange_n(&count, &c, c - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+    }
+
+    if(currentWorker != (Worker *) 0) pool.blocking();
+    __atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&count, __ATOMIC_SEQ_CST) == 0) syncWait(&count, 0);
+    __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+    if(currentWorker != (Worker *) 0) pool.unblocking();
+  }
+}
+
+void Semaphore::post() {
+  __atomic_add_fetch(&count, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&waiters, __ATOMIC_SEQ_CST) > 0) syncWake(&count, 1);
+}
+
+// Condition class
+
+// Signalling bumps the sequence number, so a waiter that read the old number
+// before unlocking the mutex won't sleep through a signal sent in between.
+Condition::Condition(Cache *cache) : Handle(conditionType, cache), sequence(0), waiters(0) { }
+
+void Condition::wait(Mutex *mutex) {
+  int s;
+
+  s = __atomic_load_n(&sequence, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+  mutex->unlock();
+  if(currentWorker != (Worker *) 0) pool.blocking();
+  syncWait(&sequence, s);
+  if(currentWorker != (Worker *) 0) pool.unblocking();
+  __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+  mutex->lock();
+}
+
+void Condition::signal(bool all) {
+  __atomic_add_fetch(&sequence, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&waiters, __ATOMIC_SEQ_CST) > 0) syncWake(&sequence, all ? INT_MAX : 1);
+}
+
+// Barrier class
+
+// The last thread to arrive resets the count for the next round before moving
+// the generation on, which is what everyone else is waiting for.
+Barrier::Barrier(int n, Cache *cache) : Handle(barrierType, cache), parties(n), arrived(0), generation(0) { }
+
+void Barrier::wait() {
+  int g;
+
+  g = __atomic_load_n(&generation, __ATOMIC_SEQ_CST);
+  if(__atomic_add_fetch(&arrived, 1, __ATOMIC_SEQ_CST) == parties) {
+    __atomic_store_n(&arrived, 0, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+    syncWake(&generation, INT_MAX);
+    return;
+  }
+
+  if(currentWorker != (Worker *) 0) pool.blocking();
+  while(__atomic_load_n(&generation, __ATOMIC_SEQ_CST) == g) syncWait(&generation, g);
+  if(currentWorker != (Worker *) 0) pool.unblocking();
+}
+
+// Named mutexes and semaphores are kept in the btree as /name/mutex/thread and
+// /name/semaphore/thread, where the name is a variable name, a string or a
+// number.
+static void syncName(Object *o, const char *kind, const char *title, char *name, char *fullName, LexInfo *li, ExecutionEnvironment *ee) {
+  Name *n;
+  Number *no;
   String *s;
-  Variable *v;
   char *str;
   char fmt[16];
+
+  name[0] = 0;
+
+  try {
+    n = o->getName(li, ee);
+    str = n->getValue();
+    strcpy(name, str + (str[0] == '/' ? 1 : 0));
+  } catch(Exception *e) { }
+
+  if(name[0] == 0) {
+    try {
+      s = o->getString(li, ee);
+      strcpy(name, s->getValue());
+      s->release(li);
+    } catch(Exception *e) { }
+  }
+
+  if(name[0] == 0) {
+    try {
+      no = o->getNumber(li, ee);
+      if(no->isInt()) { sprintf(fmt, "%%%sd", PCTD); sprintf(name, fmt, no->getInt()); }
+      else sprintf(name, "%0.3f", no->getDouble());
+      no->release(li);
+    } catch(Exception *e) { }
+  }
+
+  if(name[0] == 0) slexception.chuck("Unknown argument type", li);
+
+  sprintf(fullName, "/%s/%s/thread", name, kind);
+  if(strlen(fullName) > 63) {
+    sprintf(threadMessage, "%s name %s too long", title, name);
+    slexception.chuck(threadMessage, li);
+  }
+}
+
+static Variable *findNamed(Object *o, const char *kind, const char *title, LexInfo *li, ExecutionEnvironment *ee) {
+  Variable *v;
+  char name[512];
+  char fullName[1024];
+
+  syncName(o, kind, title, name, fullName, li, ee);
+  v = btree.findVariable(fullName);
+  if(v == (Variable *) 0) {
+    sprintf(threadMessage, "%s %s not found", title, name);
+    slexception.chuck(threadMessage, li);
+  }
+
+  return v;
+}
+
+// The handle an object refers to, or null if it isn't one, such as the name
+// of a named mutex. Names are looked up first so the usual cases, a variable
+// holding a handle and the name of a named one, don't need an exception.
+static Handle *findSyncHandle(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Name *n;
+  Variable *v;
+  Handle *h;
+
+  h = (Handle *) 0;
+  n = (Name *) 0;
+  try {
+    n = o->getName(li, ee);
+  } catch(Exception *e) { }
+
+  if(n != (Name *) 0) {
+    v = n->findVariable(ee);
+    if((v == (Variable *) 0) || ! v->isInitialised()) return h;
+    o = v->getObject();
+  }
+
+  try {
+    h = o->getHandle(li, ee);
+  } catch(Exception *e) { }
+
+  return h;
+}
+
+static Mutex *findMutex(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = findSyncHandle(o, li, ee);
+  if(h == (Handle *) 0) h = findNamed(o, "mutex", "Mutex", li, ee)->getObject()->getHandle(li, ee);
+  if(! h->isType(mutexType)) {
+    h->release(li);
+    slexception.chuck("mutex not found", li);
+  }
+
+  return (Mutex *) h;
+}
+
+static Semaphore *findSemaphore(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = findSyncHandle(o, li, ee);
+  if(h == (Handle *) 0) h = findNamed(o, "semaphore", "Semaphore", li, ee)->getObject()->getHandle(li, ee);
+  if(! h->isType(semaphoreType)) {
+    h->release(li);
+    slexception.chuck("semaphore not found", li);
+  }
+
+  return (Semaphore *) h;
+}
+
+ThreadMutex::ThreadMutex(bool u, LexInfo *li) : Operation(li), unnamed(u) { }
+
+OperatorReturn ThreadMutex::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Variable *v;
+  Mutex *mutex;
   char name[512];
   char mutexName[1024];
-  pthread_mutex_t *mutex;
+
+  if(unnamed) {
+    ee->stack.push(new Mutex(&ee->cache));
+    return or_continue;
+  }
+
+  o = ee->stack.pop(getLexInfo());
+
+  syncName(o, "mutex", "Mutex", name, mutexName, getLexInfo(), ee);
+  v = btree.findVariable(mutexName);
+  if(v != (Variable *) 0) {
+    sprintf(threadMessage, "Mutex %s already exists", name);
+    slexception.chuck(threadMessage, getLexInfo());
+  }
+  mutex = new Mutex(&ee->cache);
+  v = new Variable(mutexName);
+  v->setObject(mutex);
+  mutex->release(getLexInfo());
+  btree.addVariable(v);
+
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadLock::ThreadLock(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ThreadLock::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Mutex *mutex;
+
+  o = ee->stack.pop(getLexInfo());
+  mutex = findMutex(o, getLexInfo(), ee);
+  mutex->lock();
+  mutex->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadUnlock::ThreadUnlock(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ThreadUnlock::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Mutex *mutex;
+
+  o = ee->stack.pop(getLexInfo());
+  mutex = findMutex(o, getLexInfo(), ee);
+  mutex->unlock();
+  mutex->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadSemaphore::ThreadSemaphore(bool u, LexInfo *li) : Operation(li), unnamed(u) { }
+
+OperatorReturn ThreadSemaphore::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Number *no;
+  Variable *v;
+  Semaphore *sem;
+  char name[512];
+  char semName[1024];
+  INT count;
+
+  o = ee->stack.pop(getLexInfo());
+
+  if(unnamed) {
+    no = o->getNumber(getLexInfo(), ee);
+    count = no->getInt();
+    no->release(getLexInfo());
+    o->release(getLexInfo());
+    if(count < 0 || count > INT_MAX) slexception.chuck("semaphore count out of range", getLexInfo());
+    ee->stack.push(new Semaphore((int) count, &ee->cache));
+    return or_continue;
+  }
+
+  syncName(o, "semaphore", "Semaphore", name, semName, getLexInfo(), ee);
+  v = btree.findVariable(semName);
+  if(v != (Variable *) 0) {
+    sprintf(threadMessage, "Semaphore %s already exists", name);
+    slexception.chuck(threadMessage, getLexInfo());
+  }
+  sem = new Semaphore(0, &ee->cache);
+  v = new Variable(semName);
+  v->setObject(sem);
+  sem->release(getLexInfo());
+  btree.addVariable(v);
+
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadWait::ThreadWait(LexInfo *li) : Operation(li) { }
+
+// wait is shared by semaphores, condition variables and barriers.
+OperatorReturn ThreadWait::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Object *m;
+  Handle *h;
+  Mutex *mutex;
+
+  o = ee->stack.pop(getLexInfo());
+
+  h = findSyncHandle(o, getLexInfo(), ee);
+  if(h == (Handle *) 0) h = findSemaphore(o, getLexInfo(), ee);
+
+  if(h->isType(semaphoreType)) ((Semaphore *) h)->wait();
+  else if(h->isType(barrierType)) ((Barrier *) h)->wait();
+  else if(h->isType(conditionType)) {
+    m = ee->stack.pop(getLexInfo());
+    try {
+      mutex = findMutex(m, getLexInfo(), ee);
+    } catch(Exception *e) {
+      h->release(getLexInfo());
+      m->release(getLexInfo());
+      o->release(getLexInfo());
+      e->rechuck(getLexInfo());
+    }
+    ((Condition *) h)->wait(mutex);
+    mutex->release(getLexInfo());
+    m->release(getLexInfo());
+  } else {
+    h->release(getLexInfo());
+    slexception.chuck("semaphore, condition or barrier not found", getLexInfo());
+  }
+
+  h->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadPost::ThreadPost(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ThreadPost::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Semaphore *sem;
 
   o = ee->stack.pop(getLexInfo());
+  sem = findSemaphore(o, getLexInfo(), ee);
+  sem->post();
+  sem->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+static Handle *findTypedHandle(Object *o, const char *type, const char *message, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(type)) {
+    h->release(li);
+    slexception.chuck(message, li);
+  }
+
+  return h;
+}
+
+ThreadCondition::ThreadCondition(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn ThreadCondition::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Condition *c;
+
+  if(function == CONDITION_CREATE) {
+    ee->stack.push(new Condition(&ee->cache));
+    return or_continue;
+  }
+
+  o = ee->stack.pop(getLexInfo());
+  c = (Condition *) findTypedHandle(o, conditionType, "condition not found", getLexInfo(), ee);
+  c->signal(function == CONDITION_BROADCAST);
+  c->release(getLexInfo());
+  o->release(getLexInfo());
+
+  return or_continue;
+}
+
+ThreadBarrier::ThreadBarrier(LexInfo *li) : Operation(li) { }
+
+OperatorReturn ThreadBarrier::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Number *n;
+  INT parties;
+
+  o = ee->stack.pop(getLexInfo());
+  n = o->getNumber(getLexInfo(), ee);
+  parties = n->getInt();
+  n->release(getLexInfo());
+  o->release(getLexInfo());
+  if(parties < 1 || parties > INT_MAX) slexception.chuck("a barrier needs at least one thread", getLexInfo());
+  ee->stack.push(new Barrier((int) parties, &ee->cache));
+
+  return or_continue;
+}
+
+ThreadSetting::ThreadSetting(int s, LexInfo *li) : Operation(li), setting(s) { }
+
+OperatorReturn ThreadSetting::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Number *n;
+  INT value;
+  long page;
+
+  o = ee->stack.pop(getLexInfo());
+  n = o->getNumber(getLexInfo(), ee);
+  value = n->getInt();
+  n->release(getLexInfo());
+  o->release(getLexInfo());
+
+  switch(setting) {
+    case SETTING_PIN:
+      pool.setPinning(value != 0);
+      break;
+
+    case SETTING_STACKSIZE:
+      if(value < PTHREAD_STACK_MIN) {
+        sprintf(threadMessage, "a stack needs at least %ld bytes", (long) PTHREAD_STACK_MIN);
+        slexception.chuck(threadMessage, getLexInfo());
+      }
+      page = sysconf(_SC_PAGESIZE);
+      if(page > 0) value = (value + page - 1) / page * page;
+      pool.setStackSize((size_t) value);
+      break;
+  }
+
+  return or_continue;
+}
+
+// RangeJob class
+
+RangeJob::RangeJob(INT f, INT t, Code *c, Code *cb) : from(f), to(t), code(c), combiner(cb), next(0), finished(0), waiters(0), references(1), failed(false) {
+  chunks = ((unsigned INT) to - (unsigned INT) from < RANGE_CHUNKS ? (int) (to - from) : RANGE_CHUNKS);
+  results = (TaskValue *) 0;
+  if((combiner != (Code *) 0) && (chunks > 0)) {
+    if((results = (TaskValue *) malloc(chunks * sizeof(TaskValue))) == (TaskValue *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  }
+}
+
+RangeJob::~RangeJob() {
+  int i;
+
+  if(results != (TaskValue *) 0) {
+    for(i = 0; i < chunks; i++) freeValue(&results[i]);
+    free(results);
+  }
+  code->release((LexInfo *) 0);
+  if(combiner != (Code *) 0) combiner->release((LexInfo *) 0);
+}
+
+int RangeJob::getChunks() { return chunks; }
+bool RangeJob::hasFailed() { return failed; }
+void RangeJob::hold() { __atomic_add_fetch(&references, 1, __ATOMIC_RELAXED); }
+void RangeJob::release() { if(__atomic_sub_fetch(&references, 1, __ATOMIC_ACQ_REL) == 0) delete this; }
+
+// Chunk c starts (to - from) * c / chunks numbers in, worked out from the
+// quotient and remainder so that a range spanning most of INT can't overflow.
+// to isn't less than from, so their difference fits in an unsigned INT.
+INT RangeJob::chunkStart(int c) {
+  unsigned INT span;
+
+  span = (unsigned INT) to - (unsigned INT) from;
+
+  return (INT) ((unsigned INT) from + (span / chunks) * c + ((span % chunks) * c) / chunks);
+}
+
+// Run code for each number in the chunk. For reduce, fold the values left by
+// each run with the combiner as we go, leaving one value for the chunk.
+void RangeJob::runChunk(ExecutionEnvironment *ee, int c) {
+  Object *o;
+  INT lo;
+  INT hi;
+  INT i;
+  int depth;
+
+  lo = chunkStart(c);
+  hi = chunkStart(c + 1);
+  depth = ee->stack.getStackSize();
+
+  for(i = lo; i < hi; i++) {
+    ee->stack.push(ee->cache.newNumber(i));
+    code->action(ee);
+    if(combiner == (Code *) 0) {
+      while(ee->stack.getStackSize() > depth) ee->stack.pop((LexInfo *) 0)->release((LexInfo *) 0);
+    } else {
+      if(i > lo) combiner->action(ee);
+      if(ee->stack.getStackSize() != depth + 1) slexception.chuck("reduce code must leave one value", (LexInfo *) 0);
+    }
+  }
+
+  if(combiner != (Code *) 0) {
+    o = ee->stack.pop((LexInfo *) 0);
+    if(! takeValue(o, &results[c], ee)) {
+      o->release((LexInfo *) 0);
+      slexception.chuck("reduce code must leave a value", (LexInfo *) 0);
+    }
+    o->release((LexInfo *) 0);
+  }
+}
+
+// Claim chunks until there are none left. After a failure the remaining chunks
+// are claimed but not run.
+void RangeJob::work(ExecutionEnvironment *ee) {
+  int c;
+  int depth;
+  int frames;
+  bool ok;
+
+  depth = ee->stack.getStackSize();
+  frames = ee->variableStack.getDepth();
+  while((c = __atomic_fetch_add(&next, 1, __ATOMIC_ACQ_REL)) < chunks) {
+    ok = ! __atomic_load_n(&failed, __ATOMIC_ACQUIRE);
+    if(ok) {
+      try {
+        runChunk(ee, c);
+      } catch(Exception *e) {
+        e->printError();
+        ok = false;
+      }
+    }
+    if(! ok) {
+      if(results != (TaskValue *) 0) { results[c].type = TASK_INT; results[c].valueInt = 0; }
+      while(ee->stack.getStackSize() > depth) ee->stack.pop((LexInfo *) 0)->release((LexInfo *) 0);
+      while(ee->variableStack.getDepth() > frames) ee->variableStack.popVariableStack();
+      __atomic_store_n(&failed, true, __ATOMIC_RELEASE);
+    }
+
+    if((__atomic_add_fetch(&finished, 1, __ATOMIC_SEQ_CST) == chunks) && (__atomic_load_n(&waiters, __ATOMIC_SEQ_CST) > 0)) syncWake(&finished, INT_MAX);
+  }
+}
+
+// As Task::wait, so a green thread running parallel or reduce parks while the
+// helpers finish rather than stopping its carrier.
+void RangeJob::wait() {
+  int f;
+
+  if(__atomic_load_n(&finished, __ATOMIC_ACQUIRE) == chunks) return;
+
+  if(currentWorker != (Worker *) 0) pool.blocking();
+  __atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+  while((f = __atomic_load_n(&finished, __ATOMIC_SEQ_CST)) < chunks) syncWait(&finished, f);
+  __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+  if(currentWorker != (Worker *) 0) pool.unblocking();
+}
+
+void RangeJob::combine(ExecutionEnvironment *ee, LexInfo *li) {
+  int depth;
+  int c;
+
+  if(chunks == 0) slexception.chuck("reduce needs a range with at least one number", li);
+  depth = ee->stack.getStackSize();
+  for(c = 0; c < chunks; c++) {
+    pushValue(&results[c], ee);
+    if(c > 0) combiner->action(ee);
+    if(ee->stack.getStackSize() != depth + 1) slexception.chuck("reduce code must leave one value", li);
+  }
+}
+
+ThreadParallel::ThreadParallel(bool r, LexInfo *li) : Operation(li), reduce(r) { }
+
+OperatorReturn ThreadParallel::action(ExecutionEnvironment *ee) {
+  Object *o1;
+  Object *o2;
+  Object *o3;
+  Object *o4;
+  Number *n;
+  Code *code;
+  Code *combiner;
+  ThreadTask *t;
+  RangeJob *job;
+  INT from;
+  INT to;
+  int helpers;
+  int i;
+
+  o4 = (reduce ? ee->stack.pop(getLexInfo()) : (Object *) 0);
+  o3 = ee->stack.pop(getLexInfo());
+  o2 = ee->stack.pop(getLexInfo());
+  o1 = ee->stack.pop(getLexInfo());
+
+  n = o1->getNumber(getLexInfo(), ee);
+  from = n->getInt();
+  n->release(getLexInfo());
+  n = o2->getNumber(getLexInfo(), ee);
+  to = n->getInt();
+  n->release(getLexInfo());
+  if(to < from) to = from;
+  o3->allocateMutex();
+  code = o3->getCode(getLexInfo(), ee);
+  combiner = (Code *) 0;
+  if(reduce) {
+    o4->allocateMutex();
+    combiner = o4->getCode(getLexInfo(), ee);
+  }
+
+  o1->release(getLexInfo());
+  o2->release(getLexInfo());
+  o3->release(getLexInfo());
+  if(reduce) o4->release(getLexInfo());
+
+  // Helpers for all but one of the processors, since this thread works too.
+  job = new RangeJob(from, to, code, combiner);
+  helpers = pool.getBaseWorkers() - 1;
+  if(helpers > job->getChunks() - 1) helpers = job->getChunks() - 1;
+  for(i = 0; i < helpers; i++) {
+    t = new ThreadTask;
+    t->code = (Code *) 0;
+    t->arg = (Object *) 0;
+    t->task = (Task *) 0;
+    t->job = job;
+    t->cpu = -1;
+    job->hold();
+    pool.submit(t, getLexInfo());
+  }
+
+  job->work(ee);
+  job->wait();
+
+  try {
+    if(job->hasFailed()) slexception.chuck("parallel failed", getLexInfo());
+    if(reduce) job->combine(ee, getLexInfo());
+  } catch(Exception *e) {
+    job->release();
+    e->rechuck(getLexInfo());
+  }
+  job->release();
+
+  return or_continue;
+}
+
+// Channel class
+
+Channel::Channel(INT size, Cache *c) : Handle(channelType, c), sendPosition(0), recvPosition(0), closed(false), sendersWaiting(0), receiversWaiting(0) {
+  unsigned long n;
+  unsigned long i;
+
+  for(n = 2; n < (unsigned long) size; n <<= 1) ;
+  if((slots = (ChannelSlot *) malloc(n * sizeof(ChannelSlot))) == (ChannelSlot *) 0) slexception.chuck("malloc error", (LexInfo *) 0);
+  for(i = 0; i < n; i++) slots[i].sequence = i;
+  mask = n - 1;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&notFull, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+}
+
+Channel::~Channel() {
+  TaskValue tv;
+
+  while(dequeue(&tv)) freeValue(&tv);
+  free(slots);
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&notFull);
+  pthread_cond_destroy(&notEmpty);
+}
+
+bool Channel::enqueue(TaskValue *tv) {
+  ChannelSlot *slot;
+  unsigned long pos;
+  unsigned long seq;
+  long diff;
+
+  pos = __atomic_load_n(&sendPosition, __ATOMIC_RELAXED);
+  for(;;) {
+    slot = &slots[pos & mask];
+    seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    diff = (long) seq - (long) pos;
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&sendPosition, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if(diff < 0) return false;
+    else pos = __atomic_load_n(&sendPosition, __ATOMIC_RELAXED);
+  }
+  slot->value = *tv;
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool Channel::dequeue(TaskValue *tv) {
+  ChannelSlot *slot;
+  unsigned long pos;
+  unsigned long seq;
+  long diff;
+
+  pos = __atomic_load_n(&recvPosition, __ATOMIC_RELAXED);
+  for(;;) {
+    slot = &slots[pos & mask];
+    seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    diff = (long) seq - (long) (pos + 1);
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&recvPosition, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if(diff < 0) return false;
+    else pos = __atomic_load_n(&recvPosition, __ATOMIC_RELAXED);
+  }
+  *tv = slot->value;
+  __atomic_store_n(&slot->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool Channel::trySend(TaskValue *tv) {
+  if(! enqueue(tv)) return false;
+  wake(&notEmpty, &receiversWaiting, &greenReceivers);
+  return true;
+}
+
+bool Channel::tryRecv(TaskValue *tv) {
+  if(! dequeue(tv)) return false;
+  wake(&notFull, &sendersWaiting, &greenSenders);
+  return true;
+}
+
+// Waiters count themselves in with the mutex held before trying again, so
+// either their retry sees the change or the count is seen here and the signal
+// is sent once they're waiting. One waiting green thread is woken per value,
+// since every green thread woken has to be switched to.
+void Channel::wake(pthread_cond_t *cond, int *waiting, GreenWaiters *greens) {
+  GreenThread *g;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+    pthread_mutex_lock(&mutex);
+    pthread_cond_broadcast(cond);
+    if((g = greens->remove()) != (GreenThread *) 0) g->carrier->wake(g);
+    pthread_mutex_unlock(&mutex);
+  }
+}
 
-  name[0] = 0;
+// A green thread waits by parking on its carrier so the carrier can run
+// something else. Called with the mutex held, and returns with it held.
+void Channel::waitGreen(GreenWaiters *greens, GreenThread *g) {
+  greens->add(g);
+  pthread_mutex_unlock(&mutex);
+  g->carrier->park();
+  pthread_mutex_lock(&mutex);
+  greens->remove(g);
+}
 
-  try {
-    n = o->getName(getLexInfo(), ee);
-    str = n->getValue();
-    strcpy(name, str + (str[0] == '/' ? 1 : 0));
-  } catch(Exception *e) { }
+void Channel::send(TaskValue *tv, LexInfo *li) {
+  GreenThread *g;
+  bool sent;
+
+  g = currentGreen;
+  for(;;) {
+    if(__atomic_load_n(&closed, __ATOMIC_ACQUIRE)) slexception.chuck("channel closed", li);
+    if(trySend(tv)) return;
+
+    if((g == (GreenThread *) 0) && (currentWorker != (Worker *) 0)) pool.blocking();
+    pthread_mutex_lock(&mutex);
+    __atomic_add_fetch(&sendersWaiting, 1, __ATOMIC_SEQ_CST);
+    sent = ! __atomic_load_n(&closed, __ATOMIC_ACQUIRE) && enqueue(tv);
+    if(! sent && ! __atomic_load_n(&closed, __ATOMIC_ACQUIRE)) {
+      if(g != (GreenThread *) 0) waitGreen(&greenSenders, g);
+      else pthread_cond_wait(&notFull, &mutex);
+    }
+    __atomic_sub_fetch(&sendersWaiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&mutex);
+    if((g == (GreenThread *) 0) && (currentWorker != (Worker *) 0)) pool.unblocking();
+    if(sent) {
+      wake(&notEmpty, &receiversWaiting, &greenReceivers);
+      return;
+    }
+  }
+}
 
-  if(name[0] == 0) {
-    try {
-      s = o->getString(getLexInfo(), ee);
-      strcpy(name, s->getValue());
-      s->release(getLexInfo());
-    } catch(Exception *e) { }
+// Returns false once the channel is closed and empty.
+bool Channel::recv(TaskValue *tv) {
+  GreenThread *g;
+  bool got;
+
+  g = currentGreen;
+  for(;;) {
+    if(tryRecv(tv)) return true;
+    if(__atomic_load_n(&closed, __ATOMIC_ACQUIRE)) return tryRecv(tv);
+
+    if((g == (GreenThread *) 0) && (currentWorker != (Worker *) 0)) pool.blocking();
+    pthread_mutex_lock(&mutex);
+    __atomic_add_fetch(&receiversWaiting, 1, __ATOMIC_SEQ_CST);
+    got = dequeue(tv);
+    if(! got && ! __atomic_load_n(&closed, __ATOMIC_ACQUIRE)) {
+      if(g != (GreenThread *) 0) waitGreen(&greenReceivers, g);
+      else pthread_cond_wait(&notEmpty, &mutex);
+    }
+    __atomic_sub_fetch(&receiversWaiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&mutex);
+    if((g == (GreenThread *) 0) && (currentWorker != (Worker *) 0)) pool.unblocking();
+    if(got) {
+      wake(&notFull, &sendersWaiting, &greenSenders);
+      return true;
+    }
   }
+}
 
-  if(name[0] == 0) {
-    try {
-      no = o->getNumber(getLexInfo(), ee);
-      if(no->isInt()) { sprintf(fmt, "%%%sd", PCTD); sprintf(name, fmt, no->getInt()); }
-      else sprintf(name, "%0.3f", no->getDouble());
-      no->release(getLexInfo());
-    } catch(Exception *e) { }
+void Channel::close() {
+  GreenThread *g;
+
+  pthread_mutex_lock(&mutex);
+  __atomic_store_n(&closed, true, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&notFull);
+  pthread_cond_broadcast(&notEmpty);
+  while((g = greenSenders.remove()) != (GreenThread *) 0) g->carrier->wake(g);
+  while((g = greenReceivers.remove()) != (GreenThread *) 0) g->carrier->wake(g);
+  pthread_mutex_unlock(&mutex);
+}
+
+bool Channel::isClosed() { return __atomic_load_n(&closed, __ATOMIC_ACQUIRE); }
+
+static Channel *findChannel(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
+
+  h = o->getHandle(li, ee);
+  if(! h->isType(channelType)) {
+    h->release(li);
+    slexception.chuck("channel not found", li);
   }
 
-  if(name[0] == 0) slexception.chuck("Unknown argument type", getLexInfo());
+  return (Channel *) h;
+}
 
-  sprintf(mutexName, "/%s/mutex/thread", name);
-  if(strlen(mutexName) > 63) {
-    sprintf(threadMessage, "Mutex name %s too long", name);
-    slexception.chuck(threadMessage, getLexInfo());
+ThreadChannel::ThreadChannel(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn ThreadChannel::action(ExecutionEnvironment *ee) {
+  Object *o1;
+  Object *o2;
+  Number *n;
+  Channel *ch;
+  TaskValue tv;
+  INT size;
+  bool ok;
+
+  o1 = ee->stack.pop(getLexInfo());
+
+  if(function == CHANNEL_CREATE) {
+    n = o1->getNumber(getLexInfo(), ee);
+    size = n->getInt();
+    n->release(getLexInfo());
+    o1->release(getLexInfo());
+    if(size < 1) slexception.chuck("a channel needs room for at least one value", getLexInfo());
+    ee->stack.push(new Channel(size, &ee->cache));
+    return or_continue;
   }
-  mutex = new pthread_mutex_t;
-  pthread_mutex_init(mutex, NULL);
-  v = btree.findVariable(mutexName);
-  if(v != (Variable *) 0) {
-    sprintf(threadMessage, "Mutex %s already exists", name);
-    slexception.chuck("Name already exists", getLexInfo());
+
+  ch = findChannel(o1, getLexInfo(), ee);
+
+  switch(function) {
+    case CHANNEL_SEND:
+    case CHANNEL_TRYSEND:
+      o2 = ee->stack.pop(getLexInfo());
+      if(! takeValue(o2, &tv, ee)) {
+        ch->release(getLexInfo());
+        slexception.chuck("value not found", getLexInfo());
+      }
+      o2->release(getLexInfo());
+      try {
+        if(function == CHANNEL_SEND) ch->send(&tv, getLexInfo());
+        else {
+          if(ch->isClosed()) slexception.chuck("channel closed", getLexInfo());
+          ok = ch->trySend(&tv);
+          if(! ok) freeValue(&tv);
+          ee->stack.push(ok ? trueValue : falseValue);
+        }
+      } catch(Exception *e) {
+        freeValue(&tv);
+        ch->release(getLexInfo());
+        e->rechuck(getLexInfo());
+      }
+      break;
+
+    case CHANNEL_RECV:
+    case CHANNEL_TRYRECV:
+      ok = (function == CHANNEL_RECV ? ch->recv(&tv) : ch->tryRecv(&tv));
+      if(ok) {
+        pushValue(&tv, ee);
+        freeValue(&tv);
+        ee->stack.push(trueValue);
+      } else ee->stack.push(falseValue);
+      break;
+
+    case CHANNEL_CLOSE:
+      ch->close();
+      break;
   }
-  v = new Variable(mutexName);
-  v->setObject(ee->cache.newNumber((INT) mutex));
-  btree.addVariable(v);
 
-  o->release(getLexInfo());
+  ch->release(getLexInfo());
+  o1->release(getLexInfo());
 
   return or_continue;
 }
 
-ThreadLock::ThreadLock(LexInfo *li) : Operation(li) { }
+Atomic::Atomic(INT i, Cache *cache) : Handle(atomicType, cache), value(i) { }
 
-OperatorReturn ThreadLock::action(ExecutionEnvironment *ee) {
-  Object *o;
-  Name *n;
-  Number *no;
-  String *s;
-  Variable *v;
-  char *str;
-  char fmt[16];
-  char name[512];
-  char mutexName[1024];
-  pthread_mutex_t *mutex;
+INT Atomic::load() { return __atomic_load_n(&value, __ATOMIC_SEQ_CST); }
 
-  o = ee->stack.pop(getLexInfo());
+void Atomic::add(INT i) { __atomic_add_fetch(&value, i, __ATOMIC_SEQ_CST); }
 
-  name[0] = 0;
+INT Atomic::exchange(INT i) { return __atomic_exchange_n(&value, i, __ATOMIC_SEQ_CST); }
 
-  try {
-    n = o->getName(getLexInfo(), ee);
-    str = n->getValue();
-    strcpy(name, str + (str[0] == '/' ? 1 : 0));
-  } catch(Exception *e) { }
+bool Atomic::compareExchange(INT expected, INT desired) {
+  return __atomic_compare_exchange_n(&value, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
 
-  if(name[0] == 0) {
-    try {
-      s = o->getString(getLexInfo(), ee);
-      strcpy(name, s->getValue());
-      s->release(getLexInfo());
-    } catch(Exception *e) { }
-  }
+static Atomic *findAtomic(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Handle *h;
 
-  if(name[0] == 0) {
-    try {
-      no = o->getNumber(getLexInfo(), ee);
-      if(no->isInt()) { sprintf(fmt, "%%%sd", PCTD); sprintf(name, fmt, no->getInt()); }
-      else sprintf(name, "%0.3f", no->getDouble());
-      no->release(getLexInfo());
-    } catch(Exception *e) { }
+  h = o->getHandle(li, ee);
+  if(! h->isType(atomicType)) {
+    h->release(li);
+    slexception.chuck("atomic integer not found", li);
   }
 
-  if(name[0] == 0) slexception.chuck("Unknown argument type", getLexInfo());
+  return (Atomic *) h;
+}
 
-  sprintf(mutexName, "/%s/mutex/thread", name);
-  if(strlen(mutexName) > 63) {
-    sprintf(threadMessage, "Mutex name %s too long", name);
-    slexception.chuck(threadMessage, getLexInfo());
-  }
-  v = btree.findVariable(mutexName);
-  if(v == (Variable *) 0) {
-    sprintf(threadMessage, "Mutex %s not found", name);
-    slexception.chuck(threadMessage, getLexInfo());
+static INT atomicArgument(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  Number *n;
+  INT i;
+
+  n = o->getNumber(li, ee);
+  if(! n->isInt()) {
+    n->release(li);
+    slexception.chuck("atomic integers only hold integers", li);
   }
-  no = v->getObject()->getNumber(getLexInfo(), ee);
-  pthread_mutex_lock((pthread_mutex_t *) no->getInt());
-  no->release(getLexInfo());
+  i = n->getInt();
+  n->release(li);
 
-  o->release(getLexInfo());
+  return i;
+}
 
-  return or_continue;
+// As atomicArgument, for an object popped off the stack that has to be
+// released once its value has been read.
+static INT takeAtomicArgument(Object *o, LexInfo *li, ExecutionEnvironment *ee) {
+  INT i;
+
+  try {
+    i = atomicArgument(o, li, ee);
+  } catch(Exception *e) {
+    o->release(li);
+    e->rechuck(li);
+  }
+  o->release(li);
+
+  return i;
 }
 
-ThreadUnlock::ThreadUnlock(LexInfo *li) : Operation(li) { }
+ThreadAtomic::ThreadAtomic(int f, LexInfo *li) : Operation(li), function(f) { }
 
-OperatorReturn ThreadUnlock::action(ExecutionEnvironment *ee) {
+OperatorReturn ThreadAtomic::action(ExecutionEnvironment *ee) {
   Object *o;
   Name *n;
-  Number *no;
-  String *s;
   Variable *v;
-  char *str;
-  char fmt[16];
-  char name[512];
-  char mutexName[1024];
-  pthread_mutex_t *mutex;
-
-  o = ee->stack.pop(getLexInfo());
+  Atomic *a;
+  INT arg1;
+  INT arg2;
+  bool ok;
 
-  name[0] = 0;
-
-  try {
-    n = o->getName(getLexInfo(), ee);
-    str = n->getValue();
-    strcpy(name, str + (str[0] == '/' ? 1 : 0));
-  } catch(Exception *e) { }
+  if(function == ATOMIC_CREATE) {
+    o = ee->stack.pop(getLexInfo());
 
-  if(name[0] == 0) {
+    // A variable holding a number becomes an atomic integer in place, so
+    // globals that threads share can be made atomic where they're declared.
+    v = (Variable *) 0;
     try {
-      s = o->getString(getLexInfo(), ee);
-      strcpy(name, s->getValue());
-      s->release(getLexInfo());
+      n = o->getName(getLexInfo(), ee);
+      v = n->findVariable(ee);
     } catch(Exception *e) { }
-  }
 
-  if(name[0] == 0) {
-    try {
-      no = o->getNumber(getLexInfo(), ee);
-      if(no->isInt()) { sprintf(fmt, "%%%sd", PCTD); sprintf(name, fmt, no->getInt()); }
-      else sprintf(name, "%0.3f", no->getDouble());
-      no->release(getLexInfo());
-    } catch(Exception *e) { }
+    if(v != (Variable *) 0) {
+      a = new Atomic(atomicArgument(v->getObject(), getLexInfo(), ee), &ee->cache);
+      v->setObject(a);
+      a->release(getLexInfo());
+      o->release(getLexInfo());
+    } else ee->stack.push(new Atomic(takeAtomicArgument(o, getLexInfo(), ee), &ee->cache));
+
+    return or_continue;
   }
 
-  if(name[0] == 0) slexception.chuck("Unknown argument type", getLexInfo());
+  arg1 = arg2 = 0;
+  if(function == ATOMIC_CAS) arg2 = takeAtomicArgument(ee->stack.pop(getLexInfo()), getLexInfo(), ee);
+  if(function != ATOMIC_LOAD) arg1 = takeAtomicArgument(ee->stack.pop(getLexInfo()), getLexInfo(), ee);
 
-  sprintf(mutexName, "/%s/mutex/thread", name);
-  if(strlen(mutexName) > 63) {
-    sprintf(threadMessage, "Mutex name %s too long", name);
-    slexception.chuck(threadMessage, getLexInfo());
-  }
-  v = btree.findVariable(mutexName);
-  if(v == (Variable *) 0) {
-    sprintf(threadMessage, "Mutex %s not found", name);
-    slexception.chuck(threadMessage, getLexInfo());
+  o = ee->stack.pop(getLexInfo());
+  a = findAtomic(o, getLexInfo(), ee);
+
+  switch(function) {
+    case ATOMIC_ADD:
+      a->add(arg1);
+      break;
+
+    case ATOMIC_SUB:
+      a->add(-arg1);
+      break;
+
+    case ATOMIC_CAS:
+      ok = a->compareExchange(arg1, arg2);
+      ee->stack.push(ok ? trueValue : falseValue);
+      break;
+
+    case ATOMIC_EXCHANGE:
+      ee->stack.push(ee->cache.newNumber(a->exchange(arg1)));
+      break;
+
+    case ATOMIC_LOAD:
+      ee->stack.push(ee->cache.newNumber(a->load()));
+      break;
   }
-  no = v->getObject()->getNumber(getLexInfo(), ee);
-  pthread_mutex_unlock((pthread_mutex_t *) no->getInt());
-  no->release(getLexInfo());
 
+  a->release(getLexInfo());
   o->release(getLexInfo());
 
   return or_continue;
 }
 
-ThreadSemaphore::ThreadSemaphore(LexInfo *li) : Operation(li) { }
+// Green threads
+
+#ifdef GREEN_SWITCH
+// Push the registers a function has to preserve and the floating point
+// control words, save the stack pointer in *from, then switch to the stack at
+// to and pop the same from it.
+extern "C" void shaleGreenSwitch(void **, void *);
+
+__asm__(
+  ".text\n"
+  ".globl shaleGreenSwitch\n"
+  ".hidden shaleGreenSwitch\n"
+  ".type shaleGreenSwitch, @function\n"
+  "shaleGreenSwitch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size shaleGreenSwitch, .-shaleGreenSwitch\n"
+);
+#endif
+
+static void greenEntry();
+
+// A new green thread's stack looks like it's switched away just before
+// calling greenEntry(), with the default floating point control words.
+static void greenInit(GreenContext *c, char *stack, size_t size) {
+#ifdef GREEN_SWITCH
+  void **sp;
+  int i;
+
+  sp = (void **) ((unsigned long) (stack + size) & ~15UL);
+  *--sp = (void *) 0;
+  *--sp = (void *) greenEntry;
+  for(i = 0; i < 6; i++) *--sp = (void *) 0;
+  *--sp = (void *) 0x0000037f00001f80UL;
+  c->sp = (void *) sp;
+#else
+  getcontext(&c->uc);
+  c->uc.uc_stack.ss_sp = stack;
+  c->uc.uc_stack.ss_size = size;
+  c->uc.uc_link = (ucontext_t *) 0;
+  makecontext(&c->uc, greenEntry, 0);
+#endif
+}
 
-OperatorReturn ThreadSemaphore::action(ExecutionEnvironment *ee) {
-  Object *o;
-  Name *n;
-  Number *no;
-  String *s;
-  Variable *v;
-  char *str;
-  char fmt[16];
-  char name[512];
-  char semName[1024];
-  char externalName[1024];
-  sem_t *sem;
-  char *p;
+static void greenSwap(GreenContext *from, GreenContext *to) {
+#ifdef GREEN_SWITCH
+  shaleGreenSwitch(&from->sp, to->sp);
+#else
+  swapcontext(&from->uc, &to->uc);
+#endif
+}
 
-  o = ee->stack.pop(getLexInfo());
+// The environment is left clean for the next green thread, as a worker's is
+// between tasks.
+static void greenEntry() {
+  GreenThread *g;
+  ExecutionEnvironment *ee;
+
+  g = currentGreen;
+  if(g->ee == (ExecutionEnvironment *) 0) g->ee = new ExecutionEnvironment;
+  ee = g->ee;
+  if(g->arg != (Object *) 0) {
+    g->arg->cache = &ee->cache;
+    ee->stack.push(g->arg);
+  }
 
-  name[0] = 0;
+  try {
+    g->code->action(ee);
+  } catch(Exception *e) { e->printError(); }
 
   try {
-    n = o->getName(getLexInfo(), ee);
-    str = n->getValue();
-    strcpy(name, str + (str[0] == '/' ? 1 : 0));
-  } catch(Exception *e) { }
+    g->code->release((LexInfo *) 0);
+    while(ee->stack.getStack() != (StackItem *) 0) ee->stack.pop((LexInfo *) 0)->release((LexInfo *) 0);
+  } catch(Exception *e) { e->printError(); }
+  while(! ee->variableStack.isEmpty()) ee->variableStack.popVariableStack();
 
-  if(name[0] == 0) {
-    try {
-      s = o->getString(getLexInfo(), ee);
-      strcpy(name, s->getValue());
-      s->release(getLexInfo());
-    } catch(Exception *e) { }
-  }
+  g->carrier->finish();
+}
 
-  if(name[0] == 0) {
-    try {
-      no = o->getNumber(getLexInfo(), ee);
-      if(no->isInt()) { sprintf(fmt, "%%%sd", PCTD); sprintf(name, fmt, no->getInt()); }
-      else sprintf(name, "%0.3f", no->getDouble());
-      no->release(getLexInfo());
-    } catch(Exception *e) { }
-  }
+static void *carrierThread(void *arg) {
+  ((GreenCarrier *) arg)->run();
+  return (void *) 0;
+}
 
-  if(name[0] == 0) slexception.chuck("Unknown argument type", getLexInfo());
+static bool greenBefore(struct timespec *a, struct timespec *b) {
+  return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
 
-  sprintf(semName, "/%s/semaphore/thread", name);
-  if(strlen(semName) > 63) {
-    sprintf(threadMessage, "Semaphore name %s too long", name);
-    slexception.chuck(threadMessage, getLexInfo());
-  }
-  sprintf(externalName, "/shale.%s", name);
-  for(p = externalName; *p != 0; p++) {
-    if(*p == '/') *p = '_';
+// GreenWaiters class
+
+GreenWaiters::GreenWaiters() : head((GreenThread *) 0), tail((GreenThread *) 0) { }
+
+void GreenWaiters::add(GreenThread *g) {
+  g->waiting = true;
+  g->waitNext = (GreenThread *) 0;
+  if(tail == (GreenThread *) 0) head = g;
+  else tail->waitNext = g;
+  tail = g;
+}
+
+GreenThread *GreenWaiters::remove() {
+  GreenThread *g;
+
+  if((g = head) != (GreenThread *) 0) {
+    head = g->waitNext;
+    if(head == (GreenThread *) 0) tail = (GreenThread *) 0;
+    g->waiting = false;
   }
-  v = btree.findVariable(semName);
-  if(v != (Variable *) 0) {
-    sprintf(threadMessage, "Semaphore %s already exists", name);
-    slexception.chuck(threadMessage, getLexInfo());
+
+  return g;
+}
+
+// The first green thread waiting on an address, taken out.
+GreenThread *GreenWaiters::remove(int *address) {
+  GreenThread *prev;
+  GreenThread *g;
+
+  prev = (GreenThread *) 0;
+  for(g = head; (g != (GreenThread *) 0) && (g->waitAddress != address); g = g->waitNext) prev = g;
+  if(g != (GreenThread *) 0) {
+    if(prev == (GreenThread *) 0) head = g->waitNext;
+    else prev->waitNext = g->waitNext;
+    if(tail == g) tail = prev;
+    g->waiting = false;
   }
-  sem_unlink(externalName);
-  if((sem = sem_open(externalName, O_CREAT | O_EXCL, 0666, 0)) == SEM_FAILED) slexception.chuck("Can't create semaphore", getLexInfo());
-  v = new Variable(semName);
-  v->setObject(ee->cache.newNumber((INT) sem));
-  btree.addVariable(v);
 
-  o->release(getLexInfo());
+  return g;
+}
 
-  return or_continue;
+// Take out a green thread that stopped waiting without being removed, after a
+// spurious wakeup.
+void GreenWaiters::remove(GreenThread *g) {
+  GreenThread *prev;
+  GreenThread *p;
+
+  if(! g->waiting) return;
+  prev = (GreenThread *) 0;
+  for(p = head; p != g; p = p->waitNext) prev = p;
+  if(prev == (GreenThread *) 0) head = g->waitNext;
+  else prev->waitNext = g->waitNext;
+  if(tail == g) tail = prev;
+  g->waiting = false;
 }
 
-ThreadWait::ThreadWait(LexInfo *li) : Operation(li) { }
+// GreenCarrier class
 
-OperatorReturn ThreadWait::action(ExecutionEnvironment *ee) {
-  Object *o;
-  Name *n;
-  Number *no;
-  String *s;
-  Variable *v;
-  char *str;
-  char fmt[16];
-  char name[512];
-  char semName[1024];
-  sem_t *sem;
+static GreenCarrier greenCarriers[GREEN_MAX_CARRIERS];
+static unsigned long greenNext = 0;
 
-  o = ee->stack.pop(getLexInfo());
+// Green threads are dealt out to the carriers in turn, with up to one carrier
+// per processor.
+static GreenCarrier *nextCarrier() {
+  int n;
 
-  name[0] = 0;
+  n = pool.getBaseWorkers();
+  if(n > GREEN_MAX_CARRIERS) n = GREEN_MAX_CARRIERS;
 
-  try {
-    n = o->getName(getLexInfo(), ee);
-    str = n->getValue();
-    strcpy(name, str + (str[0] == '/' ? 1 : 0));
-  } catch(Exception *e) { }
+  return &greenCarriers[__atomic_fetch_add(&greenNext, 1, __ATOMIC_RELAXED) % n];
+}
 
-  if(name[0] == 0) {
-    try {
-      s = o->getString(getLexInfo(), ee);
-      strcpy(name, s->getValue());
-      s->release(getLexInfo());
-    } catch(Exception *e) { }
-  }
+GreenCarrier::GreenCarrier() : runHead((GreenThread *) 0), runTail((GreenThread *) 0), spare((GreenThread *) 0), sleepers((GreenThread **) 0), sleeperCount(0), sleeperSize(0), started(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&wakeup, NULL);
+}
 
-  if(name[0] == 0) {
-    try {
-      no = o->getNumber(getLexInfo(), ee);
-      if(no->isInt()) { sprintf(fmt, "%%%sd", PCTD); sprintf(name, fmt, no->getInt()); }
-      else sprintf(name, "%0.3f", no->getDouble());
-      no->release(getLexInfo());
-    } catch(Exception *e) { }
+// A new green thread's stack has an inaccessible page below it, so running
+// off the end faults rather than writing over something else.
+void GreenCarrier::start(Code *code, Object *arg, LexInfo *li) {
+  pthread_t thread;
+  pthread_attr_t attr;
+  GreenThread *g;
+  char *stack;
+  long page;
+
+  pthread_mutex_lock(&mutex);
+  if((g = spare) != (GreenThread *) 0) spare = g->next;
+  pthread_mutex_unlock(&mutex);
+
+  page = sysconf(_SC_PAGESIZE);
+  if(g == (GreenThread *) 0) {
+    stack = (char *) mmap((void *) 0, GREEN_STACK_SIZE + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if(stack == (char *) MAP_FAILED) slexception.chuck("Can't create thread", li);
+    mprotect(stack, page, PROT_NONE);
+    g = new GreenThread;
+    g->stack = stack;
+    g->ee = (ExecutionEnvironment *) 0;
+    g->carrier = this;
   }
+  g->code = code;
+  g->arg = arg;
+  g->woken = false;
+  g->waiting = false;
+  greenInit(&g->context, g->stack + page, GREEN_STACK_SIZE);
+
+  pthread_mutex_lock(&mutex);
+  if(! started) {
+    if((pthread_attr_init(&attr) != 0) || (pthread_attr_setstacksize(&attr, 64 * 1024) != 0) || (pthread_create(&thread, &attr, carrierThread, this) != 0)) {
+      g->next = spare;
+      spare = g;
+      pthread_mutex_unlock(&mutex);
+      slexception.chuck("Can't create thread", li);
+    }
+    pthread_detach(thread);
+    started = true;
+  }
+  enqueue(g);
+  pthread_cond_signal(&wakeup);
+  pthread_mutex_unlock(&mutex);
+}
 
-  if(name[0] == 0) slexception.chuck("Unknown argument type", getLexInfo());
+// Called with the mutex held.
+void GreenCarrier::enqueue(GreenThread *g) {
+  g->state = GREEN_RUNNABLE;
+  g->next = (GreenThread *) 0;
+  if(runTail == (GreenThread *) 0) runHead = g;
+  else runTail->next = g;
+  runTail = g;
+}
 
-  sprintf(semName, "/%s/semaphore/thread", name);
-  if(strlen(semName) > 63) {
-    sprintf(threadMessage, "Semaphore name %s too long", name);
-    slexception.chuck(threadMessage, getLexInfo());
-  }
-  v = btree.findVariable(semName);
-  if(v == (Variable *) 0) {
-    sprintf(threadMessage, "Semaphore %s not found", name);
-    slexception.chuck(threadMessage, getLexInfo());
+// Sleepers are a heap ordered by wake time. There's always room, since
+// sleep() makes it before a green thread stops to sleep.
+void GreenCarrier::addSleeper(GreenThread *g) {
+  int i;
+  int parent;
+
+  for(i = sleeperCount++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if(! greenBefore(&g->wakeAt, &sleepers[parent]->wakeAt)) break;
+    sleepers[i] = sleepers[parent];
   }
-  no = v->getObject()->getNumber(getLexInfo(), ee);
-  sem_wait((sem_t *) no->getInt());
-  no->release(getLexInfo());
+  sleepers[i] = g;
+}
 
-  o->release(getLexInfo());
+GreenThread *GreenCarrier::removeSleeper() {
+  GreenThread *first;
+  GreenThread *last;
+  int i;
+  int child;
+
+  first = sleepers[0];
+  last = sleepers[--sleeperCount];
+  for(i = 0; (child = 2 * i + 1) < sleeperCount; i = child) {
+    if((child + 1 < sleeperCount) && greenBefore(&sleepers[child + 1]->wakeAt, &sleepers[child]->wakeAt)) child++;
+    if(! greenBefore(&sleepers[child]->wakeAt, &last->wakeAt)) break;
+    sleepers[i] = sleepers[child];
+  }
+  if(sleeperCount > 0) sleepers[i] = last;
 
-  return or_continue;
+  return first;
 }
 
-ThreadPost::ThreadPost(LexInfo *li) : Operation(li) { }
+// A green thread takes the mutex before switching back here and the carrier
+// lets it go before switching to the next one, so a green thread can't be
+// woken between saying it's waiting and having stopped.
+void GreenCarrier::run() {
+  GreenThread *g;
+  struct timespec now;
+
+  pthread_mutex_lock(&mutex);
+  for(;;) {
+    if(sleeperCount > 0) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      while((sleeperCount > 0) && ! greenBefore(&now, &sleepers[0]->wakeAt)) enqueue(removeSleeper());
+    }
+    if((g = runHead) == (GreenThread *) 0) {
+      if(sleeperCount > 0) pthread_cond_timedwait(&wakeup, &mutex, &sleepers[0]->wakeAt);
+      else pthread_cond_wait(&wakeup, &mutex);
+      continue;
+    }
+    runHead = g->next;
+    if(runHead == (GreenThread *) 0) runTail = (GreenThread *) 0;
+    g->state = GREEN_RUNNING;
+    pthread_mutex_unlock(&mutex);
+
+    currentGreen = g;
+    greenSwap(&context, &g->context);
+    currentGreen = (GreenThread *) 0;
+
+    switch(g->state) {
+      case GREEN_YIELDING:
+        enqueue(g);
+        break;
+
+      case GREEN_SLEEPING:
+        addSleeper(g);
+        break;
+
+      case GREEN_DONE:
+        g->next = spare;
+        spare = g;
+        break;
+    }
+  }
+}
 
-OperatorReturn ThreadPost::action(ExecutionEnvironment *ee) {
-  Object *o;
-  Name *n;
-  Number *no;
-  String *s;
-  Variable *v;
-  char *str;
-  char fmt[16];
-  char name[512];
-  char semName[1024];
-  sem_t *sem;
+void GreenCarrier::yield() {
+  GreenThread *g;
 
-  o = ee->stack.pop(getLexInfo());
+  g = currentGreen;
+  pthread_mutex_lock(&mutex);
+  g->state = GREEN_YIELDING;
+  greenSwap(&g->context, &context);
+}
 
-  name[0] = 0;
+void GreenCarrier::sleep(INT ms, LexInfo *li) {
+  GreenThread *g;
+  GreenThread **s;
+  struct timespec ts;
 
-  try {
-    n = o->getName(getLexInfo(), ee);
-    str = n->getValue();
-    strcpy(name, str + (str[0] == '/' ? 1 : 0));
-  } catch(Exception *e) { }
+  if(ms <= 0) {
+    yield();
+    return;
+  }
 
-  if(name[0] == 0) {
-    try {
-      s = o->getString(getLexInfo(), ee);
-      strcpy(name, s->getValue());
-      s->release(getLexInfo());
-    } catch(Exception *e) { }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (ms % 1000) * 1000000;
+  if(ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+
+  g = currentGreen;
+  pthread_mutex_lock(&mutex);
+  if(sleeperCount == sleeperSize) {
+    if((s = (GreenThread **) realloc(sleepers, (sleeperSize + 64) * sizeof(GreenThread *))) == (GreenThread **) 0) {
+      pthread_mutex_unlock(&mutex);
+      slexception.chuck("malloc error", li);
+    }
+    sleepers = s;
+    sleeperSize += 64;
   }
+  g->wakeAt = ts;
+  g->state = GREEN_SLEEPING;
+  greenSwap(&g->context, &context);
+}
 
-  if(name[0] == 0) {
-    try {
-      no = o->getNumber(getLexInfo(), ee);
-      if(no->isInt()) { sprintf(fmt, "%%%sd", PCTD); sprintf(name, fmt, no->getInt()); }
-      else sprintf(name, "%0.3f", no->getDouble());
-      no->release(getLexInfo());
-    } catch(Exception *e) { }
+// A wake that comes before the green thread has parked isn't lost, it stops
+// the park. Parking can return without a wake, so callers check again.
+void GreenCarrier::park() {
+  GreenThread *g;
+
+  g = currentGreen;
+  pthread_mutex_lock(&mutex);
+  if(g->woken) {
+    g->woken = false;
+    pthread_mutex_unlock(&mutex);
+    return;
   }
+  g->state = GREEN_PARKED;
+  greenSwap(&g->context, &context);
+}
 
-  if(name[0] == 0) slexception.chuck("Unknown argument type", getLexInfo());
+void GreenCarrier::wake(GreenThread *g) {
+  pthread_mutex_lock(&mutex);
+  if(g->state == GREEN_PARKED) {
+    enqueue(g);
+    pthread_cond_signal(&wakeup);
+  } else g->woken = true;
+  pthread_mutex_unlock(&mutex);
+}
 
-  sprintf(semName, "/%s/semaphore/thread", name);
-  if(strlen(semName) > 63) {
-    sprintf(threadMessage, "Semaphore name %s too long", name);
-    slexception.chuck(threadMessage, getLexInfo());
-  }
-  v = btree.findVariable(semName);
-  if(v == (Variable *) 0) {
-    sprintf(threadMessage, "Semaphore %s not found", name);
-    slexception.chuck(threadMessage, getLexInfo());
-  }
-  no = v->getObject()->getNumber(getLexInfo(), ee);
-  sem_post((sem_t *) no->getInt());
-  no->release(getLexInfo());
+void GreenCarrier::finish() {
+  GreenThread *g;
 
-  o->release(getLexInfo());
+  g = currentGreen;
+  pthread_mutex_lock(&mutex);
+  g->state = GREEN_DONE;
+  greenSwap(&g->context, &context);
+}
+
+ThreadGo::ThreadGo(int f, LexInfo *li) : Operation(li), function(f) { }
+
+OperatorReturn ThreadGo::action(ExecutionEnvironment *ee) {
+  Object *o;
+  Object *arg;
+  Number *n;
+  Code *code;
+  INT ms;
+
+  switch(function) {
+    case GO_START:
+      o = ee->stack.pop(getLexInfo());
+      o->allocateMutex();
+      code = o->getCode(getLexInfo(), ee);
+      arg = ee->stack.pop(getLexInfo());
+      arg->hold();
+      arg->allocateMutex();
+      try {
+        nextCarrier()->start(code, arg, getLexInfo());
+      } catch(Exception *e) {
+        code->release(getLexInfo());
+        arg->release(getLexInfo());
+        o->release(getLexInfo());
+        e->rechuck(getLexInfo());
+      }
+      o->release(getLexInfo());
+      break;
+
+    case GO_YIELD:
+      if(currentGreen != (GreenThread *) 0) currentGreen->carrier->yield();
+      else sched_yield();
+      break;
+
+    case GO_SLEEP:
+      o = ee->stack.pop(getLexInfo());
+      n = o->getNumber(getLexInfo(), ee);
+      ms = n->getInt();
+      n->release(getLexInfo());
+      o->release(getLexInfo());
+      if(currentGreen != (GreenThread *) 0) currentGreen->carrier->sleep(ms, getLexInfo());
+      else if(ms > 0) {
+        if(currentWorker != (Worker *) 0) pool.blocking();
+        usleep(ms * 1000);
+        if(currentWorker != (Worker *) 0) pool.unblocking();
+      }
+      break;
+  }
 
   return or_continue;
 }